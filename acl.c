@@ -0,0 +1,375 @@
+#include "acl.h"
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include "alloc.h"
+#include "log/log.h"
+
+// ---- domain-suffix trie ----------------------------------------------
+//
+// Domains are inserted reversed, one node per character, so matching a
+// host walks it back to front and the deepest terminal node passed on a
+// label boundary is the longest matching suffix. Children are indexed by
+// a compact alphabet (letters fold to lower case), nodes live in one
+// growable arena and reference each other by index, so the whole trie is
+// two allocations and lookups touch no allocator at all.
+
+#define ACL_ALPHA 39  // a-z, 0-9, '-', '.', '_'
+
+typedef struct {
+  int32_t child[ACL_ALPHA];  // 0 = no child (node 0 is the root)
+  int8_t action;             // -1 = not a terminal, else AclAction
+} AclTrieNode;
+
+static AclTrieNode *g_trie;
+static int g_trie_len;
+static int g_trie_cap;
+
+static int g_acl_loaded;
+static AclAction g_default_action = ACL_PROXY;
+
+static int char_index(int c) {
+  c = tolower(c);
+  if (c >= 'a' && c <= 'z') {
+    return c - 'a';
+  }
+  if (c >= '0' && c <= '9') {
+    return 26 + c - '0';
+  }
+  switch (c) {
+    case '-': return 36;
+    case '.': return 37;
+    case '_': return 38;
+  }
+  return -1;
+}
+
+static int trie_node_new() {
+  if (g_trie_len == g_trie_cap) {
+    g_trie_cap = g_trie_cap == 0 ? 256 : g_trie_cap * 2;
+    g_trie = lrealloc(g_trie, g_trie_cap * sizeof(AclTrieNode));
+  }
+  memset(&g_trie[g_trie_len], 0, sizeof(AclTrieNode));
+  g_trie[g_trie_len].action = -1;
+  return g_trie_len++;
+}
+
+static int trie_insert(const char *domain, AclAction action) {
+  int node = 0;
+  for (int i = (int)strlen(domain) - 1; i >= 0; --i) {
+    int ci = char_index((unsigned char)domain[i]);
+    if (ci < 0) {
+      return -1;
+    }
+    if (g_trie[node].child[ci] == 0) {
+      int fresh = trie_node_new();  // may move the arena
+      g_trie[node].child[ci] = fresh;
+    }
+    node = g_trie[node].child[ci];
+  }
+  g_trie[node].action = (int8_t)action;
+  return 0;
+}
+
+// ---- CIDR tables ------------------------------------------------------
+//
+// IPv4 rules are flattened at load time into disjoint segments (each
+// boundary gets the action of the longest prefix covering it), so a
+// lookup is one binary search regardless of how the rules nest. IPv6
+// rules are rare in practice and stay a linear masked-compare scan,
+// longest prefix wins.
+
+typedef struct {
+  uint32_t start;  // host byte order
+  uint32_t end;    // inclusive
+  int prefix;
+  AclAction action;
+} V4Rule;
+
+typedef struct {
+  uint32_t start;  // first address of the segment, host byte order
+  int8_t action;   // -1 = no rule covers this segment
+} V4Seg;
+
+typedef struct {
+  unsigned char addr[16];
+  int prefix;
+  AclAction action;
+} V6Rule;
+
+static V4Rule *g_v4_rules;
+static int g_v4_rule_len;
+static int g_v4_rule_cap;
+
+static V4Seg *g_v4_segs;
+static int g_v4_seg_len;
+
+static V6Rule *g_v6_rules;
+static int g_v6_rule_len;
+static int g_v6_rule_cap;
+
+static void v4_rule_add(uint32_t net, int prefix, AclAction action) {
+  if (g_v4_rule_len == g_v4_rule_cap) {
+    g_v4_rule_cap = g_v4_rule_cap == 0 ? 64 : g_v4_rule_cap * 2;
+    g_v4_rules = lrealloc(g_v4_rules, g_v4_rule_cap * sizeof(V4Rule));
+  }
+  uint32_t mask = prefix == 0 ? 0 : 0xffffffffu << (32 - prefix);
+  V4Rule *r = &g_v4_rules[g_v4_rule_len++];
+  r->start = net & mask;
+  r->end = r->start | ~mask;
+  r->prefix = prefix;
+  r->action = action;
+}
+
+static void v6_rule_add(const unsigned char *addr, int prefix,
+    AclAction action) {
+  if (g_v6_rule_len == g_v6_rule_cap) {
+    g_v6_rule_cap = g_v6_rule_cap == 0 ? 16 : g_v6_rule_cap * 2;
+    g_v6_rules = lrealloc(g_v6_rules, g_v6_rule_cap * sizeof(V6Rule));
+  }
+  V6Rule *r = &g_v6_rules[g_v6_rule_len++];
+  memcpy(r->addr, addr, 16);
+  r->prefix = prefix;
+  r->action = action;
+}
+
+static int uint64_cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// every rule start and one-past-end is a potential action change; probe
+// each boundary against all rules for the longest covering prefix. The
+// quadratic load cost is fine for rule lists (a one-off ~10ms for the
+// usual few thousand entries), lookups stay a single binary search.
+static void v4_build_segments() {
+  if (g_v4_rule_len == 0) {
+    return;
+  }
+  int nbounds = 0;
+  uint64_t *bounds = lmalloc((2 * g_v4_rule_len) * sizeof(uint64_t));
+  for (int i = 0; i < g_v4_rule_len; ++i) {
+    bounds[nbounds++] = g_v4_rules[i].start;
+    bounds[nbounds++] = (uint64_t)g_v4_rules[i].end + 1;
+  }
+  qsort(bounds, nbounds, sizeof(uint64_t), uint64_cmp);
+
+  g_v4_segs = lmalloc((nbounds + 1) * sizeof(V4Seg));
+  g_v4_seg_len = 0;
+  int8_t last_action = -2;  // forces the first segment to be emitted
+  for (int b = -1; b < nbounds; ++b) {
+    uint64_t pos = b < 0 ? 0 : bounds[b];
+    if (pos > 0xffffffffu || (b >= 0 && b + 1 < nbounds &&
+          bounds[b + 1] == pos)) {
+      continue;  // past the address space, or a duplicate boundary
+    }
+    int8_t action = -1;
+    int best_prefix = -1;
+    for (int i = 0; i < g_v4_rule_len; ++i) {
+      if (g_v4_rules[i].start <= pos && pos <= g_v4_rules[i].end &&
+          g_v4_rules[i].prefix > best_prefix) {
+        best_prefix = g_v4_rules[i].prefix;
+        action = (int8_t)g_v4_rules[i].action;
+      }
+    }
+    if (action != last_action) {
+      g_v4_segs[g_v4_seg_len].start = (uint32_t)pos;
+      g_v4_segs[g_v4_seg_len].action = action;
+      ++g_v4_seg_len;
+      last_action = action;
+    }
+  }
+  free(bounds);
+}
+
+static AclAction v4_lookup(uint32_t ip) {
+  if (g_v4_seg_len == 0) {
+    return g_default_action;
+  }
+  // greatest segment start <= ip
+  int lo = 0, hi = g_v4_seg_len - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (g_v4_segs[mid].start <= ip) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  if (g_v4_segs[lo].start > ip || g_v4_segs[lo].action < 0) {
+    return g_default_action;
+  }
+  return (AclAction)g_v4_segs[lo].action;
+}
+
+static AclAction v6_lookup(const unsigned char *addr) {
+  int best_prefix = -1;
+  AclAction action = g_default_action;
+  for (int i = 0; i < g_v6_rule_len; ++i) {
+    V6Rule *r = &g_v6_rules[i];
+    if (r->prefix <= best_prefix) {
+      continue;
+    }
+    int nbytes = r->prefix / 8, nbits = r->prefix % 8;
+    if (memcmp(addr, r->addr, nbytes) != 0) {
+      continue;
+    }
+    if (nbits != 0) {
+      unsigned char mask = (unsigned char)(0xff << (8 - nbits));
+      if ((addr[nbytes] & mask) != (r->addr[nbytes] & mask)) {
+        continue;
+      }
+    }
+    best_prefix = r->prefix;
+    action = r->action;
+  }
+  return action;
+}
+
+// ---- rule file parsing ------------------------------------------------
+
+static int parse_rule_target(const char *target, AclAction action) {
+  // CIDR or bare address first, anything else is a domain suffix
+  char host[64];
+  int prefix = -1;
+  const char *slash = strchr(target, '/');
+  if (slash != NULL) {
+    if ((size_t)(slash - target) >= sizeof(host)) {
+      return -1;
+    }
+    memcpy(host, target, slash - target);
+    host[slash - target] = '\0';
+    prefix = atoi(slash + 1);
+  } else if (strlen(target) < sizeof(host)) {
+    strcpy(host, target);
+  } else {
+    host[0] = '\0';
+  }
+
+  struct in_addr a4;
+  struct in6_addr a6;
+  if (host[0] != '\0' && uv_inet_pton(AF_INET, host, &a4) == 0) {
+    if (prefix < 0) {
+      prefix = 32;
+    }
+    if (prefix > 32) {
+      return -1;
+    }
+    v4_rule_add(ntohl(a4.s_addr), prefix, action);
+    return 0;
+  }
+  if (host[0] != '\0' && uv_inet_pton(AF_INET6, host, &a6) == 0) {
+    if (prefix < 0) {
+      prefix = 128;
+    }
+    if (prefix > 128) {
+      return -1;
+    }
+    v6_rule_add((const unsigned char *)&a6, prefix, action);
+    return 0;
+  }
+  if (slash != NULL) {
+    return -1;  // a prefix length only makes sense on an address
+  }
+  return trie_insert(target, action);
+}
+
+int acl_load(const char *path) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    LOG_E("cannot open acl file: %s", path);
+    return -1;
+  }
+
+  trie_node_new();  // node 0 is the root
+
+  char line[512];
+  int lineno = 0, nrules = 0, err = 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    ++lineno;
+    char verb[16], target[256];
+    char *hash = strchr(line, '#');
+    if (hash != NULL) {
+      *hash = '\0';
+    }
+    int n = sscanf(line, "%15s %255s", verb, target);
+    if (n <= 0) {
+      continue;  // blank line
+    }
+    if (n != 2) {
+      err = 1;
+    } else if (strcmp(verb, "default") == 0) {
+      if (strcmp(target, "direct") == 0) {
+        g_default_action = ACL_DIRECT;
+      } else if (strcmp(target, "proxy") == 0) {
+        g_default_action = ACL_PROXY;
+      } else {
+        err = 1;
+      }
+    } else if (strcmp(verb, "direct") == 0) {
+      err = parse_rule_target(target, ACL_DIRECT) != 0;
+      ++nrules;
+    } else if (strcmp(verb, "proxy") == 0) {
+      err = parse_rule_target(target, ACL_PROXY) != 0;
+      ++nrules;
+    } else {
+      err = 1;
+    }
+    if (err) {
+      LOG_E("bad acl rule at %s:%d: %s", path, lineno, line);
+      fclose(f);
+      return -1;
+    }
+  }
+  fclose(f);
+
+  v4_build_segments();
+  g_acl_loaded = 1;
+  LOG_I("acl compiled: %d rules (%d trie nodes, %d v4 segments, %d v6), "
+      "default %s", nrules, g_trie_len, g_v4_seg_len, g_v6_rule_len,
+      g_default_action == ACL_DIRECT ? "direct" : "proxy");
+  return 0;
+}
+
+int acl_loaded() {
+  return g_acl_loaded;
+}
+
+AclAction acl_match_host(const char *host) {
+  // clients configured for remote name resolution send literal addresses
+  // as ATYP_DOMAIN, route those through the address tables
+  struct in_addr a4;
+  struct in6_addr a6;
+  if (uv_inet_pton(AF_INET, host, &a4) == 0) {
+    return v4_lookup(ntohl(a4.s_addr));
+  }
+  if (uv_inet_pton(AF_INET6, host, &a6) == 0) {
+    return v6_lookup((const unsigned char *)&a6);
+  }
+
+  AclAction action = g_default_action;
+  int node = 0;
+  for (int i = (int)strlen(host) - 1; i >= 0; --i) {
+    int ci = char_index((unsigned char)host[i]);
+    if (ci < 0 || g_trie[node].child[ci] == 0) {
+      return action;
+    }
+    node = g_trie[node].child[ci];
+    // a terminal only matches on a label boundary: the whole host, or a
+    // suffix starting right after a dot
+    if (g_trie[node].action >= 0 && (i == 0 || host[i - 1] == '.')) {
+      action = (AclAction)g_trie[node].action;
+    }
+  }
+  return action;
+}
+
+AclAction acl_match_addr(const struct sockaddr *sa) {
+  if (sa->sa_family == AF_INET) {
+    return v4_lookup(ntohl(((const struct sockaddr_in *)sa)->sin_addr.s_addr));
+  }
+  if (sa->sa_family == AF_INET6) {
+    return v6_lookup(((const struct sockaddr_in6 *)sa)->sin6_addr.s6_addr);
+  }
+  return g_default_action;
+}
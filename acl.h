@@ -0,0 +1,40 @@
+#ifndef ACL_H_
+#define ACL_H_
+#include <uv.h>
+
+// Rule-based split tunneling for lightning_local: a rule file is compiled
+// at startup into a domain-suffix trie plus a binary-searched CIDR table,
+// and every CONNECT consults it to decide DIRECT vs PROXY. Lookups are
+// O(length of the name) with zero allocation, they sit on the
+// connection-setup path of every session.
+//
+// Rule file format, one rule per line ('#' starts a comment):
+//
+//   direct  cdn.example.com      # the domain and any subdomain of it
+//   direct  203.0.113.0/24       # CIDR, bare addresses imply /32 (/128)
+//   proxy   ads.example.com
+//   default proxy                # action when nothing matches
+//
+// The most specific rule wins: longest domain suffix, longest CIDR
+// prefix. The default action is PROXY unless the file says otherwise.
+//
+// The compiled tables are immutable after acl_load, which runs on the
+// main thread before the workers start, so they are shared read-only and
+// need no locking.
+
+typedef enum {
+  ACL_PROXY = 0,
+  ACL_DIRECT
+} AclAction;
+
+// compiles the rule file; returns 0 on success, non-zero on a file or
+// parse error (the offending line is logged)
+int acl_load(const char *path);
+int acl_loaded();
+
+// host may be a domain name or a literal address (SOCKS clients send
+// literals as ATYP_DOMAIN when configured with remote name resolution)
+AclAction acl_match_host(const char *host);
+AclAction acl_match_addr(const struct sockaddr *sa);
+
+#endif /* end of include guard: ACL_H_ */
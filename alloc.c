@@ -2,6 +2,22 @@
 #include <stdio.h>
 #include <string.h>
 
+// keep at most this many recycled blocks per pool per thread, anything
+// beyond that goes back to the heap
+#define POOL_MAX_FREE 1024
+
+typedef struct PoolBlock {
+  struct PoolBlock *next;
+} PoolBlock;
+
+typedef struct {
+  PoolBlock *free_list;
+  size_t block_size;
+  int free_count;
+} Pool;
+
+static __thread Pool pools[POOL_KIND_MAX];
+
 void *lmalloc(size_t size) {
   void *p = malloc(size);
   memset(p, 0, size);
@@ -22,3 +38,45 @@ void *lrealloc(void *p, size_t size) {
 
   return p2;
 }
+
+void *lpool_take(PoolKind kind, size_t size) {
+  Pool *pool = &pools[kind];
+  if (pool->block_size == 0) {
+    pool->block_size = size;
+  }
+
+  // all users of one pool must agree on the block size, otherwise a
+  // recycled block may be too small for the next taker
+  if (size > pool->block_size) {
+    fprintf(stderr, "lpool_take: size %lu exceeds pool block size %lu\n",
+        size, pool->block_size);
+    exit(1);
+  }
+
+  PoolBlock *block = pool->free_list;
+  if (block != NULL) {
+    pool->free_list = block->next;
+    --pool->free_count;
+    return block;
+  }
+
+  void *p = malloc(pool->block_size);
+  if (!p) {
+    fprintf(stderr, "malloc failed for: %lu\n", pool->block_size);
+    exit(1);
+  }
+  return p;
+}
+
+void lpool_return(PoolKind kind, void *p) {
+  Pool *pool = &pools[kind];
+  if (pool->free_count >= POOL_MAX_FREE) {
+    free(p);
+    return;
+  }
+
+  PoolBlock *block = p;
+  block->next = pool->free_list;
+  pool->free_list = block;
+  ++pool->free_count;
+}
@@ -5,4 +5,28 @@
 void *lmalloc(size_t size);
 void *lrealloc(void *p, size_t size);
 
+// fixed-size object pools for the per-connection allocations on the accept
+// path (sessions and uv handles). Blocks are recycled through per-thread
+// free-lists, so in the multi-worker mode every loop keeps its own pool and
+// no locking is needed. Blocks come back from the pool NOT zeroed, callers
+// initialize the fields they use.
+typedef enum {
+  POOL_SESSION,
+  POOL_UV_TCP,
+  POOL_UV_UDP,
+  // tiered I/O buffers: sessions borrow one only while data is in flight
+  // (see the on_*_alloc callbacks), so idle sessions pin no buffer memory
+  POOL_BUF_SMALL,   // handshake-phase read buffer, SESSION_SMALL_BUFSIZ
+  POOL_BUF_LARGE,   // pipe slot buffer, tier 0, PIPE_SLOT_BUFSIZ
+  // bigger slot tiers for bulk flows; the adaptive read sizing indexes
+  // them as POOL_BUF_LARGE + tier, keep them contiguous
+  POOL_BUF_LARGE_16K,
+  POOL_BUF_LARGE_32K,
+  POOL_BUF_LARGE_64K,
+  POOL_KIND_MAX
+} PoolKind;
+
+void *lpool_take(PoolKind kind, size_t size);
+void lpool_return(PoolKind kind, void *p);
+
 #endif /* end of include guard: ALLOC_H_ */
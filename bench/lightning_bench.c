@@ -0,0 +1,496 @@
+// lightning_bench: load generator and microbenchmark harness.
+//
+// Microbenchmarks exercise the cipher and SOCKS5 parser hot paths in
+// isolation; the net mode drives real SOCKS5 CONNECT handshakes and
+// ping-pong streaming through a running lightning_local (pointed at a
+// running lightning_remote), against a loopback echo server the bench
+// hosts itself, and reports connections/sec, throughput and end-to-end
+// p50/p99 message latency.
+//
+//   lightning_bench micro
+//   lightning_bench net [-p socks_port] [-c conns] [-n msgs] [-s msgsize]
+//                       [-e echo_port]
+//
+// Typical regression run:
+//   ./bin/lightning_remote -p 18443 -c aes-256-gcm -s secret &
+//   ./bin/lightning_local -p 11080 -H 127.0.0.1 -P 18443 \
+//       -c aes-256-gcm -s secret &
+//   ./bin/lightning_bench net -p 11080
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+#include "../socks5.h"
+#include "../encrypt.h"
+#include "../util.h"
+
+#define BENCH_ECHO_PORT 18200
+#define BENCH_SOCKS_PORT 11080
+#define BENCH_CONNS 8
+#define BENCH_MSGS 200
+#define BENCH_MSGSIZE 1400
+#define BENCH_MAX_MSGSIZE 60000
+
+#define MICRO_MIN_NSEC (500 * 1000000ull)  // measure for at least 0.5s
+
+/* ---------------------------- microbenchmarks --------------------------- */
+
+static const char *micro_ciphers[] = {
+  "aes-256-cfb", "aes-256-gcm", "chacha20-poly1305", NULL
+};
+static const int micro_sizes[] = { 64, 512, 1400, 8192, 0 };
+
+static void micro_cipher_one(const char *cipher_name, int size) {
+  // headroom/tailroom as the session buffers reserve them
+  char *raw = malloc(CRYPTO_HEADROOM + size + CRYPTO_TAILROOM);
+  char *buf = raw + CRYPTO_HEADROOM;
+  memset(buf, 0xa5, size);
+
+  CipherCtx e_ctx, d_ctx;
+  if (cipher_ctx_init(&e_ctx, cipher_name, "bench-secret") != 0 ||
+      cipher_ctx_init(&d_ctx, cipher_name, "bench-secret") != 0) {
+    printf("  %-18s unavailable\n", cipher_name);
+    free(raw);
+    return;
+  }
+
+  // encrypt+decrypt roundtrip: decryption is stateful (IV consumption,
+  // nonce sequence), so the honest measurement pairs the two
+  uint64_t start = uv_hrtime();
+  uint64_t bytes = 0;
+  int iters = 0;
+  while (uv_hrtime() - start < MICRO_MIN_NSEC) {
+    for (int i = 0; i < 64; ++i) {
+      int len = size;
+      memset(buf, 0xa5, size);
+      char *enc = stream_encrypt_to(&e_ctx, buf, &len);
+      if (enc == NULL) {
+        printf("  %-18s encrypt failed\n", cipher_name);
+        goto out;
+      }
+      char *dec = stream_decrypt_to(&d_ctx, enc, &len);
+      if (dec == NULL) {
+        printf("  %-18s decrypt failed\n", cipher_name);
+        goto out;
+      }
+      bytes += size;
+      ++iters;
+    }
+  }
+  {
+    double secs = (uv_hrtime() - start) / 1e9;
+    printf("  %-18s %6d B  %8.1f MB/s roundtrip  (%.2f Gbit/s one-way)\n",
+        cipher_name, size, bytes / secs / 1e6, bytes * 8 / secs / 1e9);
+  }
+
+out:
+  cipher_ctx_destroy(&e_ctx);
+  cipher_ctx_destroy(&d_ctx);
+  free(raw);
+}
+
+static void micro_socks5(void) {
+  // CONNECT www.example.com:443, the common shape of a request
+  const char host[] = "www.example.com";
+  char req[4 + 1 + sizeof(host) - 1 + 2];
+  int req_len = 0;
+  req[req_len++] = 5;
+  req[req_len++] = 1;  // CONNECT
+  req[req_len++] = 0;
+  req[req_len++] = S5_ATYP_DOMAIN;
+  req[req_len++] = sizeof(host) - 1;
+  memcpy(req + req_len, host, sizeof(host) - 1);
+  req_len += sizeof(host) - 1;
+  req[req_len++] = 1;
+  req[req_len++] = 0xbb;
+
+  uint64_t start = uv_hrtime();
+  uint64_t ops = 0;
+  Socks5Ctx s5_ctx;
+  while (uv_hrtime() - start < MICRO_MIN_NSEC) {
+    for (int i = 0; i < 256; ++i) {
+      memset(&s5_ctx, 0, sizeof(s5_ctx));
+      if (socks5_parse_request(&s5_ctx, req, req_len) != S5_OK) {
+        printf("  socks5_parse_request failed\n");
+        return;
+      }
+      ++ops;
+    }
+  }
+  double secs = (uv_hrtime() - start) / 1e9;
+  printf("  %-18s %14.0f ops/s\n", "parse_request", ops / secs);
+
+  const char greeting[] = "\x05\x01\x00";
+  start = uv_hrtime();
+  ops = 0;
+  while (uv_hrtime() - start < MICRO_MIN_NSEC) {
+    for (int i = 0; i < 256; ++i) {
+      memset(&s5_ctx, 0, sizeof(s5_ctx));
+      if (socks5_parse_method_identification(&s5_ctx, greeting, 3) != S5_OK) {
+        printf("  socks5_parse_method_identification failed\n");
+        return;
+      }
+      ++ops;
+    }
+  }
+  secs = (uv_hrtime() - start) / 1e9;
+  printf("  %-18s %14.0f ops/s\n", "parse_greeting", ops / secs);
+}
+
+static int run_micro(void) {
+  cipher_global_init();
+  printf("cipher roundtrip (stream_encrypt_to + stream_decrypt_to):\n");
+  for (int c = 0; micro_ciphers[c] != NULL; ++c) {
+    for (int s = 0; micro_sizes[s] != 0; ++s) {
+      micro_cipher_one(micro_ciphers[c], micro_sizes[s]);
+    }
+  }
+  printf("socks5 parser:\n");
+  micro_socks5();
+  return 0;
+}
+
+/* ------------------------------- net bench ------------------------------ */
+
+typedef enum {
+  CONN_GREETING,
+  CONN_REQUEST,
+  CONN_STREAMING,
+} ConnPhase;
+
+typedef struct {
+  uv_tcp_t tcp;
+  uv_connect_t connect_req;
+  uv_write_t write_req;
+  ConnPhase phase;
+  int msgs_left;
+  int recvd;            // bytes of the current echo received so far
+  uint64_t conn_start;  // for the handshake timing
+  uint64_t msg_start;   // for per-message latency
+  char *msg;            // the payload, reused for every message
+  char recv_buf[65536];
+} BenchConn;
+
+typedef struct {
+  uv_tcp_t tcp;
+  char buf[65536];
+} EchoConn;
+
+static uv_loop_t *g_bench_loop;
+static struct sockaddr_in g_socks_addr;
+static int g_echo_port = BENCH_ECHO_PORT;
+static int g_conns = BENCH_CONNS;
+static int g_msgs = BENCH_MSGS;
+static int g_msgsize = BENCH_MSGSIZE;
+
+static uint64_t g_bench_start;
+static int g_active;
+static int g_handshakes;
+static uint64_t g_bytes;
+static double *g_lat_ms;
+static int g_lat_count;
+static int g_lat_cap;
+
+static void conn_start(BenchConn *conn);
+
+/* ---- echo server: the upstream the proxied connections talk to ---- */
+
+static void echo_close_cb(uv_handle_t *handle) {
+  free(container_of((uv_tcp_t *)handle, EchoConn, tcp));
+}
+
+static void echo_write_done(uv_write_t *req, int status) {
+  free(req);
+  if (status < 0) {
+    // peer gone, the read side will observe it too
+  }
+}
+
+static void echo_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
+  EchoConn *conn = (EchoConn *)handle->data;
+  buf->base = conn->buf;
+  buf->len = sizeof(conn->buf);
+}
+
+static void echo_read_done(uv_stream_t *handle, ssize_t nread,
+    const uv_buf_t *buf) {
+  if (nread == 0) {
+    return;
+  }
+  if (nread < 0) {
+    uv_close((uv_handle_t *)handle, echo_close_cb);
+    return;
+  }
+  // one malloc'ed req + copy per chunk keeps the echo server trivially
+  // correct; it is not the system under test
+  uv_write_t *req = malloc(sizeof(uv_write_t) + nread);
+  char *data = (char *)(req + 1);
+  memcpy(data, buf->base, nread);
+  uv_buf_t wbuf = uv_buf_init(data, nread);
+  uv_write(req, handle, &wbuf, 1, echo_write_done);
+}
+
+static void echo_connection_new(uv_stream_t *server, int status) {
+  if (status < 0) {
+    return;
+  }
+  EchoConn *conn = malloc(sizeof(EchoConn));
+  uv_tcp_init(g_bench_loop, &conn->tcp);
+  conn->tcp.data = conn;
+  if (uv_accept(server, (uv_stream_t *)&conn->tcp) != 0) {
+    uv_close((uv_handle_t *)&conn->tcp, echo_close_cb);
+    return;
+  }
+  uv_read_start((uv_stream_t *)&conn->tcp, echo_alloc, echo_read_done);
+}
+
+/* ---- bench clients ---- */
+
+static void lat_record(double ms) {
+  if (g_lat_count == g_lat_cap) {
+    g_lat_cap *= 2;
+    g_lat_ms = realloc(g_lat_ms, g_lat_cap * sizeof(double));
+  }
+  g_lat_ms[g_lat_count++] = ms;
+}
+
+static void conn_close_cb(uv_handle_t *handle) {
+  BenchConn *conn = container_of((uv_tcp_t *)handle, BenchConn, tcp);
+  free(conn->msg);
+  free(conn);
+  if (--g_active == 0) {
+    // all clients finished, let the loop drain and exit
+  }
+}
+
+static void conn_fail(BenchConn *conn, const char *what, int err) {
+  fprintf(stderr, "bench conn failed in %s: %s\n", what,
+      err ? uv_strerror(err) : "protocol error");
+  uv_close((uv_handle_t *)&conn->tcp, conn_close_cb);
+}
+
+static void conn_write_done(uv_write_t *req, int status) {
+  BenchConn *conn = container_of(req, BenchConn, write_req);
+  if (status < 0) {
+    conn_fail(conn, "write", status);
+  }
+}
+
+static void conn_send_msg(BenchConn *conn) {
+  conn->recvd = 0;
+  conn->msg_start = uv_hrtime();
+  uv_buf_t buf = uv_buf_init(conn->msg, g_msgsize);
+  int err;
+  if ((err = uv_write(&conn->write_req, (uv_stream_t *)&conn->tcp, &buf, 1,
+          conn_write_done)) != 0) {
+    conn_fail(conn, "send", err);
+  }
+}
+
+static void conn_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
+  BenchConn *conn = (BenchConn *)handle->data;
+  buf->base = conn->recv_buf;
+  buf->len = sizeof(conn->recv_buf);
+}
+
+static void conn_read_done(uv_stream_t *handle, ssize_t nread,
+    const uv_buf_t *buf) {
+  BenchConn *conn = (BenchConn *)handle->data;
+  if (nread == 0) {
+    return;
+  }
+  if (nread < 0) {
+    conn_fail(conn, "read", nread);
+    return;
+  }
+
+  switch (conn->phase) {
+    case CONN_GREETING: {
+      if (nread < 2 || buf->base[1] != 0) {
+        conn_fail(conn, "greeting", 0);
+        return;
+      }
+      conn->phase = CONN_REQUEST;
+      char *req = conn->recv_buf;  // reuse as scratch for the request
+      memcpy(req, "\x05\x01\x00\x01", 4);
+      uint32_t ip = htonl(0x7f000001);  // 127.0.0.1
+      memcpy(req + 4, &ip, 4);
+      uint16_t port = htons(g_echo_port);
+      memcpy(req + 8, &port, 2);
+      uv_buf_t wbuf = uv_buf_init(req, 10);
+      int err;
+      if ((err = uv_write(&conn->write_req, handle, &wbuf, 1,
+              conn_write_done)) != 0) {
+        conn_fail(conn, "request", err);
+      }
+      break;
+    }
+
+    case CONN_REQUEST: {
+      if (nread < 10 || buf->base[1] != 0) {
+        conn_fail(conn, "connect reply", 0);
+        return;
+      }
+      ++g_handshakes;
+      conn->phase = CONN_STREAMING;
+      conn->msgs_left = g_msgs;
+      conn_send_msg(conn);
+      break;
+    }
+
+    case CONN_STREAMING: {
+      conn->recvd += nread;
+      g_bytes += nread;
+      if (conn->recvd < g_msgsize) {
+        return;  // echo still in flight
+      }
+      lat_record((uv_hrtime() - conn->msg_start) / 1e6);
+      if (--conn->msgs_left > 0) {
+        conn_send_msg(conn);
+        return;
+      }
+      // connection done; reconnect to also measure handshake churn
+      uv_close((uv_handle_t *)&conn->tcp, conn_close_cb);
+      break;
+    }
+  }
+}
+
+static void conn_connect_cb(uv_connect_t *req, int status) {
+  BenchConn *conn = container_of(req, BenchConn, connect_req);
+  if (status < 0) {
+    conn_fail(conn, "connect", status);
+    return;
+  }
+  uv_read_start((uv_stream_t *)&conn->tcp, conn_alloc, conn_read_done);
+
+  conn->phase = CONN_GREETING;
+  uv_buf_t buf = uv_buf_init("\x05\x01\x00", 3);
+  int err;
+  if ((err = uv_write(&conn->write_req, (uv_stream_t *)&conn->tcp, &buf, 1,
+          conn_write_done)) != 0) {
+    conn_fail(conn, "greeting send", err);
+  }
+}
+
+static void conn_start(BenchConn *conn) {
+  memset(conn, 0, offsetof(BenchConn, recv_buf));
+  uv_tcp_init(g_bench_loop, &conn->tcp);
+  conn->tcp.data = conn;
+  uv_tcp_nodelay(&conn->tcp, 1);
+  conn->msg = malloc(g_msgsize);
+  memset(conn->msg, 0x42, g_msgsize);
+  conn->conn_start = uv_hrtime();
+  int err;
+  if ((err = uv_tcp_connect(&conn->connect_req, &conn->tcp,
+          (struct sockaddr *)&g_socks_addr, conn_connect_cb)) != 0) {
+    conn_fail(conn, "tcp connect", err);
+  }
+}
+
+static int lat_cmp(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static int run_net(void) {
+  g_bench_loop = uv_default_loop();
+
+  uv_tcp_t echo_server;
+  struct sockaddr_in echo_addr;
+  uv_ip4_addr("127.0.0.1", g_echo_port, &echo_addr);
+  uv_tcp_init(g_bench_loop, &echo_server);
+  int err;
+  if ((err = uv_tcp_bind(&echo_server, (struct sockaddr *)&echo_addr, 0)) != 0 ||
+      (err = uv_listen((uv_stream_t *)&echo_server, 128,
+          echo_connection_new)) != 0) {
+    fprintf(stderr, "echo server setup failed: %s\n", uv_strerror(err));
+    return 1;
+  }
+
+  g_lat_cap = 4096;
+  g_lat_ms = malloc(g_lat_cap * sizeof(double));
+
+  g_bench_start = uv_hrtime();
+  g_active = g_conns;
+  for (int i = 0; i < g_conns; ++i) {
+    BenchConn *conn = malloc(sizeof(BenchConn));
+    conn_start(conn);
+  }
+
+  // run until every client closed, then stop accepting
+  while (g_active > 0 && uv_run(g_bench_loop, UV_RUN_ONCE) != 0) {
+  }
+  double secs = (uv_hrtime() - g_bench_start) / 1e9;
+
+  if (g_lat_count == 0) {
+    fprintf(stderr, "no messages completed, is the proxy pair running?\n");
+    return 1;
+  }
+  qsort(g_lat_ms, g_lat_count, sizeof(double), lat_cmp);
+  double p50 = g_lat_ms[g_lat_count / 2];
+  double p99 = g_lat_ms[(int)(g_lat_count * 0.99)];
+
+  printf("conns: %d  msgs/conn: %d  msgsize: %d\n", g_conns, g_msgs,
+      g_msgsize);
+  printf("handshakes: %d (%.0f conn/s)\n", g_handshakes,
+      g_handshakes / secs);
+  printf("echoed %.1f MB in %.2fs: %.2f Gbit/s on the wire (both ways)\n",
+      g_bytes / 1e6, secs, g_bytes * 2 * 8 / secs / 1e9);
+  printf("latency p50: %.3f ms  p99: %.3f ms  (%d samples)\n", p50, p99,
+      g_lat_count);
+  return 0;
+}
+
+/* --------------------------------- main --------------------------------- */
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+      "usage: %s micro\n"
+      "       %s net [-p socks_port] [-c conns] [-n msgs] [-s msgsize]\n"
+      "              [-e echo_port]\n", argv0, argv0);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (strcmp(argv[1], "micro") == 0) {
+    return run_micro();
+  }
+
+  if (strcmp(argv[1], "net") != 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  int socks_port = BENCH_SOCKS_PORT;
+  for (int i = 2; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-p") == 0) {
+      socks_port = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-c") == 0) {
+      g_conns = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-n") == 0) {
+      g_msgs = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-s") == 0) {
+      g_msgsize = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-e") == 0) {
+      g_echo_port = atoi(argv[i + 1]);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (g_msgsize < 1 || g_msgsize > BENCH_MAX_MSGSIZE || g_conns < 1 ||
+      g_msgs < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+  uv_ip4_addr("127.0.0.1", socks_port, &g_socks_addr);
+
+  return run_net();
+}
@@ -11,13 +11,40 @@ void local_server_usage(const char *cmd, int exit_code) {
       "Usage: %s <options>\n"
       "    -h, --local_host    the host this server is running on\n"
       "    -p, --local_port    the port this server to be bound\n"
-      "    -H, --remote_host   the host this server connects to\n"
-      "    -P, --remote_host   the port this server connects to\n"
+      "    -H, --remote_host   comma-separated list of host[:port] remotes,\n"
+      "                        probed and balanced by latency; bare hosts\n"
+      "                        (and IPv6 literals) use the -P port\n"
+      "    -P, --remote_port   the default port for --remote_host entries\n"
       "    -c, --cipher_name   the cipher used to encrypt & decrypt the payloads\n"
       "    -s, --cipher_secret the secret key\n"
       "    -u, --user          run as user\n"
       "    -l, --log_file      path to log file, stderr if absent\n"
       "    -w, --window_size   tcp window size in bytes\n"
+      "    -n, --workers       number of worker event loops, each with its own\n"
+      "                        SO_REUSEPORT listener, default: 1\n"
+      "    -B, --backlog       listen(2) queue length per listener,\n"
+      "                        default: 256\n"
+      "    -a, --acl_file      split-tunneling rule file deciding DIRECT vs\n"
+      "                        PROXY per destination, see acl.h for the format\n"
+      "    -T, --tunnel_pool   pre-established tunnels kept warm per worker,\n"
+      "                        default: 4\n"
+      "    -R, --tunnel_refill_ms\n"
+      "                        pause between tunnel refill connects,\n"
+      "                        default: 250\n"
+      "    -z, --compress      framed wire mode with LZ4 compression, must\n"
+      "                        be enabled on both ends\n"
+      "    -W, --high_watermark\n"
+      "                        bytes in flight per relay direction before\n"
+      "                        reads pause, default: 24576\n"
+      "    -L, --low_watermark bytes in flight under which paused reads\n"
+      "                        resume, default: 8192\n"
+      "    -S, --stall_ms      log event loop callbacks blocking longer than\n"
+      "                        this many ms, default: 0 (profiler off)\n"
+      "    -i, --idle_timeout  close sessions with no traffic for this many\n"
+      "                        seconds, default: 0 (never)\n"
+      "    -x, --crypto_offload\n"
+      "                        run the stream ciphers on the thread pool\n"
+      "                        instead of inline in the event loop\n"
       "    -D, --daemon        run the process in the background\n"
       "    -g, --pac_file_url  MacOS only, specify the PAC file, when used, -G, --set_system_proxy will be ignored\n"
       "    -G, --set_system_proxy\n"
@@ -37,6 +64,28 @@ void remote_server_usage(const char *cmd, int exit_code) {
       "    -u, --user          run as user\n"
       "    -l, --log_file      path to log file, stderr if absent\n"
       "    -w, --window_size   tcp window size in bytes\n"
+      "    -n, --workers       number of worker event loops, each with its own\n"
+      "                        SO_REUSEPORT listener, default: 1\n"
+      "    -B, --backlog       listen(2) queue length per listener,\n"
+      "                        default: 256\n"
+      "    -r, --rate_limit    per-session relay rate limit in KB/s,\n"
+      "                        default: 0 (unlimited)\n"
+      "    -b, --rate_burst    per-session burst allowance in KB,\n"
+      "                        default: half a second of the rate limit\n"
+      "    -z, --compress      framed wire mode with LZ4 compression, must\n"
+      "                        be enabled on both ends\n"
+      "    -W, --high_watermark\n"
+      "                        bytes in flight per relay direction before\n"
+      "                        reads pause, default: 24576\n"
+      "    -L, --low_watermark bytes in flight under which paused reads\n"
+      "                        resume, default: 8192\n"
+      "    -S, --stall_ms      log event loop callbacks blocking longer than\n"
+      "                        this many ms, default: 0 (profiler off)\n"
+      "    -i, --idle_timeout  close sessions with no traffic for this many\n"
+      "                        seconds, default: 0 (never)\n"
+      "    -x, --crypto_offload\n"
+      "                        run the stream ciphers on the thread pool\n"
+      "                        instead of inline in the event loop\n"
       "    -D, --daemon        run the process in the background\n"
       "    --help          print this help message\n"
       , cmd);
@@ -67,13 +116,23 @@ void handle_remote_server_args(
     {"user",          required_argument, 0, 'u'},
     {"log_file",      required_argument, 0, 'l'},
     {"window_size",   required_argument, 0, 'w'},
+    {"workers",       required_argument, 0, 'n'},
+    {"backlog",       required_argument, 0, 'B'},
+    {"rate_limit",    required_argument, 0, 'r'},
+    {"rate_burst",    required_argument, 0, 'b'},
+    {"compress",      no_argument,       0, 'z'},
+    {"high_watermark", required_argument, 0, 'W'},
+    {"low_watermark",  required_argument, 0, 'L'},
+    {"stall_ms",      required_argument, 0, 'S'},
+    {"idle_timeout",  required_argument, 0, 'i'},
+    {"crypto_offload", no_argument,      0, 'x'},
     {"daemon",        no_argument,       0, 'D'},
     {0, 0, 0, 0}
   };
 
   int optind = 0;
   char c;
-  while((c = getopt_long(argc, (char **)argv, "h:p:c:s:u:l:w:D",
+  while((c = getopt_long(argc, (char **)argv, "h:p:c:s:u:l:w:n:B:r:b:zW:L:S:i:xD",
           long_options, &optind)) != -1) {
     switch(c) {
       case 0:
@@ -106,6 +165,48 @@ void handle_remote_server_args(
       case 'w':
         cfg->window_size = atoi(optarg);
         break;
+      case 'n':
+        cfg->workers = atoi(optarg);
+        check_option_value((void *)(intptr_t)cfg->workers,
+            "invalid value for <-n, --workers>", 0, argv[0]);
+        break;
+      case 'B':
+        cfg->backlog = atoi(optarg);
+        check_option_value((void *)(intptr_t)cfg->backlog,
+            "invalid value for <-B, --backlog>", 0, argv[0]);
+        break;
+      case 'r':
+        cfg->rate_limit = atoi(optarg);
+        break;
+      case 'b':
+        cfg->rate_burst = atoi(optarg);
+        break;
+      case 'z':
+        cfg->compress = 1;
+        break;
+      case 'W':
+        cfg->high_watermark = atoi(optarg);
+        check_option_value((void *)(intptr_t)cfg->high_watermark,
+            "invalid value for <-W, --high_watermark>", 0, argv[0]);
+        break;
+      case 'L':
+        cfg->low_watermark = atoi(optarg);
+        check_option_value((void *)(intptr_t)cfg->low_watermark,
+            "invalid value for <-L, --low_watermark>", 0, argv[0]);
+        break;
+      case 'S':
+        cfg->stall_ms = atoi(optarg);
+        check_option_value((void *)(intptr_t)cfg->stall_ms,
+            "invalid value for <-S, --stall_ms>", 0, argv[0]);
+        break;
+      case 'i':
+        cfg->idle_timeout = atoi(optarg);
+        check_option_value((void *)(intptr_t)cfg->idle_timeout,
+            "invalid value for <-i, --idle_timeout>", 0, argv[0]);
+        break;
+      case 'x':
+        cfg->crypto_offload = 1;
+        break;
       case 'D':
         cfg->daemon_flag = 1;
         break;
@@ -137,6 +238,17 @@ void handle_local_server_args(
     {"user",             required_argument, 0, 'u'},
     {"log_file",         required_argument, 0, 'l'},
     {"window_size",      required_argument, 0, 'w'},
+    {"workers",          required_argument, 0, 'n'},
+    {"backlog",          required_argument, 0, 'B'},
+    {"acl_file",         required_argument, 0, 'a'},
+    {"tunnel_pool",      required_argument, 0, 'T'},
+    {"tunnel_refill_ms", required_argument, 0, 'R'},
+    {"compress",         no_argument,       0, 'z'},
+    {"high_watermark",   required_argument, 0, 'W'},
+    {"low_watermark",    required_argument, 0, 'L'},
+    {"stall_ms",         required_argument, 0, 'S'},
+    {"idle_timeout",     required_argument, 0, 'i'},
+    {"crypto_offload",   no_argument,       0, 'x'},
     {"daemon",           no_argument,       0, 'D'},
     {"set_global_proxy", no_argument,       0, 'G'},
     {"pac_file_url",     required_argument, 0, 'g'},
@@ -145,7 +257,7 @@ void handle_local_server_args(
 
   int optind = 0;
   char c;
-  while((c = getopt_long(argc, (char **)argv, "h:p:H:P:c:s:u:l:w:DGg:",
+  while((c = getopt_long(argc, (char **)argv, "h:p:H:P:c:s:u:l:w:n:B:a:T:R:zW:L:S:i:xDGg:",
           long_options, &optind)) != -1) {
     switch(c) {
       case 0:
@@ -184,6 +296,55 @@ void handle_local_server_args(
       case 'w':
         cfg->window_size = atoi(optarg);
         break;
+      case 'n':
+        cfg->workers = atoi(optarg);
+        check_option_value((void *)(intptr_t)cfg->workers,
+            "invalid value for <-n, --workers>", 1, argv[0]);
+        break;
+      case 'B':
+        cfg->backlog = atoi(optarg);
+        check_option_value((void *)(intptr_t)cfg->backlog,
+            "invalid value for <-B, --backlog>", 1, argv[0]);
+        break;
+      case 'a':
+        cfg->acl_file = optarg;
+        break;
+      case 'T':
+        cfg->tunnel_pool = atoi(optarg);
+        check_option_value((void *)(intptr_t)cfg->tunnel_pool,
+            "invalid value for <-T, --tunnel_pool>", 1, argv[0]);
+        break;
+      case 'R':
+        cfg->tunnel_refill_ms = atoi(optarg);
+        check_option_value((void *)(intptr_t)cfg->tunnel_refill_ms,
+            "invalid value for <-R, --tunnel_refill_ms>", 1, argv[0]);
+        break;
+      case 'z':
+        cfg->compress = 1;
+        break;
+      case 'W':
+        cfg->high_watermark = atoi(optarg);
+        check_option_value((void *)(intptr_t)cfg->high_watermark,
+            "invalid value for <-W, --high_watermark>", 1, argv[0]);
+        break;
+      case 'L':
+        cfg->low_watermark = atoi(optarg);
+        check_option_value((void *)(intptr_t)cfg->low_watermark,
+            "invalid value for <-L, --low_watermark>", 1, argv[0]);
+        break;
+      case 'S':
+        cfg->stall_ms = atoi(optarg);
+        check_option_value((void *)(intptr_t)cfg->stall_ms,
+            "invalid value for <-S, --stall_ms>", 1, argv[0]);
+        break;
+      case 'i':
+        cfg->idle_timeout = atoi(optarg);
+        check_option_value((void *)(intptr_t)cfg->idle_timeout,
+            "invalid value for <-i, --idle_timeout>", 1, argv[0]);
+        break;
+      case 'x':
+        cfg->crypto_offload = 1;
+        break;
       case 'D':
         cfg->daemon_flag = 1;
         break;
@@ -1,13 +1,91 @@
 #ifndef DEFS_H_
 #define DEFS_H_
+#include <stddef.h>
+#include <string.h>
 #include <uv.h>
 #include "encrypt.h"
 #include "socks5.h"
+#include "rate_limit.h"
+#include "idle_wheel.h"
 
 #define SESSION_TCP_BUFSIZ 8192
-#define SESSION_UDP_BUFSIZ 4096
+// small buffer class: the handshake-phase read buffer
+#define SESSION_SMALL_BUFSIZ (SESSION_TCP_BUFSIZ + MAX_IV_LEN)
 #define DEFAULT_CIPHER_NAME "aes-256-cfb"
 
+// pipelined TCP relay: reads keep flowing while up to PIPE_DEPTH earlier
+// writes are still queued in the kernel, instead of draining the pipeline
+// every read. Reads pause once the bytes in flight cross the high watermark
+// and resume when they fall back under the low one; the marks default to
+// the values below and are tunable per server with -W/-L (see cli.c). A
+// slot holds twice the read size (plus crypto framing room) because
+// reassembled AEAD plaintext can span two reads.
+#define PIPE_DEPTH 4
+#define PIPE_HIGH_WATERMARK_DEFAULT (24 * 1024)
+#define PIPE_LOW_WATERMARK_DEFAULT (8 * 1024)
+
+// adaptive read sizing: a direction whose reads keep coming back full
+// graduates to the next read (and slot) tier, 8 -> 16 -> 32 -> 64KB, so
+// bulk streams spend fewer read syscalls and cipher calls per byte; a
+// direction dwindling to quarter-full reads drops back down, keeping
+// interactive sessions on small buffers. The AEAD/framed wire format
+// caps a record at AEAD_MAX_RECORD, so the plaintext side of such
+// sessions stays on tier 0 (see the tier_cap at the observe call sites)
+#define READ_TIER_MAX 3
+#define READ_TIER_SIZE(t) (SESSION_TCP_BUFSIZ << (t))
+#define READ_TIER_PROMOTE_STREAK 4  // full reads in a row to move up
+#define READ_TIER_DEMOTE_STREAK 4   // quarter-full reads in a row to drop
+#define PIPE_SLOT_BUFSIZ_TIER(t) (READ_TIER_SIZE(t) * 2 + 128)
+#define PIPE_SLOT_BUFSIZ PIPE_SLOT_BUFSIZ_TIER(0)
+
+typedef struct {
+  uv_write_t write_req;
+  int busy;
+  int wire_len;   // bytes handed to uv_write from this slot
+  int tier;       // the slot tier buf was borrowed from
+  // borrowed from POOL_BUF_LARGE + tier while the slot carries data,
+  // returned in the write callback so idle sessions hold no slot buffers
+  char *buf;
+} PipeSlot;
+
+typedef struct {
+  PipeSlot slots[PIPE_DEPTH];
+  int inflight;      // bytes queued on the peer and not yet written out
+  int read_stopped;  // reading paused by the watermark (or slot shortage)
+  int read_tier;     // current read size tier, see READ_TIER_SIZE
+  int full_streak;   // consecutive reads that filled their buffer
+  int lean_streak;   // consecutive quarter-full reads
+} StreamPipe;
+
+// clears the pipe bookkeeping; slot buffers live in the pool between uses
+#define STREAM_PIPE_CLEAR(pipe) do { \
+  for (int i_ = 0; i_ < PIPE_DEPTH; ++i_) { \
+    (pipe)->slots[i_].busy = 0; \
+    (pipe)->slots[i_].buf = NULL; \
+  } \
+  (pipe)->inflight = 0; \
+  (pipe)->read_stopped = 0; \
+  (pipe)->read_tier = 0; \
+  (pipe)->full_streak = 0; \
+  (pipe)->lean_streak = 0; \
+} while (0)
+
+// crypto offload (-x): the cipher runs on a libuv threadpool thread
+// instead of inline in the read callback, one job per relay direction.
+// The bytes already sit in a pipe slot buffer, so the job carries only
+// pointers; the cipher state is sequential (CFB chaining, AEAD nonces),
+// which is why a direction never has more than one job in flight and
+// its read stays paused until the completion callback
+typedef struct {
+  uv_work_t work;
+  void *sess;   // owning TCPSession
+  PipeSlot *slot;
+  char *data;   // in: bytes as read, out: start of the ciphered result
+  int len;
+  int encrypt;  // run e_ctx instead of d_ctx
+  int busy;     // a job is queued or running for this direction
+} CryptoJob;
+
 typedef enum {
   S5_METHOD_IDENTIFICATION,
   S5_REQUEST,
@@ -28,7 +106,7 @@ typedef enum {
 #define SESSION_FIELDS \
   uv_tcp_t *client_tcp; \
   uv_write_t client_write_req; \
-  char client_buf[SESSION_TCP_BUFSIZ + MAX_IV_LEN]; \
+  char *client_buf;  /* POOL_BUF_SMALL, borrowed for the handshake phase */ \
   SessionState state; \
   Socks5Ctx s5_ctx; \
   CipherCtx e_ctx; \
@@ -36,6 +114,7 @@ typedef enum {
   char *socks5_req_data;  \
   int socks5_req_data_len; \
   SessionType type; \
+  IdleNode idle_node;  /* idle-eviction wheel entry, see idle_wheel.h */ \
   int8_t heap_obj_count;
 
 typedef struct {
@@ -46,27 +125,50 @@ typedef struct {
   SESSION_FIELDS
 
   uv_tcp_t *upstream_tcp;
-  uv_write_t upstream_write_req;
+  uv_write_t upstream_write_req;  // handshake-phase writes only
   uv_getaddrinfo_t upstream_addrinfo_req;
   uv_connect_t upstream_connect_req;
-  char upstream_buf[SESSION_TCP_BUFSIZ + MAX_IV_LEN]; 
-} TCPSession;
+  uint64_t upstream_connect_ts;  // uv_hrtime at connect start, for metrics
 
-typedef struct {
-  SESSION_FIELDS
+  // kernel splice fast path for DIRECT sessions (local.c, Linux only);
+  // NULL while relaying through the pipe slot buffers
+  void *splice_relay;
 
-  uv_udp_t *client_udp_recv;
-  char clinet_udp_recv_buf[SESSION_UDP_BUFSIZ + MAX_IV_LEN]; 
+  // Happy Eyeballs connect race (remote.c), NULL outside the race window
+  void *he_race;
+
+  // token bucket shared by both directions (rate_limit.c), inert unless
+  // the server runs with a --rate_limit
+  RateState rate;
+
+  // crypto offload jobs, named after the pipe they feed; inert without -x.
+  // crypto_close_pending remembers a close_session that arrived while a
+  // job was still using the cipher contexts on a threadpool thread
+  CryptoJob crypto_to_upstream;
+  CryptoJob crypto_to_client;
+  int crypto_close_pending;
+
+  // one pipe per relay direction; the slot buffers are pooled, only the
+  // write requests and bookkeeping live here. Keep the pipes last: the
+  // session-recycling memset clears everything up to here and the pipes
+  // reset through STREAM_PIPE_CLEAR
+  StreamPipe to_upstream;   // client reads -> upstream writes
+  StreamPipe to_client;     // upstream reads -> client writes
+} TCPSession;
 
-  uv_udp_t *upstream_udp;
-  uv_udp_send_t upstream_udp_send_req;
-  uv_getaddrinfo_t upstream_udp_addrinfo_req;
-  char upstream_udp_buf[SESSION_UDP_BUFSIZ + MAX_IV_LEN]; 
+// session objects live in a fixed-size pool (see alloc.h); UDP associates
+// only need the base Session for their TCP control channel, the datagram
+// flows themselves live in the shared relay (udp_relay.c), so every block
+// is sized for the TCP flavor
+typedef union {
+  TCPSession tcp;
+} SessionStorage;
 
-  uv_udp_t *client_udp_send;
-  uv_udp_send_t client_udp_send_req;
-  uv_getaddrinfo_t client_udp_addrinfo_req;
-} UDPSession;
+// the I/O buffers live in the buffer pools now, so clearing a freshly
+// pooled session is a plain memset of the state
+#define SESSION_CLEAR(sess) do { \
+  memset((sess), 0, sizeof(Session)); \
+} while (0)
 
 typedef struct {
   char *local_host;
@@ -76,21 +178,42 @@ typedef struct {
   char *user;
   char *log_file;
   int window_size;
+  int workers;
+  int backlog;     // listen(2) queue length, 0 = default
+  int rate_limit;  // per-session relay budget in KB/s, 0 = unlimited
+  int rate_burst;  // per-session burst allowance in KB, 0 = default
+  int high_watermark;  // bytes in flight per direction before reads pause
+  int low_watermark;   // bytes in flight under which reads resume
+  int compress;    // framed wire mode with LZ4, both ends must enable it
+  int stall_ms;    // loop stall profiler threshold in ms, 0 = off
+  int idle_timeout;  // close sessions idle this many seconds, 0 = never
+  int crypto_offload;  // run the stream ciphers on the threadpool
   int daemon_flag;
 } RemoteServerCliCfg;
 
 typedef struct {
   char *local_host;
   int local_port;
-  char *remote_host;
-  int remote_port;
+  char *remote_host;  // comma-separated host[:port] list, balanced by latency
+  int remote_port;    // default port for entries without one
   char *cipher_name;
   char *cipher_secret;
   char *user;
   char *log_file;
   int window_size;
+  int workers;
+  int backlog;     // listen(2) queue length, 0 = default
+  char *acl_file;  // split-tunneling rules, see acl.h; NULL = always proxy
+  int tunnel_pool;       // warm tunnels kept per worker, 0 = default
+  int tunnel_refill_ms;  // pause between tunnel refills, 0 = default
+  int high_watermark;  // bytes in flight per direction before reads pause
+  int low_watermark;   // bytes in flight under which reads resume
+  int compress;    // framed wire mode with LZ4, both ends must enable it
+  int stall_ms;    // loop stall profiler threshold in ms, 0 = off
+  int idle_timeout;  // close sessions idle this many seconds, 0 = never
+  int crypto_offload;  // run the stream ciphers on the threadpool
   int daemon_flag;
-  int set_global_proxy; 
+  int set_global_proxy;
   // if pac_file_url is not NULL, it will be used and
   // use_global_proxy will be ignored 
   char *pac_file_url; 
@@ -0,0 +1,93 @@
+#include "dns_cache.h"
+#include "hashmap.h"
+#include "util.h"
+#include "alloc.h"
+#include "log/log.h"
+
+typedef struct {
+  struct sockaddr_storage addr;
+  int negative;
+  uint64_t expires_at;
+} DNSCacheEntry;
+
+static __thread HashMap g_dns_cache;
+static __thread int g_dns_cache_initialized;
+
+static void on_entry_removed(const char *key, void *value) {
+  free(value);
+}
+
+static HashMap *cache() {
+  if (!g_dns_cache_initialized) {
+    hashmap_init(&g_dns_cache, on_entry_removed);
+    g_dns_cache_initialized = 1;
+  }
+  return &g_dns_cache;
+}
+
+DNSCacheResult dns_cache_get(const char *host, unsigned short port,
+    struct sockaddr_storage *addr, uint64_t now) {
+  DNSCacheEntry *entry = hashmap_get(cache(), host);
+  if (entry == NULL) {
+    return DNS_CACHE_MISS;
+  }
+
+  if (entry->expires_at <= now) {
+    hashmap_remove(cache(), host);
+    return DNS_CACHE_MISS;
+  }
+
+  if (entry->negative) {
+    return DNS_CACHE_NEGATIVE_HIT;
+  }
+
+  memcpy(addr, &entry->addr, sizeof(struct sockaddr_storage));
+  if (addr->ss_family == AF_INET) {
+    ((struct sockaddr_in *)addr)->sin_port = port;
+  } else {
+    ((struct sockaddr_in6 *)addr)->sin6_port = port;
+  }
+  return DNS_CACHE_HIT;
+}
+
+void dns_cache_put(const char *host, const struct addrinfo *res,
+    uint64_t now) {
+  DNSCacheEntry *entry = lmalloc(sizeof(DNSCacheEntry));
+  memset(entry, 0, sizeof(DNSCacheEntry));
+
+  if (res == NULL) {
+    entry->negative = 1;
+    entry->expires_at = now + DNS_CACHE_NEG_TTL;
+
+  } else {
+    char ipstr[INET6_ADDRSTRLEN];
+    const struct addrinfo *ai = res;
+    for (; ai != NULL; ai = ai->ai_next) {
+      if (fill_ipaddr((struct sockaddr *)&entry->addr, 0, ipstr,
+            sizeof(ipstr), (struct addrinfo *)ai) == 0) {
+        break;
+      }
+    }
+    if (ai == NULL) {
+      // nothing usable in the result, remember it as a failure
+      entry->negative = 1;
+      entry->expires_at = now + DNS_CACHE_NEG_TTL;
+    } else {
+      entry->expires_at = now + DNS_CACHE_TTL;
+      LOG_V("cached %s -> %s", host, ipstr);
+    }
+  }
+
+  hashmap_put(cache(), host, entry);
+}
+
+void dns_cache_put_addr(const char *host, const struct sockaddr *addr,
+    uint64_t now) {
+  DNSCacheEntry *entry = lmalloc(sizeof(DNSCacheEntry));
+  memset(entry, 0, sizeof(DNSCacheEntry));
+  memcpy(&entry->addr, addr,
+      addr->sa_family == AF_INET ? sizeof(struct sockaddr_in)
+                                 : sizeof(struct sockaddr_in6));
+  entry->expires_at = now + DNS_CACHE_TTL;
+  hashmap_put(cache(), host, entry);
+}
@@ -0,0 +1,37 @@
+#ifndef DNS_CACHE_H_
+#define DNS_CACHE_H_
+#include <uv.h>
+
+// a TTL-based DNS cache in front of uv_getaddrinfo: resolving on libuv's
+// threadpool is the most expensive part of connecting upstream, so resolver
+// results (including failures, see DNS_CACHE_NEGATIVE_HIT) are remembered
+// for a while and repeated connects to the same hostname become fully
+// synchronous. The cache is thread-local, each worker loop keeps its own,
+// so no locking is needed.
+//
+// Only the first usable address of a result is kept; once an entry expires
+// the next lookup misses and goes through the resolver again.
+
+#define DNS_CACHE_TTL (5 * 60 * 1000)      // ms
+#define DNS_CACHE_NEG_TTL (30 * 1000)      // ms
+
+typedef enum {
+  DNS_CACHE_MISS = 0,
+  DNS_CACHE_HIT,
+  DNS_CACHE_NEGATIVE_HIT
+} DNSCacheResult;
+
+// now is uv_now() of the calling loop; port is in network byte order and
+// is stamped into *addr on a hit
+DNSCacheResult dns_cache_get(const char *host, unsigned short port,
+    struct sockaddr_storage *addr, uint64_t now);
+
+// res == NULL records a resolution failure (negative entry)
+void dns_cache_put(const char *host, const struct addrinfo *res, uint64_t now);
+
+// pins a single known-good address for the host, e.g. the winner of a
+// Happy Eyeballs connect race, so later connects skip the losing family
+void dns_cache_put_addr(const char *host, const struct sockaddr *addr,
+    uint64_t now);
+
+#endif /* end of include guard: DNS_CACHE_H_ */
@@ -6,6 +6,36 @@
 #define MAX_IV_LEN EVP_MAX_IV_LENGTH
 #define CIPHER_INIT_BUFSIZ 8192
 
+// AEAD record framing: every record on the wire is
+//   [2-byte big-endian plaintext length][ciphertext][16-byte tag]
+// and the very first record of a stream is preceded by a random 12-byte
+// base nonce; subsequent records increment the nonce little-endian
+#define AEAD_NONCE_LEN 12
+#define AEAD_TAG_LEN 16
+#define AEAD_HEADER_LEN 2
+// upper bound for the plaintext of a single record, both ends read (and
+// therefore frame) at most this much at a time; the decrypt side rejects
+// anything bigger so its callers can size plaintext buffers
+#define AEAD_MAX_RECORD 8192
+
+// a set high bit in the record length prefix marks an LZ4-compressed
+// payload, the low 15 bits then carry the compressed length; the flag is
+// per record, incompressible data travels as plain records
+#define FRAME_COMPRESSED_BIT 0x8000
+
+// upper bound on the plaintext one stream_decrypt_to call hands out,
+// sized so it fits a pipe slot (PIPE_SLOT_BUFSIZ minus the headroom).
+// Compressed records can inflate a single wire read past this; the
+// surplus stays buffered in the context and comes out one batch at a
+// time through stream_decrypt_drain
+#define DECRYPT_OUT_MAX (AEAD_MAX_RECORD * 2)
+
+// space the session read buffers must reserve in front of and after the
+// data so stream_encrypt_to can frame a record (or prepend a stream
+// cipher IV) without moving the payload
+#define CRYPTO_HEADROOM (MAX_IV_LEN + AEAD_HEADER_LEN)
+#define CRYPTO_TAILROOM AEAD_TAG_LEN
+
 #ifndef max
 #define max(a, b) (((a) > (b)) ? (a) : (b))
 #endif
@@ -19,17 +49,64 @@ typedef enum {
 } CipherAlgorithm;
 
 typedef struct {
-  EVP_CIPHER_CTX *evp_cipher_ctx; 
+  EVP_CIPHER_CTX *evp_cipher_ctx;
   const EVP_CIPHER *cipher;
-  unsigned char *key;
+  // copied from the per-thread cipher template in cipher_ctx_init, the key
+  // derivation itself runs once per worker
+  unsigned char key[EVP_MAX_KEY_LENGTH];
   int key_len;
+
+  // AEAD mode (aes-256-gcm, chacha20-poly1305, ...), detected from the
+  // cipher flags in cipher_ctx_init
+  int is_aead;
+  int nonce_set;
+  unsigned char nonce[AEAD_NONCE_LEN];
+
+  // reassembly buffer for the decrypt direction: TCP reads do not respect
+  // record boundaries, so partial records are carried over between calls
+  unsigned char *rec_buf;
+  int rec_off;  // offset of the carried-over bytes within rec_buf
+  int rec_len;  // number of carried-over bytes
+  int rec_cap;
 } CipherCtx;
 
 void cipher_global_init();
+
+// turns on the framed wire mode with its LZ4 stage: AEAD records gain the
+// per-record compression flag, stream ciphers switch from the raw byte
+// stream to the same [length][payload] records (minus the tag). The wire
+// format changes, so both ends must run with it, the same way they must
+// agree on the cipher and the secret. Returns non-zero when this build
+// has no LZ4; call once on the main thread before the workers start.
+int cipher_set_framing(int enabled);
+int cipher_framing();
+
 int rand_bytes(unsigned char *buf, int num);
 int cipher_ctx_init(CipherCtx *ctx, const char *cipher_name, const char *passwd);
 void cipher_ctx_destroy(CipherCtx *ctx);
 char *stream_encrypt(CipherCtx *ctx, char *buf, INOUT int *len, int inplace);
 char *stream_decrypt(CipherCtx *ctx, char *buf, INOUT int *len, int inplace);
 
+// zero-copy variants for the streaming hot path: the data is ciphered in
+// place with EVP_CipherUpdate, no intermediate buffer and no memcpy.
+// stream_encrypt_to requires CRYPTO_HEADROOM bytes right BEFORE buf and
+// CRYPTO_TAILROOM bytes after buf+*len (the session buffers reserve them,
+// see the on_*_alloc callbacks): stream ciphers write the IV into the
+// headroom on the first call, AEAD ciphers frame the payload into a record
+// there (length prefix in the headroom, tag in the tailroom). The returned
+// pointer is moved back accordingly. stream_decrypt_to consumes the
+// IV/nonce from the front of the stream on the first call; in AEAD mode it
+// reassembles and authenticates records (returning NULL on a bad tag) and
+// may return *len == 0 while a record is still incomplete. Both return the
+// start of the result and update *len, or return NULL on failure.
+char *stream_encrypt_to(CipherCtx *ctx, char *buf, INOUT int *len);
+char *stream_decrypt_to(CipherCtx *ctx, char *buf, INOUT int *len);
+
+// cipher_pending reports whether a complete record is still buffered in
+// the decrypt context after a capped stream_decrypt_to (see
+// DECRYPT_OUT_MAX); stream_decrypt_drain emits the next batch without
+// consuming new wire bytes. The relay calls it as pipe slots free up.
+int cipher_pending(CipherCtx *ctx);
+char *stream_decrypt_drain(CipherCtx *ctx, INOUT int *len);
+
 #endif /* end of include guard: ENCRYPT_H_ */
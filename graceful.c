@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <uv.h>
+
+#include "log/log.h"
+#include "util.h"
+#include "alloc.h"
+#include "metrics.h"
+#include "graceful.h"
+
+// the write end of the readiness pipe rides across the exec in this
+// environment variable
+#define GRACEFUL_READY_ENV "LIGHTNING_GRACEFUL_FD"
+
+#define DRAIN_TICK_MS 500
+// one progress line roughly every ten seconds while sessions drain
+#define DRAIN_LOG_EVERY 20
+
+// one slot per worker loop; the SIGUSR2 watcher lives on every loop so
+// the signal is handled no matter which thread the kernel delivers it
+// to, and the first handler to flip g_restarting under the mutex
+// orchestrates the restart for the whole process
+typedef struct {
+  uv_loop_t *loop;
+  uv_tcp_t *listener;
+  GracefulShedCb shed_cb;
+  uv_signal_t sig;
+  uv_async_t drain_async;
+  uv_timer_t drain_timer;
+  int ticks;
+} GracefulWorker;
+
+static GracefulWorker *g_gworkers;
+static int g_gworker_cap;
+static int g_gworker_count;
+static uv_mutex_t g_graceful_mutex;
+static int g_restarting;
+static int g_drained;
+
+static const char **g_argv;
+static char g_exe_path[4096];
+
+// child side: inherited write end of the readiness pipe, -1 when this
+// process was not started by a graceful restart
+static int g_ready_fd = -1;
+
+// orchestrator side: read end of the readiness pipe and its watcher
+static int g_successor_fd = -1;
+static uv_poll_t g_successor_poll;
+
+static void on_sigusr2(uv_signal_t *handle, int signum);
+static void on_drain_async(uv_async_t *handle);
+static void on_drain_tick(uv_timer_t *handle);
+static void on_successor_status(uv_poll_t *handle, int status, int events);
+static int spawn_successor(uv_loop_t *loop);
+
+void graceful_init(int workers, const char **argv) {
+  g_argv = argv;
+
+  // daemon() moves the cwd to / before any restart can happen, so resolve
+  // the binary path now; /proc is the reliable route on Linux and argv[0]
+  // the best effort elsewhere
+  ssize_t n = readlink("/proc/self/exe", g_exe_path, sizeof(g_exe_path) - 1);
+  if (n > 0) {
+    g_exe_path[n] = '\0';
+  } else {
+    snprintf(g_exe_path, sizeof(g_exe_path), "%s", argv[0]);
+  }
+
+  CHECK(uv_mutex_init(&g_graceful_mutex) == 0);
+  g_gworker_cap = workers;
+  g_gworkers = lmalloc(sizeof(GracefulWorker) * workers);
+  memset(g_gworkers, 0, sizeof(GracefulWorker) * workers);
+
+  const char *env = getenv(GRACEFUL_READY_ENV);
+  if (env != NULL) {
+    g_ready_fd = atoi(env);
+    unsetenv(GRACEFUL_READY_ENV);
+  }
+}
+
+void graceful_register_worker(uv_loop_t *loop, uv_tcp_t *listener,
+    GracefulShedCb shed_cb) {
+  uv_mutex_lock(&g_graceful_mutex);
+  CHECK(g_gworker_count < g_gworker_cap);
+  GracefulWorker *gw = &g_gworkers[g_gworker_count++];
+  uv_mutex_unlock(&g_graceful_mutex);
+
+  gw->loop = loop;
+  gw->listener = listener;
+  gw->shed_cb = shed_cb;
+
+  // neither handle may keep the loop alive on its own, the listener and
+  // the relay timers do that
+  CHECK(uv_signal_init(loop, &gw->sig) == 0);
+  gw->sig.data = gw;
+  CHECK(uv_signal_start(&gw->sig, on_sigusr2, SIGUSR2) == 0);
+  uv_unref((uv_handle_t *)&gw->sig);
+
+  CHECK(uv_async_init(loop, &gw->drain_async, on_drain_async) == 0);
+  gw->drain_async.data = gw;
+  uv_unref((uv_handle_t *)&gw->drain_async);
+}
+
+void graceful_mark_ready() {
+  if (g_ready_fd < 0) {
+    return;
+  }
+  ssize_t n;
+  do {
+    n = write(g_ready_fd, "R", 1);
+  } while (n < 0 && errno == EINTR);
+  close(g_ready_fd);
+  g_ready_fd = -1;
+  LOG_I("listeners up, told the previous process to stop accepting");
+}
+
+void on_sigusr2(uv_signal_t *handle, int signum) {
+  uv_mutex_lock(&g_graceful_mutex);
+  if (g_restarting) {
+    uv_mutex_unlock(&g_graceful_mutex);
+    return;
+  }
+  g_restarting = 1;
+  uv_mutex_unlock(&g_graceful_mutex);
+
+  GracefulWorker *gw = handle->data;
+  LOG_I("SIGUSR2 received, spawning [%s] for a graceful restart", g_exe_path);
+  if (spawn_successor(gw->loop) != 0) {
+    LOG_E("graceful restart aborted, this process keeps serving");
+    g_restarting = 0;
+  }
+}
+
+int spawn_successor(uv_loop_t *loop) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    LOG_E("pipe failed: %s", strerror(errno));
+    return -1;
+  }
+  // the read end must not survive the exec, or a successor that dies
+  // before becoming ready would hold its own pipe open and we would
+  // never see the EOF below
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+
+  char fdstr[16];
+  snprintf(fdstr, sizeof(fdstr), "%d", fds[1]);
+  setenv(GRACEFUL_READY_ENV, fdstr, 1);
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    LOG_E("fork failed: %s", strerror(errno));
+    unsetenv(GRACEFUL_READY_ENV);
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    // only async-signal-safe calls are allowed here; a failed exec is
+    // reported through the pipe closing without a readiness byte
+    execv(g_exe_path, (char *const *)g_argv);
+    _exit(127);
+  }
+
+  unsetenv(GRACEFUL_READY_ENV);
+  close(fds[1]);
+  g_successor_fd = fds[0];
+  CHECK(uv_poll_init(loop, &g_successor_poll, g_successor_fd) == 0);
+  CHECK(uv_poll_start(&g_successor_poll, UV_READABLE, on_successor_status)
+      == 0);
+  LOG_I("new process %d spawned, waiting for its listeners", (int)pid);
+  return 0;
+}
+
+void on_successor_status(uv_poll_t *handle, int status, int events) {
+  char c;
+  ssize_t n = read(g_successor_fd, &c, 1);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return;
+  }
+
+  uv_poll_stop(&g_successor_poll);
+  uv_close((uv_handle_t *)&g_successor_poll, NULL);
+  close(g_successor_fd);
+  g_successor_fd = -1;
+
+  if (n <= 0) {
+    // EOF without the readiness byte: the successor died during startup
+    // (bad config, lost privilege on a low port, exec failure)
+    LOG_E("new process exited before its listeners came up, "
+        "graceful restart aborted, this process keeps serving");
+    g_restarting = 0;
+    return;
+  }
+
+  LOG_I("new process is accepting, draining %d worker(s)", g_gworker_count);
+  for (int i = 0; i < g_gworker_count; ++i) {
+    uv_async_send(&g_gworkers[i].drain_async);
+  }
+}
+
+// runs on each worker's own loop: stop accepting, then poll the worker's
+// session count until the last one is gone
+void on_drain_async(uv_async_t *handle) {
+  GracefulWorker *gw = handle->data;
+
+  uv_close((uv_handle_t *)gw->listener, NULL);
+  uv_signal_stop(&gw->sig);
+  uv_close((uv_handle_t *)&gw->sig, NULL);
+  uv_close((uv_handle_t *)&gw->drain_async, NULL);
+
+  if (gw->shed_cb != NULL) {
+    gw->shed_cb(gw->loop);
+  }
+
+  CHECK(uv_timer_init(gw->loop, &gw->drain_timer) == 0);
+  gw->drain_timer.data = gw;
+  CHECK(uv_timer_start(&gw->drain_timer, on_drain_tick, DRAIN_TICK_MS,
+        DRAIN_TICK_MS) == 0);
+}
+
+void on_drain_tick(uv_timer_t *handle) {
+  GracefulWorker *gw = handle->data;
+  // g_metrics is thread-local, so this sees exactly this worker's sessions
+  if (g_metrics.sessions_active > 0) {
+    if (++gw->ticks % DRAIN_LOG_EVERY == 0) {
+      LOG_I("draining, %d session(s) still open",
+          (int)g_metrics.sessions_active);
+    }
+    return;
+  }
+
+  LOG_I("worker drained, shutting down");
+  uv_timer_stop(&gw->drain_timer);
+  uv_close((uv_handle_t *)&gw->drain_timer, NULL);
+  uv_stop(gw->loop);
+
+  // the long-lived per-worker handles (udp relay, sweep timers) are never
+  // torn down on this path, so once the last worker has drained just exit
+  // instead of limping through loop close with live handles
+  uv_mutex_lock(&g_graceful_mutex);
+  int done = ++g_drained == g_gworker_count;
+  uv_mutex_unlock(&g_graceful_mutex);
+  if (done) {
+    LOG_I("all workers drained, graceful restart complete");
+    exit(0);
+  }
+}
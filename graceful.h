@@ -0,0 +1,39 @@
+#ifndef GRACEFUL_H_
+#define GRACEFUL_H_
+
+#include <uv.h>
+
+// Zero-downtime restart on SIGUSR2. The old process forks and execs its
+// own binary with the original arguments; the new process binds its
+// SO_REUSEPORT listeners next to the running ones and reports readiness
+// over a pipe inherited across the exec. Only then does the old process
+// close its listeners and drain: existing sessions keep relaying until
+// the last one ends, while the kernel steers every fresh connection to
+// the new process. Because each worker owns a SO_REUSEPORT listener there
+// is no single socket to hand over a unix socket; the overlapping bind
+// plays that role, so not even the readiness window drops connections.
+//
+// Caveat: a listener on a port under 1024 can only be rebound while the
+// new process still has the privilege, so with -u the restart is refused
+// by the child and the old process keeps serving.
+
+// call once on the main thread after argument parsing; argv must stay
+// valid for the lifetime of the process (main's argv does)
+void graceful_init(int workers, const char **argv);
+
+// called on the worker's loop when its drain begins, giving the server a
+// chance to close connections that hold no user traffic (the remote sheds
+// the warm tunnels parked by the local servers, which would otherwise
+// keep the old process alive indefinitely); may be NULL
+typedef void (*GracefulShedCb)(uv_loop_t *loop);
+
+// publishes a worker's loop and listener and installs its SIGUSR2
+// watcher; call from the worker thread once the listener is accepting
+void graceful_register_worker(uv_loop_t *loop, uv_tcp_t *listener,
+    GracefulShedCb shed_cb);
+
+// tells the previous process, if any, that every listener is up and it
+// may stop accepting; a no-op when not started by a graceful restart
+void graceful_mark_ready();
+
+#endif /* end of include guard: GRACEFUL_H_ */
@@ -63,7 +63,7 @@ void hashmap_remove(HashMap *hashmap, const char *key) {
   int index = index_for_hash(hash, hashmap->capacity_);
   Entry *prev = NULL;
   for (Entry *entry = hashmap->entries_[index]; entry; entry = entry->next_) {
-    if (hash == entry->hash_ || strcmp(entry->key_, key) == 0) {
+    if (hash == entry->hash_ && strcmp(entry->key_, key) == 0) {
       if (prev) {
         prev->next_ = entry->next_;
       } else {
@@ -75,6 +75,7 @@ void hashmap_remove(HashMap *hashmap, const char *key) {
       free((char *)entry->key_);
       free(entry);
       --hashmap->size_;
+      return;
     }
 
     prev = entry;
@@ -93,7 +94,7 @@ void hashmap_put(HashMap *hashmap, const char *key, void *value) {
   int hash = key_hash(h);
   int index = index_for_hash(hash, hashmap->capacity_);
   for (Entry *entry = hashmap->entries_[index]; entry; entry = entry->next_) {
-    if (hash == entry->hash_ || strcmp(entry->key_, key) == 0) {
+    if (hash == entry->hash_ && strcmp(entry->key_, key) == 0) {
       void *old_data = entry->data_;
       if (value == old_data) {
         return;
@@ -0,0 +1,89 @@
+#include <uv.h>
+
+#include "log/log.h"
+#include "idle_wheel.h"
+
+// one-second ticks give eviction a granularity nobody notices on an
+// idle timeout measured in minutes, and keep the wheel period (slots *
+// tick) long enough that a slot rarely holds more than one lap of
+// deadlines
+#define WHEEL_SLOTS 64
+#define WHEEL_TICK_MS 1000
+
+// the whole wheel is per worker like the rest of the relay state, so
+// touching a session never takes a lock
+static __thread IdleNode g_slots[WHEEL_SLOTS];  // circular list heads
+static __thread uv_timer_t g_wheel_timer;
+static __thread uv_loop_t *g_wheel_loop;
+static __thread uint64_t g_timeout_ms;
+static __thread IdleEvictCb g_evict_cb;
+static __thread uint64_t g_cursor;  // next slot index the tick scans
+
+static void idle_wheel_tick(uv_timer_t *timer);
+
+static void node_unlink(IdleNode *node) {
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+  node->prev = node->next = NULL;
+}
+
+void idle_wheel_init(uv_loop_t *loop, int timeout_s, IdleEvictCb evict_cb) {
+  if (timeout_s <= 0) {
+    return;
+  }
+  g_wheel_loop = loop;
+  g_timeout_ms = (uint64_t)timeout_s * 1000;
+  g_evict_cb = evict_cb;
+  for (int i = 0; i < WHEEL_SLOTS; ++i) {
+    g_slots[i].prev = g_slots[i].next = &g_slots[i];
+  }
+  g_cursor = uv_now(loop) / WHEEL_TICK_MS;
+  uv_timer_init(loop, &g_wheel_timer);
+  // the wheel must not keep a draining loop alive
+  uv_unref((uv_handle_t *)&g_wheel_timer);
+  uv_timer_start(&g_wheel_timer, idle_wheel_tick, WHEEL_TICK_MS,
+      WHEEL_TICK_MS);
+}
+
+void idle_wheel_touch(IdleNode *node) {
+  if (g_timeout_ms == 0) {
+    return;
+  }
+  if (node->prev != NULL) {
+    node_unlink(node);
+  }
+  node->deadline = uv_now(g_wheel_loop) + g_timeout_ms;
+  IdleNode *head = &g_slots[(node->deadline / WHEEL_TICK_MS) % WHEEL_SLOTS];
+  node->next = head->next;
+  node->prev = head;
+  head->next->prev = node;
+  head->next = node;
+}
+
+void idle_wheel_remove(IdleNode *node) {
+  if (g_timeout_ms == 0 || node->prev == NULL) {
+    return;
+  }
+  node_unlink(node);
+  node->deadline = 0;
+}
+
+// only the slot the cursor points at can hold due deadlines; entries
+// hashed here from a later lap stay for the next revolution
+void idle_wheel_tick(uv_timer_t *timer) {
+  uint64_t now = uv_now(g_wheel_loop);
+  // catch up if the loop stalled past one or more ticks
+  for (; g_cursor <= now / WHEEL_TICK_MS; ++g_cursor) {
+    IdleNode *head = &g_slots[g_cursor % WHEEL_SLOTS];
+    IdleNode *node = head->next;
+    while (node != head) {
+      IdleNode *next = node->next;  // the evict callback unlinks node
+      if (node->deadline <= now) {
+        LOG_V("evicting session idle for %d seconds",
+            (int)(g_timeout_ms / 1000));
+        g_evict_cb(node);
+      }
+      node = next;
+    }
+  }
+}
@@ -0,0 +1,36 @@
+#ifndef IDLE_WHEEL_H_
+#define IDLE_WHEEL_H_
+
+#include <stdint.h>
+#include <uv.h>
+
+// Hashed timer wheel evicting live-but-idle sessions. The TCP keepalive
+// only catches dead peers; a peer that stays connected without moving
+// bytes pins its buffers and fds forever. Giving every session its own
+// uv_timer_t would put one heap-managed timer per connection on the
+// loop, so instead each worker runs a single coarse timer over a wheel
+// of intrusive lists: touching a session on I/O completion is an O(1)
+// unlink/relink, and the tick only scans the one slot whose deadlines
+// can be due. Embed an IdleNode in the session and resolve it back with
+// container_of in the evict callback.
+
+typedef struct IdleNode {
+  struct IdleNode *prev;
+  struct IdleNode *next;
+  uint64_t deadline;  // uv_now deadline in ms, 0 while unlinked
+} IdleNode;
+
+typedef void (*IdleEvictCb)(IdleNode *node);
+
+// call once per worker loop; a timeout of 0 disables eviction and turns
+// the touch/remove calls below into no-ops
+void idle_wheel_init(uv_loop_t *loop, int timeout_s, IdleEvictCb evict_cb);
+
+// (re)arms the session's deadline; call on session start and on every
+// read/write completion
+void idle_wheel_touch(IdleNode *node);
+
+// unlinks the session from the wheel; call from the close path
+void idle_wheel_remove(IdleNode *node);
+
+#endif /* end of include guard: IDLE_WHEEL_H_ */
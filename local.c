@@ -7,8 +7,13 @@
 #include "util.h"
 #include "alloc.h"
 #include "socks5.h"
+#include "dns_cache.h"
+#include "udp_relay.h"
 #include "defs.h"
 #include "encrypt.h"
+#include "metrics.h"
+#include "acl.h"
+#include "graceful.h"
 #include "cli.h"
 
 #ifdef __APPLE__
@@ -16,8 +21,46 @@
 #include "proxy_config.h"
 #endif
 
+#if defined(__linux__)
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#endif
+
 #define SERVER_BACKLOG 256
 #define KEEPALIVE 60
+#define TUNNEL_POOL_SIZE_DEFAULT 4
+#define TUNNEL_POOL_MAX 32
+#define TUNNEL_REFILL_MS_DEFAULT 250
+
+#if defined(__linux__)
+// DIRECT sessions carry plaintext, so once the handshake is over the two
+// sockets can be bridged entirely inside the kernel: each direction gets a
+// pipe and payload moves with splice(2), never entering userspace. libuv
+// keeps owning the uv_tcp_t handles (quiesced with uv_read_stop); the
+// relay polls dup'ed fds so the epoll registrations do not collide.
+#define SPLICE_CHUNK (1 << 20)
+
+typedef struct {
+  int pipefd[2];  // kernel buffer between the two sockets
+  int buffered;   // bytes currently sitting in the pipe
+  int src_eof;
+  int done;       // EOF propagated and the pipe fully drained
+} SpliceDir;
+
+typedef struct {
+  Session *sess;
+  uv_poll_t client_poll;
+  uv_poll_t upstream_poll;
+  int client_fd;    // dup'ed from the uv_tcp_t handles
+  int upstream_fd;
+  SpliceDir c2u;    // client -> upstream
+  SpliceDir u2c;    // upstream -> client
+  int closing;
+  int polls_closed;
+} SpliceRelay;
+#endif
 
 typedef struct {
   const char *host;
@@ -25,10 +68,8 @@ typedef struct {
   int backlog;
 } LocalServerCfg;
 
+// the remote addresses themselves live in g_remotes since -H takes a list
 typedef struct {
-  const char *host;
-  int port;
-  struct sockaddr_storage addr;
   const char *cipher_name;
   const char *cipher_secret;
 } RemoteServerCfg;
@@ -50,11 +91,88 @@ typedef struct {
   RemoteServerCfg rs_cfg;
 } ServerContext;
 
-static ServerContext *g_server_ctx;
-static uv_loop_t *g_loop;
+// every worker thread runs its own loop with its own ServerContext, so the
+// hot path stays lock-free; the main thread resolves the addresses once and
+// the workers copy the result out of g_ctx_template
+static __thread ServerContext *g_server_ctx;
+static __thread uv_loop_t *g_loop;
 static LocalServerCliCfg g_cli_cfg = { 0 };
 
+// backpressure marks for the pipelined relay, fixed at startup (-W/-L)
+// and read-only while the workers run
+static int g_pipe_high_wm = PIPE_HIGH_WATERMARK_DEFAULT;
+static int g_pipe_low_wm = PIPE_LOW_WATERMARK_DEFAULT;
+
+static ServerContext g_ctx_template;
+static struct sockaddr_storage g_listen_addr;
+static char g_listen_ipstr[INET6_ADDRSTRLEN];
+static uv_barrier_t g_worker_barrier;
+
+typedef struct {
+  uv_thread_t thread;
+  int idx;
+} Worker;
+
+// a pre-established connection to the remote server waiting to be adopted
+// by a session, see tunnel_pool_take()
+typedef struct {
+  uv_tcp_t *tcp;
+  uv_connect_t connect_req;
+  uint64_t start_ns;  // when the connect was issued, feeds the remote EWMA
+  int remote_idx;     // which remote this tunnel leads to
+  int ready;
+} TunnelConn;
+
+// pool dimensions are fixed at startup (-T/-R) and read-only afterwards,
+// like the watermarks above
+static int g_tunnel_pool_size = TUNNEL_POOL_SIZE_DEFAULT;
+static int g_tunnel_refill_ms = TUNNEL_REFILL_MS_DEFAULT;
+
+static __thread TunnelConn g_tunnel_pool[TUNNEL_POOL_MAX];
+static __thread int g_tunnel_pool_started;
+static __thread uv_timer_t g_tunnel_refill_timer;
+
+// -H accepts a comma-separated list of remotes; each worker probes them
+// and steers new tunnels to the fastest healthy one
+#define REMOTE_MAX 8
+#define PROBE_INTERVAL_MS 3000
+#define REMOTE_DOWN_FAILS 2
+#define REMOTE_COOLDOWN_MS 10000
+
+typedef struct {
+  char *host;
+  int port;
+  struct sockaddr_storage addr;
+} RemoteAddr;
+
+// parsed and resolved once on the main thread, read-only afterwards
+static RemoteAddr g_remotes[REMOTE_MAX];
+static int g_remote_count;
+static int g_remote_resolved;  // resolver progress during startup
+
+typedef struct RemoteProbe {
+  uv_tcp_t tcp;
+  uv_connect_t req;
+  uint64_t start_ns;
+  int idx;
+  int cancelled;
+} RemoteProbe;
+
+// health is per worker like the rest of the relay state, so probing and
+// selection stay lock-free
+typedef struct {
+  double ewma_ms;       // smoothed connect RTT, 0 = no sample yet
+  int fails;            // consecutive connect failures
+  uint64_t down_until;  // uv_now deadline while the peer cools down
+  RemoteProbe *inflight;
+} RemoteHealth;
+
+static __thread RemoteHealth g_remote_health[REMOTE_MAX];
+static __thread uv_timer_t g_probe_timer;
+
 static void start_server(int argc, const char *argv[]);
+static void start_workers(int workers);
+static void worker_thread(void *arg);
 static void do_bind_and_listen(uv_getaddrinfo_t* req, int status, 
     struct addrinfo* res);
 static void on_remote_host_resolved(uv_getaddrinfo_t* req, int status, 
@@ -62,10 +180,10 @@ static void on_remote_host_resolved(uv_getaddrinfo_t* req, int status,
 static void on_connection_new(uv_stream_t *server, int status);
 
 static int init_tcp_handle(Session *sess, uv_tcp_t **tcp_handle);
-static int init_udp_handle(Session *sess, uv_udp_t **udp_handle);
 
 static Session *create_session();
 static void close_session(Session *sess);
+static void evict_idle_session(IdleNode *node);
 static void close_handle(Session *sess, uv_handle_t *handle);
 static void handle_close_cb(uv_handle_t *handle);
 static void finish_socks5_tcp_handshake(Session *sess);
@@ -79,7 +197,9 @@ static int client_tcp_write_string(uv_stream_t *handle,
 static int client_tcp_write_error(uv_stream_t *handle, int err);
 static void on_client_tcp_alloc(uv_handle_t *handle, size_t size, 
     uv_buf_t *buf);
-static void on_client_tcp_read_done(uv_stream_t *handle, ssize_t nread, 
+static void on_client_tcp_read_done(uv_stream_t *handle, ssize_t nread,
+    const uv_buf_t *buf);
+static void client_tcp_read_dispatch(uv_stream_t *handle, ssize_t nread,
     const uv_buf_t *buf);
 static void on_client_tcp_write_done(uv_write_t *req, int status);
 static void handle_socks5_method_identification(uv_stream_t *handle, 
@@ -96,27 +216,58 @@ static int upstream_tcp_read_start(uv_stream_t *handle);
 static int upstream_tcp_write_start(uv_stream_t *handle, const uv_buf_t *buf);
 static void on_upstream_tcp_alloc(uv_handle_t *handle, size_t size, 
     uv_buf_t *buf);
-static void on_upstream_tcp_read_done(uv_stream_t *handle, ssize_t nread, 
+static void on_upstream_tcp_read_done(uv_stream_t *handle, ssize_t nread,
+    const uv_buf_t *buf);
+static void upstream_tcp_read_dispatch(uv_stream_t *handle, ssize_t nread,
     const uv_buf_t *buf);
+static void upstream_tcp_connect_dispatch(uv_connect_t *req, int status);
 static void on_upstream_tcp_write_done(uv_write_t *req, int status);
+static PipeSlot *pipe_slot_take(StreamPipe *pipe);
+static PipeSlot *pipe_slot_from_base(StreamPipe *pipe, const char *base);
+static void pipe_read_observe(StreamPipe *pipe, PipeSlot *slot, int nread,
+    int tier_cap);
+static int stream_pipe_write(Session *sess, StreamPipe *pipe, PipeSlot *slot,
+    uv_stream_t *dst, char *data, int len, uv_write_cb cb);
+static void crypto_job_submit(TCPSession *sess, PipeSlot *slot, char *data,
+    int len, int encrypt);
+static void crypto_work_cb(uv_work_t *w);
+static void crypto_after_cb(uv_work_t *w, int status);
+static void on_to_upstream_pipe_write_done(uv_write_t *req, int status);
+static int flush_decrypt_backlog(TCPSession *sess);
+static void on_to_client_pipe_write_done(uv_write_t *req, int status);
 
-static void on_client_udp_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf);
-static void on_client_udp_recv_done(uv_udp_t *handle, ssize_t nread, 
-    const uv_buf_t *buf, const struct sockaddr *addr, unsigned flags);
-static void on_upstream_udp_send_done(uv_udp_send_t *req, int status);
-static void on_upstream_udp_alloc(uv_handle_t *handle, size_t size, 
-    uv_buf_t *buf);
-static void on_upstream_udp_recv_done(uv_udp_t *handle, ssize_t nread, 
-    const uv_buf_t *buf, const struct sockaddr *addr, unsigned flags);
-static void on_client_udp_send_done(uv_udp_send_t *req, int status);
-static int client_udp_recv_start(UDPSession *sess);
-static void upstream_udp_send(uv_getaddrinfo_t *req, int status, 
-    struct addrinfo *res);
-static void init_client_udp_send_if_needed(UDPSession *sess);
-static void client_udp_send_domain_resolved(uv_getaddrinfo_t *req, int status, 
-    struct addrinfo *res);
 
 static int is_proxy_connect(Session *sess);
+static int acl_says_direct(Socks5Ctx *s5_ctx);
+static void direct_upstream_connect(Session *sess);
+
+#if defined(__linux__)
+static int splice_relay_start(Session *sess);
+static void splice_relay_close(SpliceRelay *relay);
+static void splice_poll_cb(uv_poll_t *handle, int status, int events);
+static void splice_poll_close_cb(uv_handle_t *handle);
+#endif
+
+#if defined(__linux__) && defined(TCP_FASTOPEN_CONNECT)
+static void tcp_enable_fastopen_connect(uv_tcp_t *handle, int family);
+#endif
+static void tunnel_conn_connect(TunnelConn *conn);
+static void tunnel_conn_connect_cb(uv_connect_t *req, int status);
+static void tunnel_refill_tick(uv_timer_t *timer);
+static void remote_list_parse(char *list, int default_port);
+static int remote_pick();
+static int remote_is_down(int idx);
+static void remote_observe(int idx, uint64_t start_ns);
+static void remote_mark_failure(int idx);
+static void remote_probes_start(uv_loop_t *loop);
+static void remote_probe_tick(uv_timer_t *timer);
+static void remote_probe_connect_cb(uv_connect_t *req, int status);
+static void remote_probe_close_cb(uv_handle_t *handle);
+static void tunnel_conn_close_cb(uv_handle_t *handle);
+static void tunnel_conn_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf);
+static void tunnel_conn_read_cb(uv_stream_t *handle, ssize_t nread, 
+    const uv_buf_t *buf);
+static uv_tcp_t *tunnel_pool_take();
 
 int main(int argc, const char *argv[]) {
   start_server(argc, argv);
@@ -156,65 +307,190 @@ void start_server(int argc, const char *argv[]) {
 
   g_loop = uv_default_loop();
 
-  ServerContext server_ctx;
-  memset(&server_ctx, 0, sizeof(ServerContext));
-  g_server_ctx = &server_ctx;
+  memset(&g_ctx_template, 0, sizeof(ServerContext));
+  g_server_ctx = &g_ctx_template;
 
-  server_ctx.ls_sfg.host = g_cli_cfg.local_host;
-  server_ctx.ls_sfg.port = g_cli_cfg.local_port;
-  server_ctx.ls_sfg.backlog = SERVER_BACKLOG;
+  g_ctx_template.ls_sfg.host = g_cli_cfg.local_host;
+  g_ctx_template.ls_sfg.port = g_cli_cfg.local_port;
+  g_ctx_template.ls_sfg.backlog =
+      g_cli_cfg.backlog > 0 ? g_cli_cfg.backlog : SERVER_BACKLOG;
 
-  server_ctx.rs_cfg.cipher_name = g_cli_cfg.cipher_name;
-  server_ctx.rs_cfg.cipher_secret = g_cli_cfg.cipher_secret;
-  server_ctx.rs_cfg.host = g_cli_cfg.remote_host;
-  server_ctx.rs_cfg.port = g_cli_cfg.remote_port;
+  g_ctx_template.rs_cfg.cipher_name = g_cli_cfg.cipher_name;
+  g_ctx_template.rs_cfg.cipher_secret = g_cli_cfg.cipher_secret;
+  remote_list_parse(g_cli_cfg.remote_host, g_cli_cfg.remote_port);
 
-  // used after local host is resolved and bound a port. 
+  // used after local host is resolved and bound a port.
   // The reason we do setuid after binding on local port is that the local port
   // may be under 1024, which requires root permission
-  server_ctx.ls_addrinfo_req.data = &g_cli_cfg;
+  g_ctx_template.ls_addrinfo_req.data = &g_cli_cfg;
 
   cipher_global_init();
+  if (g_cli_cfg.compress && cipher_set_framing(1) != 0) {
+    exit(1);
+  }
+
+  if (g_cli_cfg.high_watermark > 0) {
+    g_pipe_high_wm = g_cli_cfg.high_watermark;
+  }
+  if (g_cli_cfg.low_watermark > 0) {
+    g_pipe_low_wm = g_cli_cfg.low_watermark;
+  }
+  if (g_pipe_low_wm >= g_pipe_high_wm) {
+    LOG_E("low_watermark (%d) must be below high_watermark (%d)",
+        g_pipe_low_wm, g_pipe_high_wm);
+    exit(1);
+  }
+
+  if (g_cli_cfg.tunnel_pool > 0) {
+    g_tunnel_pool_size = g_cli_cfg.tunnel_pool;
+    if (g_tunnel_pool_size > TUNNEL_POOL_MAX) {
+      LOG_W("tunnel_pool capped at %d per worker", TUNNEL_POOL_MAX);
+      g_tunnel_pool_size = TUNNEL_POOL_MAX;
+    }
+  }
+  if (g_cli_cfg.tunnel_refill_ms > 0) {
+    g_tunnel_refill_ms = g_cli_cfg.tunnel_refill_ms;
+  }
+
+  // compiled once here, the workers share the tables read-only
+  if (g_cli_cfg.acl_file != NULL && acl_load(g_cli_cfg.acl_file) != 0) {
+    exit(1);
+  }
+
+  graceful_init(g_cli_cfg.workers <= 1 ? 1 : g_cli_cfg.workers, argv);
+
+  // in multi-worker mode the workers register their own metrics and
+  // worker #0 owns the dump signal, the main loop drains before relaying
+  if (g_cli_cfg.workers <= 1) {
+    metrics_worker_register();
+    metrics_install_dump_signal(g_loop);
+    stall_prof_install(g_loop, g_cli_cfg.stall_ms);
+    idle_wheel_init(g_loop, g_cli_cfg.idle_timeout, evict_idle_session);
+  }
 
   struct addrinfo hint;
   memset(&hint, 0, sizeof(hint));
   hint.ai_family = AF_UNSPEC;
   hint.ai_socktype = SOCK_STREAM;
   hint.ai_protocol = IPPROTO_TCP;
-  CHECK(uv_getaddrinfo(g_loop, 
-                       &g_server_ctx->rs_addrinfo_req, 
-                       on_remote_host_resolved, 
-                       g_cli_cfg.remote_host, 
-                       NULL, 
+  CHECK(uv_getaddrinfo(g_loop,
+                       &g_server_ctx->rs_addrinfo_req,
+                       on_remote_host_resolved,
+                       g_remotes[0].host,
+                       NULL,
                        &hint) == 0);
 
   uv_run(g_loop, UV_RUN_DEFAULT);
+
+  // in multi-worker mode do_bind_and_listen only records the listen address
+  // and lets the loop drain, so we get here while the process is starting up
+  if (g_cli_cfg.workers > 1) {
+    start_workers(g_cli_cfg.workers);
+  }
+
   uv_loop_close(g_loop);
   uv_loop_delete(g_loop);
 }
 
-void on_remote_host_resolved(uv_getaddrinfo_t* req, int status, 
+void start_workers(int workers) {
+  uv_barrier_init(&g_worker_barrier, workers + 1);
+
+  Worker *w = lmalloc(sizeof(Worker) * workers);
+  for (int i = 0; i < workers; ++i) {
+    w[i].idx = i;
+    CHECK(uv_thread_create(&w[i].thread, worker_thread, &w[i]) == 0);
+  }
+
+  // all workers have bound their listeners once the barrier is passed,
+  // which may require root for ports under 1024, so only then drop privileges
+  uv_barrier_wait(&g_worker_barrier);
+  uv_barrier_destroy(&g_worker_barrier);
+  if (g_cli_cfg.user) {
+    do_setuid(g_cli_cfg.user);
+  }
+  graceful_mark_ready();
+
+  for (int i = 0; i < workers; ++i) {
+    uv_thread_join(&w[i].thread);
+  }
+  free(w);
+}
+
+void worker_thread(void *arg) {
+  Worker *w = arg;
+
+  uv_loop_t loop;
+  CHECK(uv_loop_init(&loop) == 0);
+  g_loop = &loop;
+
+  metrics_worker_register();
+  if (w->idx == 0) {
+    metrics_install_dump_signal(&loop);
+  }
+  stall_prof_install(&loop, g_cli_cfg.stall_ms);
+  idle_wheel_init(&loop, g_cli_cfg.idle_timeout, evict_idle_session);
+
+  ServerContext server_ctx;
+  memcpy(&server_ctx, &g_ctx_template, sizeof(ServerContext));
+  g_server_ctx = &server_ctx;
+
+  int err;
+  if ((err = tcp_bind_reuseport(&loop, &server_ctx.ls_server_tcp,
+          (struct sockaddr *)&g_listen_addr, server_ctx.ls_sfg.backlog,
+          on_connection_new)) != 0) {
+    LOG_E("worker #%d failed to listen on %s:%d: %s", w->idx, g_listen_ipstr,
+        server_ctx.ls_sfg.port, uv_strerror(err));
+    exit(1);
+  }
+
+  LOG_I("worker #%d listening on %s:%d", w->idx, g_listen_ipstr,
+      server_ctx.ls_sfg.port);
+  graceful_register_worker(&loop, &server_ctx.ls_server_tcp, NULL);
+  remote_probes_start(&loop);
+  uv_barrier_wait(&g_worker_barrier);
+
+  uv_run(&loop, UV_RUN_DEFAULT);
+  uv_loop_close(&loop);
+}
+
+void on_remote_host_resolved(uv_getaddrinfo_t* req, int status,
     struct addrinfo* res) {
+  RemoteAddr *r = &g_remotes[g_remote_resolved];
   if (status < 0 || res == NULL) {
-    LOG_E("cannot resolve remote host(\"%s\"): %s", g_server_ctx->rs_cfg.host, 
+    LOG_E("cannot resolve remote host(\"%s\"): %s", r->host,
         uv_strerror(status));
     exit(1);
   }
 
   char ipstr[INET6_ADDRSTRLEN];
-  // only the first ip in the list is used, so if the selected ip here is 
-  // unreachable, do not use domain name for the --remote_host option, use a 
+  // only the first ip in the list is used, so if the selected ip here is
+  // unreachable, do not use domain name for the --remote_host option, use a
   // usable ip directly
-  if (fill_ipaddr((struct sockaddr *)&g_server_ctx->rs_cfg.addr, 
-        htons(g_server_ctx->rs_cfg.port), 
+  if (fill_ipaddr((struct sockaddr *)&r->addr, htons(r->port),
         ipstr, sizeof(ipstr), res) != 0) {
     exit(1);
   }
 
-  LOG_I("remote host [%s] resolved to [%s]", g_server_ctx->rs_cfg.host, ipstr);
+  LOG_I("remote host [%s] resolved to [%s]", r->host, ipstr);
   uv_freeaddrinfo(res);
 
-  // remote host is resolved successfully, now resolve local host and bind on
+  // walk the rest of the -H list before touching the local side
+  if (++g_remote_resolved < g_remote_count) {
+    struct addrinfo hint;
+    memset(&hint, 0, sizeof(hint));
+    hint.ai_family = AF_UNSPEC;
+    hint.ai_socktype = SOCK_STREAM;
+    hint.ai_protocol = IPPROTO_TCP;
+    CHECK(uv_getaddrinfo(g_loop,
+                         &g_server_ctx->rs_addrinfo_req,
+                         on_remote_host_resolved,
+                         g_remotes[g_remote_resolved].host,
+                         NULL,
+                         &hint) == 0);
+    return;
+  }
+
+  // all remotes resolved successfully, now resolve local host and bind on
   // the specified port for local host.
   struct addrinfo hint;
   memset(&hint, 0, sizeof(hint));
@@ -237,9 +513,6 @@ void do_bind_and_listen(uv_getaddrinfo_t* req, int status, struct addrinfo* res)
     return;
   }
 
-  // abort if failing to init uv_tcp_t
-  CHECK(uv_tcp_init(g_loop, &g_server_ctx->ls_server_tcp) == 0);
-
   struct sockaddr_storage addr;
   char ipstr[INET6_ADDRSTRLEN];
 
@@ -256,33 +529,41 @@ void do_bind_and_listen(uv_getaddrinfo_t* req, int status, struct addrinfo* res)
 
     } else if (ai->ai_family == AF_INET6) {
       g_server_ctx->bound_ip_version = IPV6;
-      memcpy(g_server_ctx->bound_ip, 
+      memcpy(g_server_ctx->bound_ip,
           ((struct sockaddr_in6 *)&addr)->sin6_addr.s6_addr, 16);
     }
 
-    int err;
-    if ((err = uv_tcp_bind(&g_server_ctx->ls_server_tcp, 
-            (struct sockaddr *)&addr, 0)) != 0) {
-      LOG_W("uv_tcp_bind on %s:%d failed: %s", 
-          ipstr, g_server_ctx->ls_sfg.port, uv_strerror(err));
-      continue;
+    if (g_cli_cfg.workers > 1) {
+      // the workers bind their own SO_REUSEPORT listeners, just remember
+      // the address we settled on and let the startup loop drain
+      memcpy(&g_listen_addr, &addr, sizeof(addr));
+      memcpy(g_listen_ipstr, ipstr, sizeof(g_listen_ipstr));
+      uv_freeaddrinfo(res);
+      return;
     }
 
-    if ((err = uv_listen((uv_stream_t *)&g_server_ctx->ls_server_tcp, 
-          g_server_ctx->ls_sfg.backlog, 
-          on_connection_new)) != 0) {
-      LOG_W("uv_tcp_listen on %s:%d failed: %s", 
+    // the single listener binds with SO_REUSEPORT like the workers do, so
+    // a graceful restart's new process can bind alongside before this one
+    // stops accepting
+    int err;
+    if ((err = tcp_bind_reuseport(g_loop, &g_server_ctx->ls_server_tcp,
+            (struct sockaddr *)&addr, g_server_ctx->ls_sfg.backlog,
+            on_connection_new)) != 0) {
+      LOG_W("listening on %s:%d failed: %s",
           ipstr, g_server_ctx->ls_sfg.port, uv_strerror(err));
       continue;
     }
-    
+
     LOG_I("server listening on %s:%d", ipstr, g_server_ctx->ls_sfg.port);
+    graceful_register_worker(g_loop, &g_server_ctx->ls_server_tcp, NULL);
+    remote_probes_start(g_loop);
     uv_freeaddrinfo(res);
 
     LocalServerCliCfg *g_cli_cfg = req->data;
     if (g_cli_cfg->user) {
       do_setuid(g_cli_cfg->user);
     }
+    graceful_mark_ready();
 
     return;
   }
@@ -292,9 +573,15 @@ void do_bind_and_listen(uv_getaddrinfo_t* req, int status, struct addrinfo* res)
 } 
 
 Session *create_session() {
-  Session *sess = lmalloc(sizeof(Session));
+  // the pool block fits either session flavor, only the generic part needs
+  // to be cleared here, the TCP/UDP extension fields are zeroed when the
+  // session is specialized in handle_socks5_request
+  Session *sess = lpool_take(POOL_SESSION, sizeof(SessionStorage));
+  SESSION_CLEAR(sess);
   sess->state = S5_METHOD_IDENTIFICATION;
   sess->type = SESSION_TYPE_UNKNOWN;
+  idle_wheel_touch(&sess->idle_node);
+  ++g_metrics.sessions_active;
 
   cipher_ctx_init(&sess->e_ctx, g_server_ctx->rs_cfg.cipher_name, 
       g_server_ctx->rs_cfg.cipher_secret);
@@ -304,7 +591,7 @@ Session *create_session() {
 }
 
 int init_tcp_handle(Session *sess, uv_tcp_t **tcp_handle) {
-  *tcp_handle = lmalloc(sizeof(uv_tcp_t));
+  *tcp_handle = lpool_take(POOL_UV_TCP, sizeof(uv_tcp_t));
   (*tcp_handle)->data = sess;
 
   int err;
@@ -321,25 +608,39 @@ int init_tcp_handle(Session *sess, uv_tcp_t **tcp_handle) {
   return 0;
 }
 
-int init_udp_handle(Session *sess, uv_udp_t **udp_handle) {
-  *udp_handle = lmalloc(sizeof(uv_udp_t));
-  (*udp_handle)->data = sess;
-
-  int err;
-  if ((err = uv_udp_init(g_loop, *udp_handle)) != 0) {
-    LOG_E("uv_udp_init failed: %s", uv_strerror(err));
-    close_session(sess);
-    return err;
+void close_session(Session *sess) {
+  if (sess->state == S5_CLOSING) {
+    return;
   }
 
-  return 0;
-}
+#if defined(__linux__)
+  // a spliced session owns dup'ed fds and two poll handles; tear those
+  // down first, their close callback re-enters here once they are gone
+  if (sess->type == SESSION_TYPE_TCP &&
+      ((TCPSession *)sess)->splice_relay != NULL) {
+    splice_relay_close((SpliceRelay *)((TCPSession *)sess)->splice_relay);
+    return;
+  }
+#endif
 
-void close_session(Session *sess) {
-  if (sess->state == S5_CLOSING) {
+  if (sess->type == SESSION_TYPE_TCP &&
+      (((TCPSession *)sess)->crypto_to_upstream.busy ||
+       ((TCPSession *)sess)->crypto_to_client.busy)) {
+    // a crypto job still reads the cipher contexts on a threadpool
+    // thread; remember the close, the last completion re-enters here
+    TCPSession *tcp_sess = (TCPSession *)sess;
+    tcp_sess->crypto_close_pending = 1;
+    if (sess->client_tcp != NULL) {
+      uv_read_stop((uv_stream_t *)sess->client_tcp);
+    }
+    if (tcp_sess->upstream_tcp != NULL) {
+      uv_read_stop((uv_stream_t *)tcp_sess->upstream_tcp);
+    }
     return;
   }
+
   sess->state = S5_CLOSING;
+  idle_wheel_remove(&sess->idle_node);
 
   LOG_V("now will close session: %p", sess);
   if (sess->type == SESSION_TYPE_TCP) {
@@ -349,12 +650,9 @@ void close_session(Session *sess) {
     close_handle(sess, (uv_handle_t *)tcp_sess->upstream_tcp);
 
   } else if (sess->type == SESSION_TYPE_UDP) {
-    sess->heap_obj_count = 4;
-
-    UDPSession *udp_sess = (UDPSession *)sess;
-    close_handle(sess, (uv_handle_t *)udp_sess->upstream_udp);
-    close_handle(sess, (uv_handle_t *)udp_sess->client_udp_send);
-    close_handle(sess, (uv_handle_t *)udp_sess->client_udp_recv);
+    // only the TCP control channel belongs to the session; the datagram
+    // flows live in the shared relay and expire on their own (udp_relay.c)
+    sess->heap_obj_count = 1;
   } else {
     sess->heap_obj_count = 1;
     // type is unknown, which means the SOCKS5 connection was not 
@@ -365,6 +663,19 @@ void close_session(Session *sess) {
   close_handle(sess, (uv_handle_t *)sess->client_tcp);
 }
 
+// the idle wheel found a session with no I/O since the timeout. UDP
+// associates are exempt: the control channel is quiet by design while
+// datagrams move, and the relay sweeps its own idle flows (udp_relay.c)
+void evict_idle_session(IdleNode *node) {
+  Session *sess = container_of(node, Session, idle_node);
+  if (sess->type == SESSION_TYPE_UDP) {
+    idle_wheel_remove(node);
+    return;
+  }
+  LOG_V("closing idle session: %p", sess);
+  close_session(sess);
+}
+
 void close_handle(Session *sess, uv_handle_t *handle) {
   if (handle == NULL) {
     --sess->heap_obj_count;
@@ -385,14 +696,37 @@ void close_handle(Session *sess, uv_handle_t *handle) {
 void handle_close_cb(uv_handle_t *handle) {
   Session *sess = handle->data;
   --sess->heap_obj_count;
-  free(handle);
+  lpool_return(handle->type == UV_UDP ? POOL_UV_UDP : POOL_UV_TCP, handle);
 
   if (sess->heap_obj_count == 0) {
     LOG_V("now will free the session object: %p", sess);
+    --g_metrics.sessions_active;
+    if (sess->client_buf != NULL) {
+      lpool_return(POOL_BUF_SMALL, sess->client_buf);
+      sess->client_buf = NULL;
+    }
+    if (sess->type == SESSION_TYPE_TCP) {
+      // in-flight slots were already handed back by their (cancelled)
+      // write callbacks, this catches buffers a read borrowed but never
+      // queued on the peer
+      TCPSession *tcp_sess = (TCPSession *)sess;
+      for (int i = 0; i < PIPE_DEPTH; ++i) {
+        if (tcp_sess->to_upstream.slots[i].buf != NULL) {
+          lpool_return(POOL_BUF_LARGE + tcp_sess->to_upstream.slots[i].tier,
+              tcp_sess->to_upstream.slots[i].buf);
+          tcp_sess->to_upstream.slots[i].buf = NULL;
+        }
+        if (tcp_sess->to_client.slots[i].buf != NULL) {
+          lpool_return(POOL_BUF_LARGE + tcp_sess->to_client.slots[i].tier,
+              tcp_sess->to_client.slots[i].buf);
+          tcp_sess->to_client.slots[i].buf = NULL;
+        }
+      }
+    }
     cipher_ctx_destroy(&sess->e_ctx);
     cipher_ctx_destroy(&sess->d_ctx);
     free(sess->socks5_req_data);
-    free(sess);
+    lpool_return(POOL_SESSION, sess);
   }
 }
 
@@ -402,22 +736,29 @@ void on_connection_new(uv_stream_t *server, int status) {
     return;
   }
 
-  LOG_V(">>>> accepted new connection");
-  Session *sess = create_session();
+  // drain every connection the kernel has queued before returning to the
+  // loop; browsers open bursts of parallel connections and taking them
+  // one per event leaves the rest waiting in the SYN queue
+  for (;;) {
+    Session *sess = create_session();
 
-  if (init_tcp_handle(sess, &sess->client_tcp) < 0) {
-    close_session(sess);
-    return;
-  }
+    if (init_tcp_handle(sess, &sess->client_tcp) < 0) {
+      close_session(sess);
+      return;
+    }
 
-  int err;
-  if ((err = uv_accept(server, (uv_stream_t *)sess->client_tcp)) != 0) {
-    LOG_E("uv_accept failed: %s", uv_strerror(err));
-    close_session(sess);
-    return;
-  }
+    int err;
+    if ((err = uv_accept(server, (uv_stream_t *)sess->client_tcp)) != 0) {
+      if (err != UV_EAGAIN) {
+        LOG_E("uv_accept failed: %s", uv_strerror(err));
+      }
+      close_session(sess);
+      return;
+    }
 
-  client_tcp_read_start((uv_stream_t *)sess->client_tcp);
+    LOG_V(">>>> accepted new connection");
+    client_tcp_read_start((uv_stream_t *)sess->client_tcp);
+  }
 }
 
 int client_tcp_read_start(uv_stream_t *handle) {
@@ -495,6 +836,20 @@ void on_client_tcp_write_done(uv_write_t *req, int status) {
     if (sess->state < S5_STREAMING) {
       if (sess->state == S5_FINISHING_HANDSHAKE) {
         sess->state = S5_STREAMING;
+        // the handshake buffer is done (the reply sent from it included),
+        // streaming reads go through the pipe slots
+        if (sess->client_buf != NULL) {
+          lpool_return(POOL_BUF_SMALL, sess->client_buf);
+          sess->client_buf = NULL;
+        }
+#if defined(__linux__)
+        // a DIRECT session relays plaintext, nothing for userspace to do:
+        // bridge the two sockets inside the kernel instead of reading
+        if (sess->type == SESSION_TYPE_TCP && !is_proxy_connect(sess) &&
+            splice_relay_start(sess) == 0) {
+          return;
+        }
+#endif
       }
       client_tcp_read_start((uv_stream_t *)sess->client_tcp);
     }
@@ -510,148 +865,825 @@ void on_client_tcp_write_done(uv_write_t *req, int status) {
 
 void on_client_tcp_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
   Session *sess = (Session *)handle->data;
-  buf->base = sess->client_buf;
-  // reserve some space for encrypted version of the data
-  buf->len = sizeof(sess->client_buf) - MAX_IV_LEN;
+  if (sess->state == S5_STREAMING && sess->type == SESSION_TYPE_TCP) {
+    // streaming reads go through the pipe slots so several writes can be
+    // in flight at once; when every slot is busy the read comes back as
+    // UV_ENOBUFS and is restarted from the pipe write callback
+    PipeSlot *slot = pipe_slot_take(&((TCPSession *)sess)->to_upstream);
+    if (slot == NULL) {
+      buf->base = NULL;
+      buf->len = 0;
+      return;
+    }
+    buf->base = slot->buf + CRYPTO_HEADROOM;
+    buf->len = READ_TIER_SIZE(slot->tier);
+    return;
+  }
+  // handshake phase: borrow a small buffer, it is handed back once the
+  // session enters streaming. Leave room around the data so
+  // stream_encrypt_to can prepend the IV or frame an AEAD record in place
+  if (sess->client_buf == NULL) {
+    sess->client_buf = lpool_take(POOL_BUF_SMALL, SESSION_SMALL_BUFSIZ);
+  }
+  buf->base = sess->client_buf + CRYPTO_HEADROOM;
+  buf->len = SESSION_SMALL_BUFSIZ - CRYPTO_HEADROOM - CRYPTO_TAILROOM;
 }
 
 int is_proxy_connect(Session *sess) {
   return sess->socks5_req_data_len > 0;
 }
 
-void on_client_tcp_read_done(uv_stream_t *handle, ssize_t nread, 
-    const uv_buf_t *buf) {
-  if (nread == 0) { // EAGAIN || EWOULDBLOCK
-    return;
+int acl_says_direct(Socks5Ctx *s5_ctx) {
+  if (s5_ctx->atyp == S5_ATYP_DOMAIN) {
+    return acl_match_host((const char *)s5_ctx->dst_addr) == ACL_DIRECT;
   }
-
-  Session *sess = (Session *)handle->data;
-  if (sess == NULL || sess->state == S5_CLOSING) {
-    return;
+  if (s5_ctx->atyp == S5_ATYP_IPV4) {
+    struct sockaddr_in addr4;
+    addr4.sin_family = AF_INET;
+    memcpy(&addr4.sin_addr.s_addr, s5_ctx->dst_addr, 4);
+    return acl_match_addr((struct sockaddr *)&addr4) == ACL_DIRECT;
+  }
+  if (s5_ctx->atyp == S5_ATYP_IPV6) {
+    struct sockaddr_in6 addr6;
+    addr6.sin6_family = AF_INET6;
+    memcpy(addr6.sin6_addr.s6_addr, s5_ctx->dst_addr, 16);
+    return acl_match_addr((struct sockaddr *)&addr6) == ACL_DIRECT;
   }
+  return 0;
+}
 
-  // stop reading so the buf can be reused and not overrun
-  uv_read_stop(handle);
+// connects straight to the destination the SOCKS request names, the same
+// dispatch the remote does: literal addresses connect immediately, domains
+// go through the DNS cache and fall back to the resolver
+void direct_upstream_connect(Session *sess) {
+  Socks5Ctx *s5_ctx = &sess->s5_ctx;
+  TCPSession *tcp_sess = (TCPSession *)sess;
 
-  if (nread < 0) {
-    if (nread != UV_EOF) {
-      LOG_E("client read failed: %s", uv_strerror(nread));
-    }
-    close_session(sess);
+  int err;
+  if ((err = init_tcp_handle(sess, &tcp_sess->upstream_tcp)) < 0) {
+    client_tcp_write_error((uv_stream_t *)sess->client_tcp, err);
     return;
   }
+  tcp_sess->upstream_connect_req.data = (void *)(intptr_t)0;
 
-  if (sess->state == S5_METHOD_IDENTIFICATION) {
-    handle_socks5_method_identification(handle, nread, buf, sess);
+  if (s5_ctx->atyp == S5_ATYP_IPV4) {
+    struct sockaddr_in addr4;
+    addr4.sin_family = AF_INET;
+    addr4.sin_port = htons(s5_ctx->dst_port);
+    memcpy(&addr4.sin_addr.s_addr, s5_ctx->dst_addr, 4);
 
-  } else if (sess->state == S5_REQUEST) {
-    handle_socks5_request(handle, nread, buf, sess);
+    if ((err = upstream_tcp_connect(&tcp_sess->upstream_connect_req,
+            (struct sockaddr *)&addr4)) != 0) {
+      client_tcp_write_error((uv_stream_t *)sess->client_tcp, err);
+    }
 
-  } else {
-    if (sess->state == S5_STREAMING) { 
-      if (is_proxy_connect(sess)) {
-        if (!stream_encrypt(&sess->e_ctx, buf->base, (int *)&nread, 1)) {
-          LOG_E("cipher_secret incorrect");
-          close_session(sess);
-          return;
-        }
-      } 
+  } else if (s5_ctx->atyp == S5_ATYP_DOMAIN) {
+    struct sockaddr_storage cached_addr;
+    DNSCacheResult cache_result = dns_cache_get((const char *)s5_ctx->dst_addr,
+        htons(s5_ctx->dst_port), &cached_addr, uv_now(g_loop));
+    if (cache_result == DNS_CACHE_NEGATIVE_HIT) {
+      LOG_V("negative DNS cache hit: %s", s5_ctx->dst_addr);
+      client_tcp_write_error((uv_stream_t *)sess->client_tcp, UV_EAI_NONAME);
+      return;
+    }
+    if (cache_result == DNS_CACHE_HIT) {
+      if ((err = upstream_tcp_connect(&tcp_sess->upstream_connect_req,
+              (struct sockaddr *)&cached_addr)) != 0) {
+        client_tcp_write_error((uv_stream_t *)sess->client_tcp, err);
+      }
+      return;
+    }
 
-      ((uv_buf_t *)buf)->len = nread;
-      upstream_tcp_write_start((uv_stream_t *)((TCPSession *)sess)->upstream_tcp, 
-          buf);
+    struct addrinfo hint;
+    memset(&hint, 0, sizeof(hint));
+    hint.ai_family = AF_UNSPEC;
+    hint.ai_socktype = SOCK_STREAM;
+    hint.ai_protocol = IPPROTO_TCP;
 
-    } else {
-      // unreachable code
-      LOG_W("unepxected state: %d", sess->state);
-      close_session(sess);
+    if ((err = uv_getaddrinfo(g_loop, &tcp_sess->upstream_addrinfo_req,
+            upstream_tcp_connect_domain, (const char *)s5_ctx->dst_addr,
+            NULL, &hint)) < 0) {
+      LOG_E("uv_getaddrinfo failed: %s, err: %s",
+          s5_ctx->dst_addr, uv_strerror(err));
+      client_tcp_write_error((uv_stream_t *)sess->client_tcp, err);
     }
-  }
-}
 
-void handle_socks5_method_identification(uv_stream_t *handle, ssize_t nread, 
-    const uv_buf_t *buf, Session *sess) {
-    Socks5Ctx *s5_ctx = &sess->s5_ctx;
+  } else if (s5_ctx->atyp == S5_ATYP_IPV6) {
+    struct sockaddr_in6 addr6;
+    addr6.sin6_family = AF_INET6;
+    addr6.sin6_port = htons(s5_ctx->dst_port);
+    memcpy(addr6.sin6_addr.s6_addr, s5_ctx->dst_addr, 16);
 
-    S5Err s5_err = socks5_parse_method_identification(s5_ctx, buf->base, nread);
-    if (s5_err != S5_OK) {
-      LOG_E("socks5_parse_method_identification failed");
-      close_session(sess);
-      return;
+    if ((err = upstream_tcp_connect(&tcp_sess->upstream_connect_req,
+            (struct sockaddr *)&addr6)) != 0) {
+      client_tcp_write_error((uv_stream_t *)sess->client_tcp, err);
     }
 
-    if (s5_ctx->state == S5_PARSE_STATE_FINISH) {
-      // we only support AUTH_NONE at the moment
-      if (s5_ctx->methods & S5_AUTH_NONE) { 
-        sess->state = S5_REQUEST;
-        client_tcp_write_string(handle, "\5\0", 2);
+  } else {
+    LOG_E("unknown ATYP: %d", s5_ctx->atyp);
+    client_tcp_write_error((uv_stream_t *)sess->client_tcp, UV_EINVAL);
+  }
+}
 
-        LOG_V("socks5 method identification passed");
-      } else {
-        // this state causes the session be closed in on_write_done_cb
-        sess->state = S5_STREAMING_END;  
-        client_tcp_write_string(handle, "\5\xff", 2);
-        LOG_V("socks5 method not supported");
+#if defined(__linux__)
+// moves bytes src -> pipe -> dst until one side blocks; flushing the pipe
+// takes priority so a full pipe is never mistaken for an idle socket.
+// Returns -1 on a fatal error.
+static int splice_dir_pump(SpliceDir *dir, int src, int dst) {
+  for (;;) {
+    if (dir->buffered > 0) {
+      ssize_t n = splice(dir->pipefd[0], NULL, dst, NULL, dir->buffered,
+          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n > 0) {
+        dir->buffered -= n;
+        continue;
       }
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;  // dst blocked, wait for UV_WRITABLE
+      }
+      return -1;
+    }
 
-    } else {
-      // need more data
-      client_tcp_read_start((uv_stream_t *)handle);
+    if (dir->src_eof) {
+      // everything drained, pass the EOF on
+      shutdown(dst, SHUT_WR);
+      dir->done = 1;
+      return 0;
+    }
+
+    ssize_t n = splice(src, NULL, dir->pipefd[1], NULL, SPLICE_CHUNK,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+      dir->buffered += n;
+      continue;
+    }
+    if (n == 0) {
+      dir->src_eof = 1;
+      continue;
     }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return 0;  // src idle, wait for UV_READABLE
+    }
+    return -1;
+  }
 }
 
-void handle_socks5_request(uv_stream_t *handle, ssize_t nread, 
-    const uv_buf_t *buf, Session *sess) {
-  Socks5Ctx *s5_ctx = &sess->s5_ctx;
+// re-arms the two poll handles from the relay state: read interest while a
+// direction's pipe is empty, write interest on the peer while it is not
+static void splice_update_poll(SpliceRelay *relay) {
+  int client_events = 0, upstream_events = 0;
 
-  S5Err s5_err = socks5_parse_request(s5_ctx, buf->base, nread); 
-  if (s5_err != S5_OK) {
-    LOG_E("socks5_parse_request failed");
+  if (!relay->c2u.done) {
+    if (relay->c2u.buffered > 0) {
+      upstream_events |= UV_WRITABLE;
+    } else if (!relay->c2u.src_eof) {
+      client_events |= UV_READABLE;
+    }
+  }
+  if (!relay->u2c.done) {
+    if (relay->u2c.buffered > 0) {
+      client_events |= UV_WRITABLE;
+    } else if (!relay->u2c.src_eof) {
+      upstream_events |= UV_READABLE;
+    }
+  }
+
+  if (client_events != 0) {
+    uv_poll_start(&relay->client_poll, client_events, splice_poll_cb);
+  } else {
+    uv_poll_stop(&relay->client_poll);
+  }
+  if (upstream_events != 0) {
+    uv_poll_start(&relay->upstream_poll, upstream_events, splice_poll_cb);
+  } else {
+    uv_poll_stop(&relay->upstream_poll);
+  }
+}
+
+void splice_poll_cb(uv_poll_t *handle, int status, int events) {
+  SpliceRelay *relay = (SpliceRelay *)handle->data;
+  if (status < 0) {
+    LOG_V("splice poll failed: %s", uv_strerror(status));
+    splice_relay_close(relay);
+    return;
+  }
+
+  // spliced payload never surfaces as read callbacks, so the poll events
+  // are what keeps the session off the idle wheel
+  idle_wheel_touch(&relay->sess->idle_node);
+
+  int err = 0;
+  if (handle == &relay->client_poll) {
+    if (events & UV_READABLE) {
+      err |= splice_dir_pump(&relay->c2u, relay->client_fd,
+          relay->upstream_fd);
+    }
+    if (events & UV_WRITABLE) {
+      err |= splice_dir_pump(&relay->u2c, relay->upstream_fd,
+          relay->client_fd);
+    }
+  } else {
+    if (events & UV_READABLE) {
+      err |= splice_dir_pump(&relay->u2c, relay->upstream_fd,
+          relay->client_fd);
+    }
+    if (events & UV_WRITABLE) {
+      err |= splice_dir_pump(&relay->c2u, relay->client_fd,
+          relay->upstream_fd);
+    }
+  }
+
+  if (err != 0 || (relay->c2u.done && relay->u2c.done)) {
+    splice_relay_close(relay);
+    return;
+  }
+  splice_update_poll(relay);
+}
+
+static void splice_dir_destroy(SpliceDir *dir) {
+  if (dir->pipefd[0] > 0) {
+    close(dir->pipefd[0]);
+    close(dir->pipefd[1]);
+  }
+}
+
+void splice_relay_close(SpliceRelay *relay) {
+  if (relay->closing) {
+    return;
+  }
+  relay->closing = 1;
+  uv_close((uv_handle_t *)&relay->client_poll, splice_poll_close_cb);
+  uv_close((uv_handle_t *)&relay->upstream_poll, splice_poll_close_cb);
+}
+
+void splice_poll_close_cb(uv_handle_t *handle) {
+  SpliceRelay *relay = (SpliceRelay *)handle->data;
+  if (++relay->polls_closed < 2) {
+    return;
+  }
+
+  close(relay->client_fd);
+  close(relay->upstream_fd);
+  splice_dir_destroy(&relay->c2u);
+  splice_dir_destroy(&relay->u2c);
+
+  Session *sess = relay->sess;
+  ((TCPSession *)sess)->splice_relay = NULL;
+  free(relay);
+  close_session(sess);
+}
+
+// hands a DIRECT session over to the kernel; on any setup failure the
+// caller falls back to the regular buffered relay
+int splice_relay_start(Session *sess) {
+  TCPSession *tcp_sess = (TCPSession *)sess;
+  uv_os_fd_t client_fd, upstream_fd;
+  if (uv_fileno((uv_handle_t *)sess->client_tcp, &client_fd) != 0 ||
+      uv_fileno((uv_handle_t *)tcp_sess->upstream_tcp, &upstream_fd) != 0) {
+    return -1;
+  }
+
+  SpliceRelay *relay = lmalloc(sizeof(SpliceRelay));
+  memset(relay, 0, sizeof(SpliceRelay));
+  relay->sess = sess;
+  relay->client_fd = dup(client_fd);
+  relay->upstream_fd = dup(upstream_fd);
+  if (relay->client_fd < 0 || relay->upstream_fd < 0 ||
+      pipe2(relay->c2u.pipefd, O_NONBLOCK | O_CLOEXEC) != 0 ||
+      pipe2(relay->u2c.pipefd, O_NONBLOCK | O_CLOEXEC) != 0) {
+    LOG_W("splice relay setup failed: %s", strerror(errno));
+    if (relay->client_fd >= 0) close(relay->client_fd);
+    if (relay->upstream_fd >= 0) close(relay->upstream_fd);
+    splice_dir_destroy(&relay->c2u);
+    splice_dir_destroy(&relay->u2c);
+    free(relay);
+    return -1;
+  }
+
+  uv_poll_init(g_loop, &relay->client_poll, relay->client_fd);
+  uv_poll_init(g_loop, &relay->upstream_poll, relay->upstream_fd);
+  relay->client_poll.data = relay;
+  relay->upstream_poll.data = relay;
+
+  // the uv_tcp_t handles stay allocated but quiet; all traffic now flows
+  // through the dup'ed fds
+  uv_read_stop((uv_stream_t *)sess->client_tcp);
+  uv_read_stop((uv_stream_t *)tcp_sess->upstream_tcp);
+
+  tcp_sess->splice_relay = relay;
+  splice_update_poll(relay);
+  LOG_I("DIRECT session %p spliced kernel-side", sess);
+  return 0;
+}
+#endif  /* __linux__ */
+
+// -H holds a comma-separated list of host[:port] entries; a bare host
+// uses the -P port. IPv6 literals contain colons themselves, so list
+// them without a port and set -P instead.
+void remote_list_parse(char *list, int default_port) {
+  char *dup = lmalloc(strlen(list) + 1);  // entries point into this copy
+  strcpy(dup, list);
+  for (char *tok = strtok(dup, ","); tok != NULL; tok = strtok(NULL, ",")) {
+    if (g_remote_count >= REMOTE_MAX) {
+      LOG_E("too many remote hosts, at most %d", REMOTE_MAX);
+      exit(1);
+    }
+    RemoteAddr *r = &g_remotes[g_remote_count++];
+    r->host = tok;
+    r->port = default_port;
+    char *colon = strchr(tok, ':');
+    if (colon != NULL && strchr(colon + 1, ':') == NULL) {
+      *colon = '\0';
+      r->port = atoi(colon + 1);
+      if (r->port == 0) {
+        LOG_E("invalid port in remote host entry \"%s\"", tok);
+        exit(1);
+      }
+    }
+  }
+  if (g_remote_count == 0) {
+    LOG_E("no remote host in \"%s\"", list);
+    exit(1);
+  }
+}
+
+int remote_is_down(int idx) {
+  return g_remote_health[idx].down_until > uv_now(g_loop);
+}
+
+// fastest healthy remote by connect-RTT EWMA; an unprobed peer counts as
+// fastest so it attracts traffic (and samples) right after startup. When
+// every peer is cooling down the one closest to recovery is returned, a
+// bad guess still beats refusing the session outright.
+int remote_pick() {
+  int best = -1;
+  for (int i = 0; i < g_remote_count; ++i) {
+    if (remote_is_down(i)) {
+      continue;
+    }
+    if (best < 0 || g_remote_health[i].ewma_ms < g_remote_health[best].ewma_ms) {
+      best = i;
+    }
+  }
+  if (best < 0) {
+    best = 0;
+    for (int i = 1; i < g_remote_count; ++i) {
+      if (g_remote_health[i].down_until < g_remote_health[best].down_until) {
+        best = i;
+      }
+    }
+  }
+  return best;
+}
+
+// EWMA over connect RTTs, fed by the probes and by the tunnel pool's own
+// connects; the weighting reacts within a few samples without chasing a
+// single outlier
+void remote_observe(int idx, uint64_t start_ns) {
+  double ms = (uv_hrtime() - start_ns) / 1e6;
+  RemoteHealth *h = &g_remote_health[idx];
+  h->ewma_ms = h->ewma_ms == 0 ? ms : h->ewma_ms * 0.7 + ms * 0.3;
+  h->fails = 0;
+  // a success during the cooldown does not lift it early, flapping hosts
+  // sit out the full window
+}
+
+void remote_mark_failure(int idx) {
+  RemoteHealth *h = &g_remote_health[idx];
+  if (++h->fails < REMOTE_DOWN_FAILS || g_remote_count < 2) {
+    return;
+  }
+  if (!remote_is_down(idx)) {
+    LOG_W("remote %s:%d marked down for %d ms", g_remotes[idx].host,
+        g_remotes[idx].port, REMOTE_COOLDOWN_MS);
+  }
+  h->down_until = uv_now(g_loop) + REMOTE_COOLDOWN_MS;
+}
+
+// Each worker probes every remote with a plain TCP connect once per
+// interval: the SYN round trip travels the same path a tunnel pays and
+// needs no protocol support, the remote just sees an accepted connection
+// close without a request. A probe still connecting when the next tick
+// fires counts as a timeout.
+void remote_probes_start(uv_loop_t *loop) {
+  if (g_remote_count < 2) {
+    return;  // nothing to balance, skip the probe traffic
+  }
+  uv_timer_init(loop, &g_probe_timer);
+  uv_timer_start(&g_probe_timer, remote_probe_tick, PROBE_INTERVAL_MS,
+      PROBE_INTERVAL_MS);
+  uv_unref((uv_handle_t *)&g_probe_timer);
+}
+
+void remote_probe_tick(uv_timer_t *timer) {
+  for (int i = 0; i < g_remote_count; ++i) {
+    RemoteHealth *h = &g_remote_health[i];
+    if (h->inflight != NULL) {
+      h->inflight->cancelled = 1;
+      uv_close((uv_handle_t *)&h->inflight->tcp, remote_probe_close_cb);
+      h->inflight = NULL;
+      remote_mark_failure(i);
+    }
+
+    RemoteProbe *p = lmalloc(sizeof(RemoteProbe));
+    p->idx = i;
+    p->cancelled = 0;
+    if (uv_tcp_init(g_loop, &p->tcp) != 0) {
+      free(p);
+      continue;
+    }
+    p->start_ns = uv_hrtime();
+    if (uv_tcp_connect(&p->req, &p->tcp,
+          (struct sockaddr *)&g_remotes[i].addr,
+          remote_probe_connect_cb) != 0) {
+      remote_mark_failure(i);
+      uv_close((uv_handle_t *)&p->tcp, remote_probe_close_cb);
+      continue;
+    }
+    h->inflight = p;
+  }
+}
+
+void remote_probe_connect_cb(uv_connect_t *req, int status) {
+  RemoteProbe *p = container_of(req, RemoteProbe, req);
+  if (p->cancelled) {
+    // the tick already closed the handle, the close callback frees it
+    return;
+  }
+  g_remote_health[p->idx].inflight = NULL;
+  if (status == 0) {
+    remote_observe(p->idx, p->start_ns);
+  } else {
+    remote_mark_failure(p->idx);
+  }
+  uv_close((uv_handle_t *)&p->tcp, remote_probe_close_cb);
+}
+
+void remote_probe_close_cb(uv_handle_t *handle) {
+  free(container_of((uv_tcp_t *)handle, RemoteProbe, tcp));
+}
+
+// Each worker keeps a small pool of connections to the remote server that
+// are established ahead of time: adopting one lets a fresh session skip
+// the whole TCP handshake RTT, which dominates latency for browser-style
+// bursts of short requests. The cipher stream only starts with the SOCKS
+// request, so an idle tunnel has sent no bytes yet and the wire format is
+// unchanged for the remote end.
+void tunnel_conn_connect(TunnelConn *conn) {
+  conn->ready = 0;
+  conn->remote_idx = remote_pick();
+  conn->tcp = lpool_take(POOL_UV_TCP, sizeof(uv_tcp_t));
+  conn->tcp->data = conn;
+
+  struct sockaddr *addr = (struct sockaddr *)&g_remotes[conn->remote_idx].addr;
+  int err;
+  if ((err = uv_tcp_init(g_loop, conn->tcp)) != 0) {
+    LOG_W("uv_tcp_init failed: %s", uv_strerror(err));
+    lpool_return(POOL_UV_TCP, conn->tcp);
+    conn->tcp = NULL;
+    return;
+  }
+  uv_tcp_keepalive(conn->tcp, 1, KEEPALIVE);
+#if defined(__linux__) && defined(TCP_FASTOPEN_CONNECT)
+  tcp_enable_fastopen_connect(conn->tcp, addr->sa_family);
+#endif
+
+  conn->start_ns = uv_hrtime();
+  if ((err = uv_tcp_connect(&conn->connect_req, conn->tcp, addr,
+          tunnel_conn_connect_cb)) != 0) {
+    LOG_W("tunnel connect failed: %s", uv_strerror(err));
+    remote_mark_failure(conn->remote_idx);
+    uv_close((uv_handle_t *)conn->tcp, tunnel_conn_close_cb);
+    conn->tcp = NULL;
+  }
+}
+
+void tunnel_conn_connect_cb(uv_connect_t *req, int status) {
+  TunnelConn *conn = container_of(req, TunnelConn, connect_req);
+  if (conn->tcp == NULL) {
+    return;
+  }
+
+  if (status < 0) {
+    LOG_W("tunnel connect failed: %s", uv_strerror(status));
+    remote_mark_failure(conn->remote_idx);
+    uv_close((uv_handle_t *)conn->tcp, tunnel_conn_close_cb);
+    conn->tcp = NULL;  // the slot is refilled on the next take
+    return;
+  }
+
+  remote_observe(conn->remote_idx, conn->start_ns);
+  conn->ready = 1;
+  // watch for the remote end dropping the idle connection
+  uv_read_start((uv_stream_t *)conn->tcp, tunnel_conn_alloc, 
+      tunnel_conn_read_cb);
+}
+
+void tunnel_conn_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
+  static __thread char junk[64];
+  buf->base = junk;
+  buf->len = sizeof(junk);
+}
+
+void tunnel_conn_read_cb(uv_stream_t *handle, ssize_t nread, 
+    const uv_buf_t *buf) {
+  if (nread == 0) { // EAGAIN || EWOULDBLOCK
+    return;
+  }
+
+  // nothing legitimate ever arrives on an idle tunnel: EOF, an error or
+  // stray bytes all mean the connection is useless now
+  TunnelConn *conn = handle->data;
+  LOG_V("idle tunnel dropped: %s", 
+      nread < 0 ? uv_strerror(nread) : "unexpected data");
+  conn->ready = 0;
+  uv_close((uv_handle_t *)conn->tcp, tunnel_conn_close_cb);
+  conn->tcp = NULL;
+}
+
+void tunnel_conn_close_cb(uv_handle_t *handle) {
+  lpool_return(POOL_UV_TCP, handle);
+}
+
+// tops up one empty slot per tick: adopted and failed slots come back at
+// the refill rate instead of in a burst, so a flapping remote sees a
+// steady trickle of reconnects rather than a storm every time a session
+// drains the pool
+void tunnel_refill_tick(uv_timer_t *timer) {
+  for (int i = 0; i < g_tunnel_pool_size; ++i) {
+    if (g_tunnel_pool[i].tcp == NULL) {
+      tunnel_conn_connect(&g_tunnel_pool[i]);
+      return;
+    }
+  }
+}
+
+uv_tcp_t *tunnel_pool_take() {
+  if (!g_tunnel_pool_started) {
+    g_tunnel_pool_started = 1;
+    for (int i = 0; i < g_tunnel_pool_size; ++i) {
+      tunnel_conn_connect(&g_tunnel_pool[i]);
+    }
+    uv_timer_init(g_loop, &g_tunnel_refill_timer);
+    // the refill timer must not keep a draining loop alive
+    uv_unref((uv_handle_t *)&g_tunnel_refill_timer);
+    uv_timer_start(&g_tunnel_refill_timer, tunnel_refill_tick,
+        g_tunnel_refill_ms, g_tunnel_refill_ms);
+    // the very first session pays the RTT while the pool warms up
+    return NULL;
+  }
+
+  // a warm tunnel to the currently preferred remote first, then any
+  // tunnel to a healthy one: either beats paying a fresh handshake RTT;
+  // tunnels parked on a remote that went down are dropped and the refill
+  // timer rebuilds them
+  int want = remote_pick();
+  TunnelConn *pick = NULL;
+  for (int i = 0; i < g_tunnel_pool_size; ++i) {
+    TunnelConn *conn = &g_tunnel_pool[i];
+    if (conn->tcp == NULL || !conn->ready) {
+      continue;
+    }
+    if (remote_is_down(conn->remote_idx)) {
+      conn->ready = 0;
+      uv_close((uv_handle_t *)conn->tcp, tunnel_conn_close_cb);
+      conn->tcp = NULL;
+      continue;
+    }
+    if (pick == NULL || (conn->remote_idx == want &&
+          pick->remote_idx != want)) {
+      pick = conn;
+    }
+  }
+
+  if (pick != NULL) {
+    uv_tcp_t *tcp = pick->tcp;
+    uv_read_stop((uv_stream_t *)tcp);
+    pick->ready = 0;
+    pick->tcp = NULL;  // the refill timer replenishes the slot
+    return tcp;
+  }
+
+  return NULL;
+}
+
+// thin dispatch wrapper so the stall profiler can time the callback; the
+// session state is captured up front, the dispatch may recycle the session
+void on_client_tcp_read_done(uv_stream_t *handle, ssize_t nread,
+    const uv_buf_t *buf) {
+  Session *sess = (Session *)handle->data;
+  int state = sess != NULL ? (int)sess->state : -1;
+  uint64_t start_ns = stall_prof_enter();
+  client_tcp_read_dispatch(handle, nread, buf);
+  stall_prof_leave(start_ns, STALL_SITE_CLIENT_READ, state);
+}
+
+void client_tcp_read_dispatch(uv_stream_t *handle, ssize_t nread,
+    const uv_buf_t *buf) {
+  if (nread == 0) { // EAGAIN || EWOULDBLOCK
+    return;
+  }
+
+  Session *sess = (Session *)handle->data;
+  if (sess == NULL || sess->state == S5_CLOSING) {
+    return;
+  }
+  idle_wheel_touch(&sess->idle_node);
+
+  if (nread == UV_ENOBUFS) {
+    // every pipe slot is in flight, pause until a write completes
+    ((TCPSession *)sess)->to_upstream.read_stopped = 1;
+    uv_read_stop(handle);
+    return;
+  }
+
+  if (nread < 0) {
+    if (nread != UV_EOF) {
+      LOG_E("client read failed: %s", uv_strerror(nread));
+    }
+    uv_read_stop(handle);
+    if (sess->state == S5_STREAMING && sess->type == SESSION_TYPE_TCP &&
+        (((TCPSession *)sess)->to_upstream.inflight > 0 ||
+         ((TCPSession *)sess)->to_client.inflight > 0)) {
+      // let the queued writes drain before tearing the session down
+      sess->state = S5_STREAMING_END;
+      return;
+    }
+    close_session(sess);
+    return;
+  }
+
+  if (sess->state == S5_METHOD_IDENTIFICATION) {
+    // stop reading so the buf can be reused and not overrun
+    uv_read_stop(handle);
+    handle_socks5_method_identification(handle, nread, buf, sess);
+
+  } else if (sess->state == S5_REQUEST) {
+    uv_read_stop(handle);
+    handle_socks5_request(handle, nread, buf, sess);
+
+  } else {
+    if (sess->state == S5_STREAMING) { 
+      TCPSession *tcp_sess = (TCPSession *)sess;
+      PipeSlot *slot = pipe_slot_from_base(&tcp_sess->to_upstream,
+          buf->base);
+      // plaintext feeding an AEAD/framed cipher is cut into records of
+      // at most AEAD_MAX_RECORD, so those reads gain nothing beyond
+      // tier 0; DIRECT sessions and plain stream ciphers are unbounded
+      pipe_read_observe(&tcp_sess->to_upstream, slot, nread,
+          is_proxy_connect(sess) &&
+          (sess->e_ctx.is_aead || cipher_framing()) ? 0 : READ_TIER_MAX);
+      char *data = buf->base;
+      if (is_proxy_connect(sess)) {
+        if (g_cli_cfg.crypto_offload) {
+          crypto_job_submit(tcp_sess, slot, buf->base, nread, 1);
+          return;
+        }
+        // ciphered in place, the IV (if any) lands in the headroom in
+        // front of the slot buffer
+        if ((data = stream_encrypt_to(&sess->e_ctx, buf->base,
+                (int *)&nread)) == NULL) {
+          LOG_E("cipher_secret incorrect");
+          close_session(sess);
+          return;
+        }
+      } 
+
+      if (stream_pipe_write(sess, &tcp_sess->to_upstream, slot,
+            (uv_stream_t *)tcp_sess->upstream_tcp, data, nread,
+            on_to_upstream_pipe_write_done) != 0) {
+        return;
+      }
+      if (tcp_sess->to_upstream.inflight >= g_pipe_high_wm) {
+        tcp_sess->to_upstream.read_stopped = 1;
+        uv_read_stop(handle);
+      }
+
+    } else {
+      // unreachable code
+      LOG_W("unepxected state: %d", sess->state);
+      uv_read_stop(handle);
+      close_session(sess);
+    }
+  }
+}
+
+void handle_socks5_method_identification(uv_stream_t *handle, ssize_t nread, 
+    const uv_buf_t *buf, Session *sess) {
+    Socks5Ctx *s5_ctx = &sess->s5_ctx;
+
+    S5Err s5_err = socks5_parse_method_identification(s5_ctx, buf->base, nread);
+    if (s5_err != S5_OK) {
+      LOG_E("socks5_parse_method_identification failed");
+      ++g_metrics.handshake_errors[s5_err];
+      close_session(sess);
+      return;
+    }
+
+    if (s5_ctx->state == S5_PARSE_STATE_FINISH) {
+      // we only support AUTH_NONE at the moment
+      if (s5_ctx->methods & S5_AUTH_NONE) { 
+        sess->state = S5_REQUEST;
+        client_tcp_write_string(handle, "\5\0", 2);
+
+        LOG_V("socks5 method identification passed");
+      } else {
+        // this state causes the session be closed in on_write_done_cb
+        sess->state = S5_STREAMING_END;  
+        client_tcp_write_string(handle, "\5\xff", 2);
+        LOG_V("socks5 method not supported");
+      }
+
+    } else {
+      // need more data
+      client_tcp_read_start((uv_stream_t *)handle);
+    }
+}
+
+void handle_socks5_request(uv_stream_t *handle, ssize_t nread, 
+    const uv_buf_t *buf, Session *sess) {
+  Socks5Ctx *s5_ctx = &sess->s5_ctx;
+
+  S5Err s5_err = socks5_parse_request(s5_ctx, buf->base, nread);
+  if (s5_err != S5_OK) {
+    LOG_E("socks5_parse_request failed");
+    ++g_metrics.handshake_errors[s5_err];
     client_tcp_write_error(handle, s5_err);
     return;
   }
 
-  // finished parsing the SOCKS request, now we know it is a 
+  // finished parsing the SOCKS request, now we know it is a
   // CONNECT or UDP ASSOCIATE request
-  sess->type = (s5_ctx->cmd == S5_CMD_UDP_ASSOCIATE ? 
-      SESSION_TYPE_UDP : SESSION_TYPE_TCP); 
-
+  sess->type = (s5_ctx->cmd == S5_CMD_UDP_ASSOCIATE ?
+      SESSION_TYPE_UDP : SESSION_TYPE_TCP);
 
   if (sess->type == SESSION_TYPE_UDP) {
-    LOG_V("received a UDP request");
+    ++g_metrics.sessions_total_udp;
+  } else {
+    ++g_metrics.sessions_total_tcp;
+  }
 
-    sess = lrealloc(sess, sizeof(UDPSession));
-    memset(((char *)sess)+sizeof(Session), 0, sizeof(UDPSession)-sizeof(Session));
-    // this is necessary, because after realloc memory for the sess object,
-    // its address may be changed and any other objects that reference it 
-    // should do the re-assignment
-    handle->data = sess;  
 
+  if (sess->type == SESSION_TYPE_UDP) {
+    LOG_V("received a UDP request");
     finish_socks5_udp_handshake(sess);
     return;
   }
 
-  // alright, it is a CONNECT request
-  sess = lrealloc(sess, sizeof(TCPSession));
-  memset(((char *)sess)+sizeof(Session), 0, sizeof(TCPSession)-sizeof(Session));
-  // this is necessary, because after realloc memory for the sess object,
-  // its address may be changed and any other objects that reference it 
-  // should do the re-assignment
-  handle->data = sess;
+  // alright, it is a CONNECT request; the pool block is already big enough,
+  // just clear the TCP extension fields (the pipes only need their
+  // bookkeeping reset, the slot buffers live in the pool)
+  memset(((char *)sess)+sizeof(Session), 0,
+      offsetof(TCPSession, to_upstream) - sizeof(Session));
+  STREAM_PIPE_CLEAR(&((TCPSession *)sess)->to_upstream);
+  STREAM_PIPE_CLEAR(&((TCPSession *)sess)->to_client);
+
+  // split tunneling: when the ACL routes this destination DIRECT, connect
+  // straight to it and skip the tunnel; socks5_req_data stays NULL which
+  // marks the session as plaintext (see is_proxy_connect) and makes it
+  // eligible for the kernel splice fast path
+  if (acl_loaded() && acl_says_direct(s5_ctx)) {
+    direct_upstream_connect(sess);
+    return;
+  }
+
+  // adopt a pre-established tunnel when one is available, so the session
+  // starts with zero connection-setup RTTs
+  uv_tcp_t *tunnel = tunnel_pool_take();
 
   int err;
-  if ((err = init_tcp_handle(sess, &((TCPSession *)sess)->upstream_tcp)) < 0) {
+  if (tunnel != NULL) {
+    tunnel->data = sess;
+    ((TCPSession *)sess)->upstream_tcp = tunnel;
+  } else if ((err = init_tcp_handle(sess, 
+          &((TCPSession *)sess)->upstream_tcp)) < 0) {
     client_tcp_write_error(handle, err);
     return;
   }
 
-  // connect to REMOTE to build a tunnel
+  // connect to REMOTE to build a tunnel; cipher the request in place so
+  // the wire format matches what the streaming path emits on this e_ctx,
+  // then keep a copy for the connect callback
   sess->socks5_req_data_len = nread;
-  sess->socks5_req_data = stream_encrypt(&sess->e_ctx, buf->base, 
-      &sess->socks5_req_data_len, 0);
+  char *enc_req = stream_encrypt_to(&sess->e_ctx, buf->base, 
+      &sess->socks5_req_data_len);
+  if (enc_req == NULL) {
+    LOG_E("cipher_secret incorrect");
+    close_session(sess);
+    return;
+  }
+  sess->socks5_req_data = lmalloc(sess->socks5_req_data_len);
+  memcpy(sess->socks5_req_data, enc_req, sess->socks5_req_data_len);
+
+  if (tunnel != NULL) {
+    // already connected, jump straight into the connected path
+    ((TCPSession *)sess)->upstream_connect_req.data = (void *)(intptr_t)0;
+    upstream_tcp_connect_cb(&((TCPSession *)sess)->upstream_connect_req, 0);
+    return;
+  }
 
-  err = upstream_tcp_connect(&((TCPSession *)sess)->upstream_connect_req, 
-      (struct sockaddr *)&g_server_ctx->rs_cfg.addr);
+  err = upstream_tcp_connect(&((TCPSession *)sess)->upstream_connect_req,
+      (struct sockaddr *)&g_remotes[remote_pick()].addr);
   if (err != 0) {
     LOG_E("connecting to remote server failed: %s", uv_strerror(err));
     client_tcp_write_error((uv_stream_t *)sess->client_tcp, err); 
@@ -669,86 +1701,431 @@ int upstream_tcp_read_start(uv_stream_t *handle) {
     LOG_E("uv_read_start failed: %s", uv_strerror(err));
     close_session(sess);
   }
-  return err;
+  return err;
+}
+
+void on_upstream_tcp_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
+  TCPSession *sess = (TCPSession *)handle->data;
+  PipeSlot *slot = pipe_slot_take(&sess->to_client);
+  if (slot == NULL) {
+    buf->base = NULL;
+    buf->len = 0;
+    return;
+  }
+  buf->base = slot->buf + CRYPTO_HEADROOM;
+  buf->len = READ_TIER_SIZE(slot->tier);
+}
+
+void on_upstream_tcp_read_done(uv_stream_t *handle, ssize_t nread,
+    const uv_buf_t *buf) {
+  Session *sess = (Session *)handle->data;
+  int state = sess != NULL ? (int)sess->state : -1;
+  uint64_t start_ns = stall_prof_enter();
+  upstream_tcp_read_dispatch(handle, nread, buf);
+  stall_prof_leave(start_ns, STALL_SITE_UPSTREAM_READ, state);
+}
+
+void upstream_tcp_read_dispatch(uv_stream_t *handle, ssize_t nread,
+    const uv_buf_t *buf) {
+  if (nread == 0) { // EAGAIN || EWOULDBLOCK
+    return;
+  }
+  TCPSession *sess = (TCPSession *)handle->data;
+  if (sess == NULL || sess->state == S5_CLOSING) {
+    return;
+  }
+  idle_wheel_touch(&sess->idle_node);
+
+  if (nread == UV_ENOBUFS) {
+    // every pipe slot is in flight, pause until a write completes
+    sess->to_client.read_stopped = 1;
+    uv_read_stop(handle);
+    return;
+  }
+
+  if (nread < 0 || sess->state == S5_STREAMING_END) {
+    if (nread != UV_EOF) {
+      LOG_E("upstream read failed: %s", uv_strerror(nread));
+    }
+    uv_read_stop(handle);
+    if (sess->state != S5_STREAMING_END &&
+        (sess->to_upstream.inflight > 0 || sess->to_client.inflight > 0)) {
+      // let the queued writes drain before tearing the session down
+      sess->state = S5_STREAMING_END;
+      return;
+    }
+    if (sess->to_upstream.inflight > 0 || sess->to_client.inflight > 0) {
+      return;  // the last pipe write callback will close the session
+    }
+    close_session((Session *)sess);
+    return;
+  }
+
+  PipeSlot *slot = pipe_slot_from_base(&sess->to_client, buf->base);
+  // wire-side (and DIRECT) reads carry any size, no tier cap
+  pipe_read_observe(&sess->to_client, slot, nread, READ_TIER_MAX);
+  char *data = buf->base;
+  if (is_proxy_connect((Session *)sess)) {
+    if (g_cli_cfg.crypto_offload) {
+      crypto_job_submit(sess, slot, buf->base, nread, 0);
+      return;
+    }
+    // deciphered in place, the plaintext starts right after the consumed IV
+    if ((data = stream_decrypt_to(&sess->d_ctx, buf->base,
+            (int *)&nread)) == NULL) {
+      LOG_E("cipher_secret is incorrect");
+      close_session((Session *)sess);
+      return;
+    }
+    if (nread == 0) {
+      // an AEAD record is still incomplete, keep reading
+      return;
+    }
+    if (sess->d_ctx.is_aead || cipher_framing()) {
+      // the reassembled plaintext lives in a per-worker staging buffer and
+      // would be clobbered by the next decrypt, move it into the slot so
+      // it survives while the write is in flight (stream_decrypt_to hands
+      // out at most DECRYPT_OUT_MAX, which fits PIPE_SLOT_BUFSIZ)
+      memcpy(slot->buf + CRYPTO_HEADROOM, data, nread);
+      data = slot->buf + CRYPTO_HEADROOM;
+    }
+  }
+
+  if (stream_pipe_write((Session *)sess, &sess->to_client, slot,
+        (uv_stream_t *)sess->client_tcp, data, nread,
+        on_to_client_pipe_write_done) != 0) {
+    return;
+  }
+  if (flush_decrypt_backlog(sess)) {
+    return;
+  }
+  if (sess->to_client.inflight >= g_pipe_high_wm ||
+      cipher_pending(&sess->d_ctx)) {
+    sess->to_client.read_stopped = 1;
+    uv_read_stop(handle);
+  }
+}
+
+int upstream_tcp_write_start(uv_stream_t *handle, const uv_buf_t *buf) {
+  TCPSession *sess = (TCPSession *)handle->data;
+  if (sess == NULL) {
+    return -1;
+  }
+  int err;
+  if ((err = uv_write(&sess->upstream_write_req, (uv_stream_t *)handle, 
+          buf, 1, on_upstream_tcp_write_done)) != 0) {
+    LOG_E("uv_write failed: %s", uv_strerror(err));
+    close_session((Session *)sess);
+  }
+  return err;
+}
+
+void on_upstream_tcp_write_done(uv_write_t *req, int status) {
+  TCPSession *sess = container_of(req, TCPSession, upstream_write_req);
+  if (status < 0 || sess->state == S5_STREAMING_END) {
+    LOG_V("upstream write failed: %s", uv_strerror(status));
+    close_session((Session *)sess);
+  } else {
+    if (sess->state == S5_START_PROXY) {
+      finish_socks5_tcp_handshake((Session *)sess);
+    } else {
+      client_tcp_read_start((uv_stream_t *)sess->client_tcp);
+    }
+  }
+}
+
+PipeSlot *pipe_slot_take(StreamPipe *pipe) {
+  for (int i = 0; i < PIPE_DEPTH; ++i) {
+    if (!pipe->slots[i].busy) {
+      // a buffer left over from before a tier change goes back to its
+      // own pool so the slot can offer the current read size
+      if (pipe->slots[i].buf != NULL &&
+          pipe->slots[i].tier != pipe->read_tier) {
+        lpool_return(POOL_BUF_LARGE + pipe->slots[i].tier,
+            pipe->slots[i].buf);
+        pipe->slots[i].buf = NULL;
+      }
+      if (pipe->slots[i].buf == NULL) {
+        pipe->slots[i].buf = lpool_take(POOL_BUF_LARGE + pipe->read_tier,
+            PIPE_SLOT_BUFSIZ_TIER(pipe->read_tier));
+        pipe->slots[i].tier = pipe->read_tier;
+      }
+      return &pipe->slots[i];
+    }
+  }
+  return NULL;
+}
+
+// adjusts a direction's read tier from the sizes its reads actually come
+// back with: a buffer-filling bulk flow grows toward 64KB reads, a flow
+// gone quiescent shrinks back so interactive sessions neither pin big
+// buffers nor pay for latency. tier_cap pins the plaintext side of
+// AEAD/framed sessions to tier 0, whose read size already matches the
+// largest record the wire format carries
+void pipe_read_observe(StreamPipe *pipe, PipeSlot *slot, int nread,
+    int tier_cap) {
+  if (nread >= READ_TIER_SIZE(slot->tier)) {
+    pipe->lean_streak = 0;
+    if (pipe->read_tier < tier_cap &&
+        ++pipe->full_streak >= READ_TIER_PROMOTE_STREAK) {
+      ++pipe->read_tier;
+      pipe->full_streak = 0;
+      LOG_V("read tier up: %d", pipe->read_tier);
+    }
+    return;
+  }
+  pipe->full_streak = 0;
+  if (pipe->read_tier > 0 && nread * 4 <= READ_TIER_SIZE(pipe->read_tier) &&
+      ++pipe->lean_streak >= READ_TIER_DEMOTE_STREAK) {
+    --pipe->read_tier;
+    pipe->lean_streak = 0;
+    LOG_V("read tier down: %d", pipe->read_tier);
+  }
+}
+
+// maps a read buffer handed out by pipe_slot_take back to its slot
+PipeSlot *pipe_slot_from_base(StreamPipe *pipe, const char *base) {
+  for (int i = 0; i < PIPE_DEPTH; ++i) {
+    if (pipe->slots[i].buf != NULL &&
+        base == pipe->slots[i].buf + CRYPTO_HEADROOM) {
+      return &pipe->slots[i];
+    }
+  }
+  return NULL;
+}
+
+// queues one slot worth of data on dst without stopping the source read;
+// the read is only paused once the bytes in flight cross the high watermark
+int stream_pipe_write(Session *sess, StreamPipe *pipe, PipeSlot *slot,
+    uv_stream_t *dst, char *data, int len, uv_write_cb cb) {
+  slot->busy = 1;
+  slot->wire_len = len;
+  slot->write_req.data = sess;
+
+  uv_buf_t wbuf = uv_buf_init(data, len);
+  int err;
+  if ((err = uv_write(&slot->write_req, dst, &wbuf, 1, cb)) != 0) {
+    LOG_E("uv_write failed: %s", uv_strerror(err));
+    slot->busy = 0;
+    close_session(sess);
+    return err;
+  }
+  pipe->inflight += len;
+  return 0;
+}
+
+// common tail of the two pipe write callbacks: returns 1 when the session
+// was (or will be) closed and the caller should not resume reading
+static int stream_pipe_write_done(Session *sess, StreamPipe *pipe, 
+    uv_write_t *req, int status) {
+  PipeSlot *slot = container_of(req, PipeSlot, write_req);
+  slot->busy = 0;
+  pipe->inflight -= slot->wire_len;
+  lpool_return(POOL_BUF_LARGE + slot->tier, slot->buf);
+  slot->buf = NULL;
+
+  if (sess->state == S5_CLOSING) {
+    return 1;
+  }
+  if (status < 0) {
+    LOG_V("status=%d, now will close session", status);
+    close_session(sess);
+    return 1;
+  }
+  if (sess->state == S5_STREAMING_END) {
+    // one end hit EOF earlier; close once both directions have drained
+    if (((TCPSession *)sess)->to_upstream.inflight == 0 &&
+        ((TCPSession *)sess)->to_client.inflight == 0) {
+      close_session(sess);
+    }
+    return 1;
+  }
+  return 0;
+}
+
+void on_to_upstream_pipe_write_done(uv_write_t *req, int status) {
+  Session *sess = (Session *)req->data;
+  StreamPipe *pipe = &((TCPSession *)sess)->to_upstream;
+  if (stream_pipe_write_done(sess, pipe, req, status)) {
+    return;
+  }
+  if (pipe->read_stopped && pipe->inflight <= g_pipe_low_wm) {
+    pipe->read_stopped = 0;
+    client_tcp_read_start((uv_stream_t *)sess->client_tcp);
+  }
+}
+
+// compressed records can inflate one wire read into more plaintext than
+// its slot carries; the surplus stays buffered in the decrypt context and
+// is written out here, both right after the read and again as slots free
+// up. Returns 1 when the session got closed underneath.
+int flush_decrypt_backlog(TCPSession *sess) {
+  while (cipher_pending(&((Session *)sess)->d_ctx) &&
+      sess->to_client.inflight < g_pipe_high_wm) {
+    PipeSlot *slot = pipe_slot_take(&sess->to_client);
+    if (slot == NULL) {
+      return 0;
+    }
+    int len = 0;
+    char *data = stream_decrypt_drain(&((Session *)sess)->d_ctx, &len);
+    if (data == NULL) {
+      close_session((Session *)sess);
+      return 1;
+    }
+    if (len == 0) {
+      return 0;
+    }
+    memcpy(slot->buf + CRYPTO_HEADROOM, data, len);
+    if (stream_pipe_write((Session *)sess, &sess->to_client, slot,
+          (uv_stream_t *)sess->client_tcp, slot->buf + CRYPTO_HEADROOM,
+          len, on_to_client_pipe_write_done) != 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void on_to_client_pipe_write_done(uv_write_t *req, int status) {
+  Session *sess = (Session *)req->data;
+  StreamPipe *pipe = &((TCPSession *)sess)->to_client;
+  if (stream_pipe_write_done(sess, pipe, req, status)) {
+    return;
+  }
+  if (((TCPSession *)sess)->crypto_to_client.busy) {
+    // a decrypt job owns d_ctx on a threadpool thread right now; its
+    // completion callback drains the backlog and resumes the read
+    return;
+  }
+  if (flush_decrypt_backlog((TCPSession *)sess)) {
+    return;
+  }
+  if (pipe->read_stopped && pipe->inflight <= g_pipe_low_wm &&
+      !cipher_pending(&sess->d_ctx)) {
+    pipe->read_stopped = 0;
+    upstream_tcp_read_start((uv_stream_t *)((TCPSession *)sess)->upstream_tcp);
+  }
 }
 
-void on_upstream_tcp_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
-  TCPSession *sess = (TCPSession *)handle->data;
-  buf->base = sess->upstream_buf;
-  buf->len = sizeof(sess->upstream_buf);
+// Crypto offload (-x): instead of running EVP_CipherUpdate inline in the
+// read callback, streaming-phase buffers are handed to the libuv
+// threadpool and come back here for the pipe write, overlapping cipher
+// CPU with the loop's I/O. The source read stays paused while a job is
+// in flight: the cipher contexts chain state across calls, so each
+// direction is strictly sequential anyway.
+void crypto_job_submit(TCPSession *sess, PipeSlot *slot, char *data,
+    int len, int encrypt) {
+  CryptoJob *job = encrypt ? &sess->crypto_to_upstream
+                           : &sess->crypto_to_client;
+  job->work.data = job;
+  job->sess = sess;
+  job->slot = slot;
+  job->data = data;
+  job->len = len;
+  job->encrypt = encrypt;
+  job->busy = 1;
+  uv_read_stop(encrypt ? (uv_stream_t *)((Session *)sess)->client_tcp
+                       : (uv_stream_t *)sess->upstream_tcp);
+  CHECK(uv_queue_work(g_loop, &job->work, crypto_work_cb,
+        crypto_after_cb) == 0);
 }
 
-void on_upstream_tcp_read_done(uv_stream_t *handle, ssize_t nread, 
-    const uv_buf_t *buf) {
-  if (nread == 0) { // EAGAIN || EWOULDBLOCK
-    return;
+void crypto_work_cb(uv_work_t *w) {
+  // threadpool threads carry their own metrics block; register it once
+  // so the ciphered byte counts still reach the dump
+  static __thread int registered;
+  if (!registered) {
+    registered = 1;
+    metrics_worker_register();
   }
-  Session *sess = (Session *)handle->data;
-  if (sess == NULL || sess->state == S5_CLOSING) {
+
+  CryptoJob *job = w->data;
+  Session *sess = (Session *)job->sess;
+  if (job->encrypt) {
+    job->data = stream_encrypt_to(&sess->e_ctx, job->data, &job->len);
     return;
   }
+  job->data = stream_decrypt_to(&sess->d_ctx, job->data, &job->len);
+  if (job->data != NULL && job->len > 0 &&
+      (sess->d_ctx.is_aead || cipher_framing())) {
+    // the staging buffer belongs to this threadpool thread, move the
+    // plaintext into the slot before another job can clobber it
+    memcpy(job->slot->buf + CRYPTO_HEADROOM, job->data, job->len);
+    job->data = job->slot->buf + CRYPTO_HEADROOM;
+  }
+}
 
-  // stop reading so the buf can be reused and not overrun
-  uv_read_stop(handle);
-
-  if (nread < 0 || sess->state == S5_STREAMING_END) {
-    if (nread != UV_EOF) {
-      LOG_E("upstream read failed: %s", uv_strerror(nread));
+// back on the loop thread: queue the pipe write the read callback would
+// have queued inline, then resume the paused read unless the watermark
+// (or a pending close) says otherwise
+void crypto_after_cb(uv_work_t *w, int status) {
+  CryptoJob *job = w->data;
+  TCPSession *sess = (TCPSession *)job->sess;
+  job->busy = 0;
+
+  if (sess->crypto_close_pending) {
+    if (!sess->crypto_to_upstream.busy && !sess->crypto_to_client.busy) {
+      sess->crypto_close_pending = 0;
+      close_session((Session *)sess);
     }
-    close_session(sess);
     return;
   }
 
-  if (is_proxy_connect(sess)) {
-    if (!stream_decrypt(&sess->d_ctx, buf->base, (int *)&nread, 1)) {
-      LOG_E("cipher_secret is incorrect");
-      close_session(sess);
+  if (job->data == NULL) {
+    LOG_E("cipher_secret incorrect");
+    close_session((Session *)sess);
+    return;
+  }
+
+  if (job->encrypt) {
+    if (stream_pipe_write((Session *)sess, &sess->to_upstream, job->slot,
+          (uv_stream_t *)sess->upstream_tcp, job->data, job->len,
+          on_to_upstream_pipe_write_done) != 0) {
       return;
     }
+    if (sess->to_upstream.inflight >= g_pipe_high_wm) {
+      sess->to_upstream.read_stopped = 1;
+    } else if (((Session *)sess)->state == S5_STREAMING) {
+      client_tcp_read_start((uv_stream_t *)((Session *)sess)->client_tcp);
+    }
+    return;
   }
 
-  ((uv_buf_t *)buf)->len = nread;
-  client_tcp_write_start((uv_stream_t *)sess->client_tcp, buf);
-}
-
-int upstream_tcp_write_start(uv_stream_t *handle, const uv_buf_t *buf) {
-  TCPSession *sess = (TCPSession *)handle->data;
-  if (sess == NULL) {
-    return -1;
+  if (job->len == 0) {
+    // an AEAD record is still incomplete, keep reading
+    if (((Session *)sess)->state == S5_STREAMING) {
+      upstream_tcp_read_start((uv_stream_t *)sess->upstream_tcp);
+    }
+    return;
   }
-  int err;
-  if ((err = uv_write(&sess->upstream_write_req, (uv_stream_t *)handle, 
-          buf, 1, on_upstream_tcp_write_done)) != 0) {
-    LOG_E("uv_write failed: %s", uv_strerror(err));
-    close_session((Session *)sess);
+  if (stream_pipe_write((Session *)sess, &sess->to_client, job->slot,
+        (uv_stream_t *)sess->client_tcp, job->data, job->len,
+        on_to_client_pipe_write_done) != 0) {
+    return;
   }
-  return err;
-}
-
-void on_upstream_tcp_write_done(uv_write_t *req, int status) {
-  TCPSession *sess = container_of(req, TCPSession, upstream_write_req);
-  if (status < 0 || sess->state == S5_STREAMING_END) {
-    LOG_V("upstream write failed: %s", uv_strerror(status));
-    close_session((Session *)sess);
-  } else {
-    if (sess->state == S5_START_PROXY) {
-      finish_socks5_tcp_handshake((Session *)sess);
-    } else {
-      client_tcp_read_start((uv_stream_t *)sess->client_tcp);
-    }
+  if (flush_decrypt_backlog(sess)) {
+    return;
+  }
+  if (sess->to_client.inflight >= g_pipe_high_wm ||
+      cipher_pending(&((Session *)sess)->d_ctx)) {
+    sess->to_client.read_stopped = 1;
+  } else if (((Session *)sess)->state == S5_STREAMING) {
+    upstream_tcp_read_start((uv_stream_t *)sess->upstream_tcp);
   }
 }
 
-void upstream_tcp_connect_domain(uv_getaddrinfo_t* req, int status, 
+void upstream_tcp_connect_domain(uv_getaddrinfo_t* req, int status,
     struct addrinfo* res) {
   TCPSession *sess = container_of(req, TCPSession, upstream_addrinfo_req);
   if (status < 0) {
     LOG_E("getaddrinfo(\"%s\"): %s", sess->s5_ctx.dst_addr, uv_strerror(status));
+    dns_cache_put((const char *)sess->s5_ctx.dst_addr, NULL, uv_now(g_loop));
     uv_freeaddrinfo(res);
     client_tcp_write_error((uv_stream_t *)sess->client_tcp, status);
     return;
   }
 
+  dns_cache_put((const char *)sess->s5_ctx.dst_addr, res, uv_now(g_loop));
+
   char ipstr[INET6_ADDRSTRLEN];
   struct sockaddr_storage addr;
 
@@ -780,6 +2157,14 @@ void upstream_tcp_connect_domain(uv_getaddrinfo_t* req, int status,
 }
 
 void upstream_tcp_connect_cb(uv_connect_t* req, int status) {
+  TCPSession *sess = container_of(req, TCPSession, upstream_connect_req);
+  int state = sess != NULL ? (int)sess->state : -1;
+  uint64_t start_ns = stall_prof_enter();
+  upstream_tcp_connect_dispatch(req, status);
+  stall_prof_leave(start_ns, STALL_SITE_CONNECT, state);
+}
+
+void upstream_tcp_connect_dispatch(uv_connect_t* req, int status) {
   TCPSession *sess = container_of(req, TCPSession, upstream_connect_req);
   if (sess == NULL) {
     return;
@@ -787,11 +2172,18 @@ void upstream_tcp_connect_cb(uv_connect_t* req, int status) {
 
   upstream_tcp_connect_log((Session *)sess, status);
   if (status < 0) {
+    ++g_metrics.connect_failures;
     int keep_session_alive = (intptr_t)req->data;
     if (!keep_session_alive) {
-      client_tcp_write_error((uv_stream_t *)sess->client_tcp, status); 
+      client_tcp_write_error((uv_stream_t *)sess->client_tcp, status);
     }
   } else {
+    // ts is 0 when the upstream came out of the warm tunnel pool, there
+    // was no connect to time in that case
+    if (sess->upstream_connect_ts != 0) {
+      metrics_connect_observe(sess->upstream_connect_ts);
+      sess->upstream_connect_ts = 0;
+    }
     // not a DIRECT connect, send the socks5 request to remote server
     if (sess->socks5_req_data != NULL) {
       sess->state = S5_START_PROXY;
@@ -841,82 +2233,16 @@ void finish_socks5_udp_handshake(Session *sess) {
     addr6->sin6_port = 0;
   }
 
-  UDPSession *udp_sess = (UDPSession *)sess;
-  if (init_udp_handle(sess, &udp_sess->upstream_udp) < 0) {
-    return;
-  }
-  if (init_udp_handle(sess, &udp_sess->client_udp_recv) < 0) {
-    return;
-  }
-  uv_udp_bind(udp_sess->client_udp_recv, (struct sockaddr *)&addr, 
-      UV_UDP_REUSEADDR);
-
-  init_client_udp_send_if_needed(udp_sess);
-
-  // get the bound port and send it to the client, so the client
-  // can send us UDP packets on this port
-  if ((err = uv_udp_getsockname(udp_sess->client_udp_recv, 
-          (struct sockaddr *)&addr, (int []){ sizeof(addr) })) < 0) {
-    LOG_W("uv_udp_getsockname failed: %s", uv_strerror(err));
+  // all associates on this worker share one relay socket; the reply just
+  // points the client at it
+  struct sockaddr_storage relay_addr;
+  if ((err = udp_relay_start(g_loop, (struct sockaddr *)&addr,
+          &relay_addr)) != 0) {
     client_tcp_write_error((uv_stream_t *)sess->client_tcp, err);
     return;
   }
 
-  uv_udp_recv_start(udp_sess->client_udp_recv, on_client_udp_alloc, 
-      on_client_udp_recv_done);
-
-  finish_socks5_handshake(sess, (struct sockaddr *)&addr);
-}
-
-void init_client_udp_send_if_needed(UDPSession *sess) {
-  Socks5Ctx *s5_ctx = &sess->s5_ctx;
-  if (s5_ctx->dst_port == 0) {
-    return;
-  }
-
-  if (s5_ctx->atyp == S5_ATYP_DOMAIN) {
-    struct addrinfo hint;
-    memset(&hint, 0, sizeof(hint));
-    hint.ai_family = AF_UNSPEC;
-    hint.ai_socktype = SOCK_DGRAM;
-    hint.ai_protocol = IPPROTO_UDP;
-
-    int err;
-    if ((err = uv_getaddrinfo(g_loop, 
-            &((UDPSession *)sess)->client_udp_addrinfo_req, 
-            client_udp_send_domain_resolved,
-            (const char *)s5_ctx->dst_addr, 
-            NULL, 
-            &hint)) < 0) {
-
-      LOG_E("uv_getaddrinfo failed: %s, err: %s", 
-          s5_ctx->dst_addr, uv_strerror(err));
-    }
-    return;
-  } 
-
-  if (s5_ctx->atyp == S5_ATYP_IPV4) {
-    if (is_ipv4_addr_any((const char *)s5_ctx->dst_addr)) {
-      return;
-    }
-#ifdef IGNORE_LOCAL_UDP_RELAY
-    if (is_ipv4_addr_local((const char *)s5_ctx->dst_addr)) {
-      return;
-    }
-#endif
-
-  } else if (s5_ctx->atyp == S5_ATYP_IPV6) {
-    if (is_ipv6_addr_any((const char *)s5_ctx->dst_addr)) {
-      return;
-    }
-#ifdef IGNORE_LOCAL_UDP_RELAY
-    if (is_ipv6_addr_local((const char *)s5_ctx->dst_addr))) {
-      return;
-    }
-#endif
-  } else 
-
-  init_udp_handle((Session *)sess, &sess->client_udp_send);
+  finish_socks5_handshake(sess, (struct sockaddr *)&relay_addr);
 }
 
 void finish_socks5_handshake(Session *sess, struct sockaddr *addr) {
@@ -972,10 +2298,38 @@ void upstream_tcp_connect_log(Session *sess, int status) {
 
 }
 
+#if defined(__linux__) && defined(TCP_FASTOPEN_CONNECT)
+// lets the first payload (the buffered socks5_req_data) ride the SYN once
+// the kernel holds a TFO cookie for the remote, erasing a connect RTT from
+// time-to-first-byte on repeat connections. uv_tcp_connect only creates
+// the socket inside connect(2), so open one ourselves, set the option and
+// hand it to libuv; on any failure the plain connect path is unaffected.
+static void tcp_enable_fastopen_connect(uv_tcp_t *handle, int family) {
+  int fd = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return;
+  }
+  int on = 1;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &on,
+        sizeof(on)) != 0 ||
+      uv_tcp_open(handle, fd) != 0) {
+    close(fd);
+    return;
+  }
+  // flags cached before the handle had a socket are not replayed by
+  // uv_tcp_open, reapply
+  uv_tcp_keepalive(handle, 1, KEEPALIVE);
+}
+#endif
+
 int upstream_tcp_connect(uv_connect_t *req, struct sockaddr *addr) {
   TCPSession *sess = container_of(req, TCPSession, upstream_connect_req);
   int err;
-  if ((err = uv_tcp_connect(req, sess->upstream_tcp, (struct sockaddr *)addr, 
+#if defined(__linux__) && defined(TCP_FASTOPEN_CONNECT)
+  tcp_enable_fastopen_connect(sess->upstream_tcp, addr->sa_family);
+#endif
+  sess->upstream_connect_ts = uv_hrtime();
+  if ((err = uv_tcp_connect(req, sess->upstream_tcp, (struct sockaddr *)addr,
           upstream_tcp_connect_cb)) != 0) {
     LOG_W("uv_tcp_connect failed: %s", uv_strerror(err));
   }
@@ -998,297 +2352,3 @@ int upstream_tcp_connect(uv_connect_t *req, struct sockaddr *addr) {
   return err;
 }
 
-void on_client_udp_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
-  UDPSession *sess = (UDPSession *)handle->data;
-  buf->base = sess->clinet_udp_recv_buf;
-  // reserve some space for encrypted version of the data
-  buf->len = sizeof(sess->clinet_udp_recv_buf) - MAX_IV_LEN;
-}
-
-void on_client_udp_recv_done(uv_udp_t *handle, ssize_t nread, 
-    const uv_buf_t* buf, const struct sockaddr* addr, unsigned flags) {
-  if (nread < 0) {
-    if (nread != UV_EOF) {
-      LOG_E("client udp packet failed: %s", uv_strerror(nread));
-    }
-    return;
-  }
-
-  if (nread == 0 && addr == NULL) {
-    return;
-  }
-
-  LOG_V("received udp packet: %lu", nread);
-  UDPSession *sess = (UDPSession *)handle->data;
-  if (sess == NULL) {
-    return;
-  }
-  int err;
-  if ((err = socks5_parse_udp_request(&sess->s5_ctx, buf->base, buf->len)) != S5_OK) {
-      LOG_E("socks5_parse_udp_request failed, ignored the dgram, err: %d", err);
-      return;
-  }
-
-  uv_udp_recv_stop(handle);
-
-  ((uv_buf_t *)buf)->len = nread;
-
-  Socks5Ctx *s5_ctx = &sess->s5_ctx;
-  if (s5_ctx->atyp == S5_ATYP_IPV4) {
-    struct sockaddr_in addr4;
-    addr4.sin_family = AF_INET;
-    addr4.sin_port = htons(s5_ctx->dst_port);
-    memcpy(&addr4.sin_addr.s_addr, s5_ctx->dst_addr, 4);
-
-    err = uv_udp_send(&sess->upstream_udp_send_req, sess->upstream_udp, 
-        buf, 1, (struct sockaddr *)&addr4, on_upstream_udp_send_done);
-    if (err < 0) {
-      LOG_E("uv_udp_send failed: %s", uv_strerror(err));
-      log_ipv6_and_port(s5_ctx->dst_addr, s5_ctx->dst_port, 
-          "uv_udp_send failed");
-      client_udp_recv_start(sess);
-    }
-
-  } else if (s5_ctx->atyp == S5_ATYP_DOMAIN) {
-    struct addrinfo hint;
-    memset(&hint, 0, sizeof(hint));
-    hint.ai_family = AF_UNSPEC;
-    hint.ai_socktype = SOCK_DGRAM;
-    hint.ai_protocol = IPPROTO_UDP;
-
-    ((UDPSession *)sess)->upstream_udp_addrinfo_req.data = (void *)buf;
-
-    LOG_V("now will send udp packet to: %s", (const char *)s5_ctx->dst_addr);
-    int err;
-    if ((err = uv_getaddrinfo(g_loop, 
-            &((UDPSession *)sess)->upstream_udp_addrinfo_req, 
-            upstream_udp_send,
-            (const char *)s5_ctx->dst_addr, 
-            NULL, 
-            &hint)) < 0) {
-
-      LOG_E("uv_getaddrinfo failed: %s, err: %s", 
-          s5_ctx->dst_addr, uv_strerror(err));
-      client_udp_recv_start(sess);
-    }
-
-  } else if (s5_ctx->atyp == S5_ATYP_IPV6) {
-    struct sockaddr_in6 addr6;
-    addr6.sin6_family = AF_INET6;
-    addr6.sin6_port = htons(s5_ctx->dst_port);
-    memcpy(addr6.sin6_addr.s6_addr, s5_ctx->dst_addr, 16);
-
-    err = uv_udp_send(&sess->upstream_udp_send_req, sess->upstream_udp, 
-        buf, 1, (struct sockaddr *)&addr6, on_upstream_udp_send_done);
-    if (err < 0) {
-      LOG_E("uv_udp_send failed: %s", uv_strerror(err));
-      log_ipv6_and_port(s5_ctx->dst_addr, s5_ctx->dst_port, 
-          "uv_udp_send failed");
-
-      client_udp_recv_start(sess);
-    }
-
-  } else {
-    LOG_E("unknown ATYP: %d", s5_ctx->atyp);
-    client_udp_recv_start(sess);
-  }
-}
-
-void on_upstream_udp_send_done(uv_udp_send_t* req, int status) {
-  LOG_I("udp package sent: %s", status == 0 ? "SUCCEEDED" : uv_strerror(status));
-  UDPSession *sess = container_of(req, UDPSession, upstream_udp_send_req);
-  client_udp_recv_start(sess);
-}
-
-int client_udp_recv_start(UDPSession *sess) {
-  int err = uv_udp_recv_start(sess->client_udp_recv, on_client_udp_alloc, 
-      on_client_udp_recv_done);
-  if (err < 0) {
-    LOG_E("uv_udp_recv_start failed: %s", uv_strerror(err));
-    return err;
-  }
-  // if client_udp_send is bound, then we should start listening for UDP packets 
-  // sent from the upstream_udp port which we initially relayed the packets to.
-  if (sess->client_udp_send != NULL) {
-    LOG_I("now will listen for UDP packets from remote");
-    err = uv_udp_recv_start(sess->upstream_udp, on_upstream_udp_alloc, 
-        on_upstream_udp_recv_done);
-    if (err < 0) {
-      LOG_E("uv_udp_recv_start failed: %s", uv_strerror(err));
-    }
-  }
-  return err;
-}
-
-void upstream_udp_send(uv_getaddrinfo_t* req, int status, struct addrinfo* res) {
-  UDPSession *sess = container_of(req, UDPSession, upstream_udp_addrinfo_req);
-  if (status < 0) {
-    LOG_E("getaddrinfo(\"%s\"): %s", sess->s5_ctx.dst_addr, uv_strerror(status));
-    uv_freeaddrinfo(res);
-    client_udp_recv_start(sess);
-    return;
-  }
-
-  char ipstr[INET6_ADDRSTRLEN];
-  struct sockaddr_storage addr;
-
-  int err = -1;
-  for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
-    if (fill_ipaddr((struct sockaddr *)&addr, htons(sess->s5_ctx.dst_port), 
-          ipstr, sizeof(ipstr), ai) != 0) {
-      continue;
-    }
-
-    err = uv_udp_send(&sess->upstream_udp_send_req, sess->upstream_udp, 
-        (uv_buf_t *)req->data, 1, (struct sockaddr *)&addr,
-        on_upstream_udp_send_done);
-
-    if (err < 0) {
-      LOG_E("uv_udp_send to %s:%d failed: %s", ipstr, sess->s5_ctx.dst_port, 
-          uv_strerror(err));
-      continue;
-    }
-
-    break;
-  }
-
-  uv_freeaddrinfo(res);
-
-  if (err == -1) {
-    // if we havn't successfully sent out the packets, 
-    // on_upstream_udp_send_done will not be called, so we have to call the 
-    // following function right here
-    client_udp_recv_start(sess);
-  }
-}
-
-void on_upstream_udp_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
-  UDPSession *sess = (UDPSession *)handle->data;
-  // 22 to encapsulate the header, see on_upstream_udp_recv_done
-  buf->base = sess->upstream_udp_buf + 22;
-  buf->len = sizeof(sess->upstream_udp_buf) - 22; 
-}
-
-void on_upstream_udp_recv_done(uv_udp_t *handle, ssize_t nread, 
-    const uv_buf_t *buf, const struct sockaddr *addr, unsigned flags) {
-  if (nread < 0) {
-    if (nread != UV_EOF) {
-      LOG_E("received udp packet failed: %s", uv_strerror(nread));
-    }
-    return;
-  }
-
-  if (nread == 0 && addr == NULL) {
-    return;
-  }
-
-  LOG_V("received udp packet: %lu", nread);
-
-  uv_udp_recv_stop(handle);
-
-  UDPSession *sess = (UDPSession *)handle->data;
-  if (sess == NULL) {
-    return;
-  }
-
-  if (addr->sa_family == AF_INET) {
-    ((uv_buf_t *)buf)->base -= 10;
-    ((uv_buf_t *)buf)->len = nread + 10;
-    char *data = buf->base;
-    data[0] = 0; // RSV
-    data[1] = 0; // RSV
-    data[2] = 0; // FRAG
-    data[3] = 1; // IPv4
-    memcpy(&data[4], (char *)&((struct sockaddr_in *)addr)->sin_addr.s_addr, 4);
-    data[8] = (unsigned char)(((struct sockaddr_in *)addr)->sin_port >> 8);
-    data[9] = (unsigned char)(((struct sockaddr_in *)addr)->sin_port);
-  } else if (addr->sa_family == AF_INET6) {
-    ((uv_buf_t *)buf)->base -= 22;
-    ((uv_buf_t *)buf)->len = nread + 22;
-    char *data = buf->base;
-    data[0] = 0; // RSV
-    data[1] = 0; // RSV
-    data[2] = 0; // FRAG
-    data[3] = 4; // IPv6
-    memcpy(&data[4], ((struct sockaddr_in6 *)addr)->sin6_addr.s6_addr, 16);
-    data[20] = (unsigned char)(((struct sockaddr_in6 *)addr)->sin6_port >> 8);
-    data[21] = (unsigned char)(((struct sockaddr_in6 *)addr)->sin6_port);
-  } else {
-    // unreachable code
-    LOG_W("unepxected sa_family: %d", addr->sa_family);
-    return;
-  }
-
-  Socks5Ctx *s5_ctx = &sess->s5_ctx;
-  struct sockaddr_storage c_addr;
-
-  if (s5_ctx->atyp == S5_ATYP_IPV4) {
-    struct sockaddr_in *addr4 = (struct sockaddr_in *)&c_addr;
-    copy_ipv4_addr(&addr4->sin_addr.s_addr, (char *)s5_ctx->dst_addr);
-    addr4->sin_family = AF_INET;
-    addr4->sin_port = s5_ctx->dst_port;;
-
-  } else if (s5_ctx->atyp == S5_ATYP_IPV6) {
-    struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&c_addr;
-    memcpy(addr6->sin6_addr.s6_addr, s5_ctx->dst_addr, 16);
-    addr6->sin6_family = AF_INET6;
-    addr6->sin6_port = s5_ctx->dst_port;;
-
-  } else {
-    // unreachable code
-    LOG_W("unepxected atyp: %d", s5_ctx->atyp);
-    return;
-  }
-
-  int err = uv_udp_send(&sess->client_udp_send_req, sess->client_udp_send, 
-      buf, 1, (struct sockaddr *)&c_addr,
-      on_client_udp_send_done);
-
-  if (err < 0) {
-    LOG_E("uv_udp_send to %d failed: %s", s5_ctx->dst_port, uv_strerror(err));
-  }
-}
-
-void on_client_udp_send_done(uv_udp_send_t* req, int status) {
-  LOG_I("client_udp_send status: %s", status == 0 ? 
-      "SUCCEEDED" : uv_strerror(status));
-}
-
-void client_udp_send_domain_resolved(uv_getaddrinfo_t* req, int status, 
-    struct addrinfo* res) {
-  UDPSession *sess = container_of(req, UDPSession, client_udp_addrinfo_req);
-
-  if (status < 0) {
-    LOG_E("getaddrinfo(\"%s\"): %s", sess->s5_ctx.dst_addr, uv_strerror(status));
-    uv_freeaddrinfo(res);
-    return;
-  }
-  
-  for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
-    LOG_V("domain [%s] resolved", sess->s5_ctx.dst_addr);
-
-    if (ai->ai_family == AF_INET) {
-      struct sockaddr_in *sai = (struct sockaddr_in *)ai->ai_addr;
-      sess->s5_ctx.atyp = S5_ATYP_IPV4;
-      sess->s5_ctx.dst_addr[0] = (sai->sin_addr.s_addr >> 24) & 0xff;
-      sess->s5_ctx.dst_addr[1] = (sai->sin_addr.s_addr >> 16) & 0xff;
-      sess->s5_ctx.dst_addr[2] = (sai->sin_addr.s_addr >> 8) & 0xff;
-      sess->s5_ctx.dst_addr[3] = sai->sin_addr.s_addr & 0xff;
-
-    } else if (ai->ai_family == AF_INET6) {
-      struct sockaddr_in6 *sai6 = (struct sockaddr_in6 *)ai->ai_addr;
-      sess->s5_ctx.atyp = S5_ATYP_IPV6;
-      memcpy(sess->s5_ctx.dst_addr, sai6->sin6_addr.s6_addr, 16);
-    }
-
-    if (init_udp_handle((Session *)sess, &sess->client_udp_send) < 0) {
-      continue;
-    }
-
-    uv_freeaddrinfo(res);
-    return;
-  }
-
-  close_session((Session *)sess);
-  uv_freeaddrinfo(res);
-}
@@ -0,0 +1,165 @@
+#include "log.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <uv.h>
+
+// Asynchronous logging backend. By default log_write formats and writes
+// to stderr synchronously, exactly like the old header-only macros did.
+// Once log_async_start() is called (redirect_stderr_to_file does it, so
+// daemons and anything logging to a file get it automatically), callers
+// only format their message into a cell of a lock-free MPSC ring and a
+// dedicated writer thread renders the timestamp/prefix and drains to
+// stderr. When the ring is full the line is dropped and counted; the
+// writer reports the number of dropped lines once it catches up.
+
+#define LOG_RING_SIZE 4096  // must be a power of two
+#define LOG_RING_MASK (LOG_RING_SIZE - 1)
+
+typedef struct {
+  uint64_t seq;
+  struct timeval tv;
+  const char *file;  // __FILE__/__FUNCTION__ are static storage, safe to keep
+  const char *func;
+  int line;
+  char level;
+  char msg[MAX_FMT_SIZE + 1];
+} LogCell;
+
+static LogCell g_ring[LOG_RING_SIZE];
+static uint64_t g_head;
+static uint64_t g_tail;  // writer thread only
+static uint64_t g_dropped;
+static int g_async_on;
+static int g_stop;
+static uv_thread_t g_writer_thread;
+
+static char *strtime(char *buffer, const struct timeval *now) {
+  size_t len = strftime(buffer, TIME_BUFFER_SIZE, "%Y-%m-%d %H:%M:%S.",
+      localtime(&now->tv_sec));
+  int milli = now->tv_usec / 1000;
+  sprintf(buffer + len, "%03d", milli);
+  return buffer;
+}
+
+static const char *level_color(char level) {
+  switch (level) {
+    case 'I': return KGRN;
+    case 'W': return KYEL;
+    case 'E': return KRED;
+    default:  return KNRM;
+  }
+}
+
+static void emit(char level, const struct timeval *tv, const char *file,
+    int line, const char *func, const char *msg) {
+  char time_buf[TIME_BUFFER_SIZE];
+  fprintf(stderr, "%s%s [%c] [%s:%d] %s - %s\n", level_color(level),
+      strtime(time_buf, tv), level, file, line, func, msg);
+}
+
+static void writer_thread(void *arg) {
+  for (;;) {
+    LogCell *cell = &g_ring[g_tail & LOG_RING_MASK];
+    uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+
+    if ((int64_t)(seq - (g_tail + 1)) == 0) {
+      emit(cell->level, &cell->tv, cell->file, cell->line, cell->func,
+          cell->msg);
+      // hand the cell back to the producers
+      __atomic_store_n(&cell->seq, g_tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+      ++g_tail;
+      continue;
+    }
+
+    // caught up: report drops, flush, then wait for more
+    uint64_t dropped = __atomic_exchange_n(&g_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0) {
+      struct timeval now;
+      gettimeofday(&now, NULL);
+      char msg[MAX_FMT_SIZE + 1];
+      snprintf(msg, sizeof(msg),
+          "log ring full, dropped %llu lines", (unsigned long long)dropped);
+      emit('W', &now, __FILE__, __LINE__, "writer_thread", msg);
+    }
+    fflush(stderr);
+
+    if (__atomic_load_n(&g_stop, __ATOMIC_ACQUIRE)) {
+      return;
+    }
+    struct timespec ts = { 0, 5 * 1000000 };  // 5ms
+    nanosleep(&ts, NULL);
+  }
+}
+
+static void log_async_stop() {
+  // back to the synchronous path for anything logged during teardown
+  __atomic_store_n(&g_async_on, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&g_stop, 1, __ATOMIC_RELEASE);
+  uv_thread_join(&g_writer_thread);
+}
+
+void log_async_start() {
+  if (g_async_on) {
+    return;
+  }
+  for (int i = 0; i < LOG_RING_SIZE; ++i) {
+    g_ring[i].seq = i;
+  }
+  if (uv_thread_create(&g_writer_thread, writer_thread, NULL) != 0) {
+    fprintf(stderr, "failed to start the log writer thread, "
+        "logging stays synchronous\n");
+    return;
+  }
+  atexit(log_async_stop);
+  __atomic_store_n(&g_async_on, 1, __ATOMIC_RELEASE);
+}
+
+void log_write(char level, const char *file, int line, const char *func,
+    const char *fmt, ...) {
+  va_list args;
+
+  if (!__atomic_load_n(&g_async_on, __ATOMIC_ACQUIRE)) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    char msg[MAX_FMT_SIZE + 1];
+    va_start(args, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+    emit(level, &now, file, line, func, msg);
+    return;
+  }
+
+  // Vyukov-style bounded MPSC enqueue: claim a cell with a CAS on the
+  // head, format into it, then publish it to the writer via its seq
+  uint64_t pos = __atomic_load_n(&g_head, __ATOMIC_RELAXED);
+  for (;;) {
+    LogCell *cell = &g_ring[pos & LOG_RING_MASK];
+    uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    int64_t dif = (int64_t)(seq - pos);
+
+    if (dif == 0) {
+      if (__atomic_compare_exchange_n(&g_head, &pos, pos + 1, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        gettimeofday(&cell->tv, NULL);
+        cell->file = file;
+        cell->func = func;
+        cell->line = line;
+        cell->level = level;
+        va_start(args, fmt);
+        vsnprintf(cell->msg, sizeof(cell->msg), fmt, args);
+        va_end(args);
+        __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+        return;
+      }
+      // CAS failed, pos was refreshed with the current head, retry
+    } else if (dif < 0) {
+      // the writer is a full lap behind, drop instead of blocking the loop
+      __atomic_fetch_add(&g_dropped, 1, __ATOMIC_RELAXED);
+      return;
+    } else {
+      pos = __atomic_load_n(&g_head, __ATOMIC_RELAXED);
+    }
+  }
+}
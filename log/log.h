@@ -19,29 +19,25 @@
 #define KGRN  "\x1B[32m"
 #define KYEL  "\x1B[33m"
 #else
-#define KNRM
-#define KRED
-#define KGRN
-#define KYEL 
+#define KNRM  ""
+#define KRED  ""
+#define KGRN  ""
+#define KYEL  ""
 #endif
 
-#if !defined(__ANDROID__) && \
-    (defined(LOG_VERBOSE) || \
-     defined(LOG_DEBUG) || \
-     defined(LOG_INFO) || \
-     defined(LOG_WARN) || \
-     defined(LOG_ERROR))
-static char *strtime(char *buffer) {
-    struct timeval now;
-    gettimeofday(&now, NULL);
-
-    size_t len = strftime(buffer, TIME_BUFFER_SIZE, "%Y-%m-%d %H:%M:%S.", 
-        localtime(&now.tv_sec));
-    int milli = now.tv_usec / 1000;
-    sprintf(buffer + len, "%03d", milli);
-
-    return buffer;
-}
+#ifndef __ANDROID__
+// the backend behind the LOG_* macros (log/log.c): synchronous fprintf to
+// stderr by default; after log_async_start() the call only formats the
+// message into a lock-free ring and a writer thread drains to stderr,
+// dropping (and counting) lines when the ring is full.
+// redirect_stderr_to_file() starts the async backend automatically.
+void log_write(char level, const char *file, int line, const char *func,
+    const char *fmt, ...)
+#if defined(__GNUC__)
+    __attribute__((format(printf, 5, 6)))
+#endif
+    ;
+void log_async_start();
 #endif
 
 #if defined(LOG_VERBOSE)
@@ -53,11 +49,7 @@ static char *strtime(char *buffer) {
 }
 #else
 #define LOG_V(fmt, ...) \
-{ \
-  char _Buf_[TIME_BUFFER_SIZE];  \
-  fprintf(stderr, KNRM "%s [V] [%s:%d] %s - " fmt "\n", strtime(_Buf_), __FILE__, \
-      __LINE__, __FUNCTION__, ##__VA_ARGS__); \
-}
+  log_write('V', __FILE__, __LINE__, __FUNCTION__, fmt, ##__VA_ARGS__)
 #endif
 #else
 #define LOG_V(fmt, ...)
@@ -72,11 +64,7 @@ static char *strtime(char *buffer) {
 }
 #else
 #define LOG_D(fmt, ...) \
-{ \
-  char _Buf_[TIME_BUFFER_SIZE];  \
-  fprintf(stderr, KNRM "%s [D] [%s:%d] %s - " fmt "\n", strtime(_Buf_), __FILE__, \
-      __LINE__, __FUNCTION__, ##__VA_ARGS__); \
-}
+  log_write('D', __FILE__, __LINE__, __FUNCTION__, fmt, ##__VA_ARGS__)
 #endif
 #else
 #define LOG_D(fmt, ...)
@@ -91,11 +79,7 @@ static char *strtime(char *buffer) {
 }
 #else
 #define LOG_I(fmt, ...) \
-{ \
-  char _Buf_[TIME_BUFFER_SIZE];  \
-  fprintf(stderr, KGRN "%s [I] [%s:%d] %s - " fmt "\n", strtime(_Buf_), __FILE__, \
-      __LINE__, __FUNCTION__, ##__VA_ARGS__); \
-}
+  log_write('I', __FILE__, __LINE__, __FUNCTION__, fmt, ##__VA_ARGS__)
 #endif
 #else
 #define LOG_I(fmt, ...)
@@ -111,11 +95,7 @@ static char *strtime(char *buffer) {
 }
 #else
 #define LOG_W(fmt, ...) \
-{ \
-  char _Buf_[TIME_BUFFER_SIZE];  \
-  fprintf(stderr, KYEL "%s [W] [%s:%d] %s - " fmt "\n", strtime(_Buf_), __FILE__, \
-      __LINE__, __FUNCTION__, ##__VA_ARGS__); \
-}
+  log_write('W', __FILE__, __LINE__, __FUNCTION__, fmt, ##__VA_ARGS__)
 #endif
 #else
 #define LOG_W(fmt, ...)
@@ -131,11 +111,7 @@ static char *strtime(char *buffer) {
 }
 #else
 #define LOG_E(fmt, ...) \
-{ \
-  char _Buf_[TIME_BUFFER_SIZE];  \
-  fprintf(stderr, KRED "%s [E] [%s:%d] %s - " fmt "\n", strtime(_Buf_), __FILE__, \
-      __LINE__, __FUNCTION__, ##__VA_ARGS__); \
-}
+  log_write('E', __FILE__, __LINE__, __FUNCTION__, fmt, ##__VA_ARGS__)
 #endif
 #else
 #define LOG_E(fmt, ...)
@@ -0,0 +1,222 @@
+#include "metrics.h"
+#include "log/log.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_METRICS_WORKERS 64
+
+__thread Metrics g_metrics;
+
+// the slot array is written once per worker at startup (under the mutex)
+// and then only read; the dump sums live counters with plain loads, a
+// slightly stale value is fine for stats
+static Metrics *g_metrics_slots[MAX_METRICS_WORKERS];
+static int g_metrics_slot_count;
+static uv_mutex_t g_metrics_mu;
+static uv_once_t g_metrics_once = UV_ONCE_INIT;
+
+static uv_signal_t g_dump_signal;
+
+// stall profiler state; the threshold is process-wide and set before the
+// workers start, the handles and timestamps belong to each worker's loop
+static int g_stall_threshold_ms;
+static __thread uv_prepare_t g_stall_prepare;
+static __thread uv_check_t g_stall_check;
+static __thread uint64_t g_stall_poll_start;
+static __thread uint64_t g_stall_idle_start;
+
+static const char *s5_err_names[METRICS_S5_ERR_COUNT] = {
+  "ok", "bad_version", "junk_in_handshake", "junk_in_request",
+  "unsupported_cmd", "bad_atyp", "bad_udp_request", "other",
+};
+
+static const char *stall_site_names[STALL_SITE_COUNT] = {
+  "client_read", "upstream_read", "connect",
+};
+
+// indexed by SessionState from defs.h
+static const char *sess_state_names[] = {
+  "method_identification", "request", "start_proxy",
+  "finishing_handshake", "streaming", "streaming_end", "closing",
+};
+
+static void metrics_global_init() {
+  uv_mutex_init(&g_metrics_mu);
+}
+
+void metrics_worker_register() {
+  uv_once(&g_metrics_once, metrics_global_init);
+  uv_mutex_lock(&g_metrics_mu);
+  if (g_metrics_slot_count < MAX_METRICS_WORKERS) {
+    g_metrics_slots[g_metrics_slot_count++] = &g_metrics;
+  } else {
+    LOG_W("metrics slot array full, worker not registered");
+  }
+  uv_mutex_unlock(&g_metrics_mu);
+}
+
+static int lat_bucket(uint64_t ms) {
+  int bucket = 0;
+  while (bucket < METRICS_LAT_BUCKETS - 1 && ms >= (1ull << bucket)) {
+    ++bucket;
+  }
+  return bucket;
+}
+
+void metrics_connect_observe(uint64_t start_ns) {
+  uint64_t ms = (uv_hrtime() - start_ns) / 1000000;
+  ++g_metrics.connect_lat[lat_bucket(ms)];
+}
+
+// prepare runs right before the loop blocks in poll, check right after the
+// poll phase's I/O callbacks; the elapsed time minus the poll's idle wait
+// is how long the callbacks kept the loop from servicing anything else
+static void stall_prepare_cb(uv_prepare_t *handle) {
+  g_stall_poll_start = uv_hrtime();
+  g_stall_idle_start = uv_metrics_idle_time(handle->loop);
+}
+
+static void stall_check_cb(uv_check_t *handle) {
+  uint64_t elapsed = uv_hrtime() - g_stall_poll_start;
+  uint64_t idle = uv_metrics_idle_time(handle->loop) - g_stall_idle_start;
+  uint64_t busy_ms = (elapsed - idle) / 1000000;
+  if (busy_ms >= (uint64_t)g_stall_threshold_ms) {
+    ++g_metrics.loop_stalls;
+    LOG_W("event loop blocked for %llu ms dispatching I/O callbacks",
+        (unsigned long long)busy_ms);
+  }
+}
+
+void stall_prof_install(uv_loop_t *loop, int threshold_ms) {
+  if (threshold_ms <= 0) {
+    return;
+  }
+  g_stall_threshold_ms = threshold_ms;
+
+  int err;
+  if ((err = uv_loop_configure(loop, UV_METRICS_IDLE_TIME)) != 0) {
+    LOG_W("enabling loop idle time accounting failed: %s", uv_strerror(err));
+    return;
+  }
+  uv_prepare_init(loop, &g_stall_prepare);
+  uv_prepare_start(&g_stall_prepare, stall_prepare_cb);
+  uv_unref((uv_handle_t *)&g_stall_prepare);
+  uv_check_init(loop, &g_stall_check);
+  uv_check_start(&g_stall_check, stall_check_cb);
+  uv_unref((uv_handle_t *)&g_stall_check);
+}
+
+uint64_t stall_prof_enter() {
+  return g_stall_threshold_ms > 0 ? uv_hrtime() : 0;
+}
+
+void stall_prof_leave(uint64_t start_ns, StallSite site, int sess_state) {
+  if (start_ns == 0) {
+    return;
+  }
+  uint64_t ms = (uv_hrtime() - start_ns) / 1000000;
+  ++g_metrics.stall_lat[site][lat_bucket(ms)];
+  if (ms >= (uint64_t)g_stall_threshold_ms) {
+    LOG_W("%s callback blocked the loop for %llu ms (session state: %s)",
+        stall_site_names[site], (unsigned long long)ms,
+        sess_state >= 0 && sess_state < (int)(sizeof(sess_state_names) /
+          sizeof(sess_state_names[0])) ?
+        sess_state_names[sess_state] : "none");
+  }
+}
+
+static void metrics_aggregate(Metrics *out) {
+  memset(out, 0, sizeof(Metrics));
+  for (int i = 0; i < g_metrics_slot_count; ++i) {
+    Metrics *m = g_metrics_slots[i];
+    out->sessions_total_tcp += m->sessions_total_tcp;
+    out->sessions_total_udp += m->sessions_total_udp;
+    out->sessions_active += m->sessions_active;
+    out->bytes_encrypted += m->bytes_encrypted;
+    out->bytes_decrypted += m->bytes_decrypted;
+    out->connect_failures += m->connect_failures;
+    for (int j = 0; j < METRICS_S5_ERR_COUNT; ++j) {
+      out->handshake_errors[j] += m->handshake_errors[j];
+    }
+    for (int j = 0; j < METRICS_LAT_BUCKETS; ++j) {
+      out->connect_lat[j] += m->connect_lat[j];
+    }
+    out->loop_stalls += m->loop_stalls;
+    for (int j = 0; j < STALL_SITE_COUNT; ++j) {
+      for (int k = 0; k < METRICS_LAT_BUCKETS; ++k) {
+        out->stall_lat[j][k] += m->stall_lat[j][k];
+      }
+    }
+  }
+}
+
+static void metrics_dump() {
+  Metrics m;
+  metrics_aggregate(&m);
+
+  fprintf(stderr, "---------------- metrics (%d workers) ----------------\n",
+      g_metrics_slot_count);
+  fprintf(stderr, "sessions_active     %llu\n",
+      (unsigned long long)m.sessions_active);
+  fprintf(stderr, "sessions_total_tcp  %llu\n",
+      (unsigned long long)m.sessions_total_tcp);
+  fprintf(stderr, "sessions_total_udp  %llu\n",
+      (unsigned long long)m.sessions_total_udp);
+  fprintf(stderr, "bytes_encrypted     %llu\n",
+      (unsigned long long)m.bytes_encrypted);
+  fprintf(stderr, "bytes_decrypted     %llu\n",
+      (unsigned long long)m.bytes_decrypted);
+  fprintf(stderr, "connect_failures    %llu\n",
+      (unsigned long long)m.connect_failures);
+
+  // skip index 0 (S5_OK is not an error)
+  for (int i = 1; i < METRICS_S5_ERR_COUNT; ++i) {
+    if (m.handshake_errors[i] > 0) {
+      fprintf(stderr, "handshake_error     %s %llu\n", s5_err_names[i],
+          (unsigned long long)m.handshake_errors[i]);
+    }
+  }
+
+  for (int i = 0; i < METRICS_LAT_BUCKETS; ++i) {
+    if (m.connect_lat[i] > 0) {
+      if (i < METRICS_LAT_BUCKETS - 1) {
+        fprintf(stderr, "connect_latency_ms  <%d %llu\n", 1 << i,
+            (unsigned long long)m.connect_lat[i]);
+      } else {
+        fprintf(stderr, "connect_latency_ms  >=%d %llu\n", 1 << (i - 1),
+            (unsigned long long)m.connect_lat[i]);
+      }
+    }
+  }
+  if (g_stall_threshold_ms > 0) {
+    fprintf(stderr, "loop_stalls         %llu\n",
+        (unsigned long long)m.loop_stalls);
+    for (int i = 0; i < STALL_SITE_COUNT; ++i) {
+      for (int j = 0; j < METRICS_LAT_BUCKETS; ++j) {
+        if (m.stall_lat[i][j] > 0) {
+          if (j < METRICS_LAT_BUCKETS - 1) {
+            fprintf(stderr, "%s_ms  <%d %llu\n", stall_site_names[i], 1 << j,
+                (unsigned long long)m.stall_lat[i][j]);
+          } else {
+            fprintf(stderr, "%s_ms  >=%d %llu\n", stall_site_names[i],
+                1 << (j - 1), (unsigned long long)m.stall_lat[i][j]);
+          }
+        }
+      }
+    }
+  }
+
+  fprintf(stderr, "------------------------------------------------------\n");
+  fflush(stderr);
+}
+
+static void dump_signal_cb(uv_signal_t *handle, int signum) {
+  metrics_dump();
+}
+
+void metrics_install_dump_signal(uv_loop_t *loop) {
+  uv_signal_init(loop, &g_dump_signal);
+  uv_signal_start(&g_dump_signal, dump_signal_cb, SIGUSR1);
+  uv_unref((uv_handle_t *)&g_dump_signal);
+}
@@ -0,0 +1,70 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdint.h>
+#include <uv.h>
+
+// S5Err currently tops out at S5_BAD_UDP_REQUEST == 6
+#define METRICS_S5_ERR_COUNT 8
+
+// upstream connect latency, log2 millisecond buckets:
+// [<1ms, <2ms, <4ms, ..., <1024ms, rest]
+#define METRICS_LAT_BUCKETS 12
+
+// the callback sites the stall profiler attributes loop time to
+typedef enum {
+  STALL_SITE_CLIENT_READ,
+  STALL_SITE_UPSTREAM_READ,
+  STALL_SITE_CONNECT,
+  STALL_SITE_COUNT
+} StallSite;
+
+typedef struct {
+  uint64_t sessions_total_tcp;
+  uint64_t sessions_total_udp;
+  uint64_t sessions_active;
+  uint64_t bytes_encrypted;    // plaintext bytes through stream_encrypt*
+  uint64_t bytes_decrypted;    // plaintext bytes out of stream_decrypt*
+  uint64_t handshake_errors[METRICS_S5_ERR_COUNT];
+  uint64_t connect_failures;
+  uint64_t connect_lat[METRICS_LAT_BUCKETS];
+  uint64_t loop_stalls;        // loop iterations busier than the threshold
+  uint64_t stall_lat[STALL_SITE_COUNT][METRICS_LAT_BUCKETS];
+} Metrics;
+
+// one instance per worker loop so the data path can bump counters with
+// plain unsynchronized increments; metrics_dump sums the workers on read
+extern __thread Metrics g_metrics;
+
+// publishes this worker's g_metrics for aggregation, call once per worker
+// before its loop starts relaying
+void metrics_worker_register();
+
+// buckets the elapsed time since start_ns (uv_hrtime) into connect_lat
+void metrics_connect_observe(uint64_t start_ns);
+
+// installs a SIGUSR1 watcher on the given loop that dumps the aggregated
+// counters to stderr (which may be redirected to the log file); the handle
+// is unref'ed so it never keeps the loop alive
+void metrics_install_dump_signal(uv_loop_t *loop);
+
+// Opt-in event-loop stall profiler (-S/--stall_ms). A uv_prepare/uv_check
+// pair times each loop iteration's poll phase minus the idle wait, so a
+// callback that blocks the loop shows up even when it is not one of the
+// instrumented sites; any iteration busier than the threshold bumps
+// loop_stalls and logs a warning. The heavyweight read/connect callbacks
+// are additionally bracketed with stall_prof_enter/leave, feeding the
+// per-site histograms above and naming the site and session state when a
+// single dispatch exceeds the threshold. Call once per worker loop;
+// threshold_ms <= 0 leaves the profiler off and the brackets cost one
+// branch.
+void stall_prof_install(uv_loop_t *loop, int threshold_ms);
+
+// returns the uv_hrtime the dispatch started, 0 when the profiler is off
+uint64_t stall_prof_enter();
+
+// sess_state is the SessionState captured before the dispatch (the
+// callback may have recycled the session), -1 when there was none
+void stall_prof_leave(uint64_t start_ns, StallSite site, int sess_state);
+
+#endif /* end of include guard: METRICS_H_ */
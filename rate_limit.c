@@ -0,0 +1,141 @@
+#include "rate_limit.h"
+#include "log/log.h"
+
+// refill period: short enough that a resumed session never sits idle for
+// a perceptible time, long enough that the timer stays cheap
+#define RATE_REFILL_MS 20
+
+static __thread uv_loop_t *g_rl_loop;
+static __thread uv_timer_t g_rl_timer;
+static __thread int g_rl_timer_on;
+static __thread int64_t g_rl_rate;    // bytes per second, 0 = disabled
+static __thread int64_t g_rl_burst;   // bucket capacity in bytes
+static __thread RateResumeCb g_rl_resume;
+static __thread RateState *g_rl_head;
+static __thread RateState *g_rl_tail;
+
+static void on_refill_tick(uv_timer_t *timer);
+
+void rate_limit_init(uv_loop_t *loop, int rate_kb, int burst_kb,
+    RateResumeCb resume) {
+  g_rl_loop = loop;
+  g_rl_rate = (int64_t)rate_kb * 1024;
+  g_rl_burst = burst_kb > 0 ? (int64_t)burst_kb * 1024 : g_rl_rate / 2;
+  g_rl_resume = resume;
+  uv_timer_init(loop, &g_rl_timer);
+  LOG_I("per-session rate limit: %d KB/s, burst %d KB",
+      rate_kb, (int)(g_rl_burst / 1024));
+}
+
+int rate_limit_enabled() {
+  return g_rl_rate > 0;
+}
+
+int rate_limit_throttled(RateState *rs) {
+  return rs->queued;
+}
+
+static void bucket_refill(RateState *rs, uint64_t now) {
+  if (rs->last_ms == 0) {
+    rs->tokens = g_rl_burst;  // a fresh session starts with a full bucket
+  } else if (now > rs->last_ms) {
+    rs->tokens += (int64_t)(now - rs->last_ms) * g_rl_rate / 1000;
+    if (rs->tokens > g_rl_burst) {
+      rs->tokens = g_rl_burst;
+    }
+  }
+  rs->last_ms = now;
+}
+
+static void waiter_push(RateState *rs) {
+  rs->next = NULL;
+  if (g_rl_tail != NULL) {
+    g_rl_tail->next = rs;
+  } else {
+    g_rl_head = rs;
+  }
+  g_rl_tail = rs;
+}
+
+int rate_limit_charge(RateState *rs, void *sess, int nbytes) {
+  if (g_rl_rate == 0) {
+    return 0;
+  }
+  if (rs->queued) {
+    // a charge can still land after the stop (reads already in flight),
+    // just deepen the debt; the refill ticks work it off
+    rs->tokens -= nbytes;
+    return 1;
+  }
+
+  bucket_refill(rs, uv_now(g_rl_loop));
+  rs->tokens -= nbytes;
+  if (rs->tokens > 0) {
+    return 0;
+  }
+
+  rs->sess = sess;
+  rs->queued = 1;
+  waiter_push(rs);
+  if (!g_rl_timer_on) {
+    uv_timer_start(&g_rl_timer, on_refill_tick, RATE_REFILL_MS,
+        RATE_REFILL_MS);
+    g_rl_timer_on = 1;
+  }
+  return 1;
+}
+
+void rate_limit_forget(RateState *rs) {
+  if (!rs->queued) {
+    return;
+  }
+  RateState *prev = NULL;
+  for (RateState *cur = g_rl_head; cur != NULL; prev = cur, cur = cur->next) {
+    if (cur == rs) {
+      if (prev != NULL) {
+        prev->next = cur->next;
+      } else {
+        g_rl_head = cur->next;
+      }
+      if (g_rl_tail == cur) {
+        g_rl_tail = prev;
+      }
+      break;
+    }
+  }
+  rs->queued = 0;
+  rs->next = NULL;
+}
+
+void on_refill_tick(uv_timer_t *timer) {
+  (void)timer;
+  uint64_t now = uv_now(g_rl_loop);
+
+  // service only the sessions queued before this tick; a session that is
+  // still in debt goes to the back and waits its turn again, so the
+  // waiters share the refills round-robin
+  RateState *last = g_rl_tail;
+  int done = 0;
+  while (g_rl_head != NULL && !done) {
+    RateState *rs = g_rl_head;
+    done = (rs == last);
+    g_rl_head = rs->next;
+    if (g_rl_head == NULL) {
+      g_rl_tail = NULL;
+    }
+    rs->next = NULL;
+
+    bucket_refill(rs, now);
+    if (rs->tokens > 0) {
+      rs->queued = 0;
+      g_rl_resume(rs->sess);
+    } else {
+      waiter_push(rs);
+    }
+  }
+
+  if (g_rl_head == NULL && g_rl_timer_on) {
+    uv_timer_stop(&g_rl_timer);
+    g_rl_timer_on = 0;
+  }
+}
@@ -0,0 +1,38 @@
+#ifndef RATE_LIMIT_H_
+#define RATE_LIMIT_H_
+#include <stdint.h>
+#include <uv.h>
+
+// Per-session token buckets so one bulk transfer cannot starve the
+// interactive sessions sharing a loop. Every relayed chunk is charged
+// against the session's bucket; once the bucket runs dry the caller stops
+// reading and the session joins a FIFO of waiters. A refill timer services
+// the waiters round-robin, each getting one period worth of tokens before
+// the next, so every throttled session makes progress each tick. The state
+// is per worker thread like the other pools, no locking involved.
+typedef struct RateState {
+  int64_t tokens;          // bytes the session may still relay
+  uint64_t last_ms;        // uv_now at the last refill, 0 = untouched bucket
+  void *sess;              // handed back through the resume callback
+  struct RateState *next;  // intrusive FIFO of sessions waiting for tokens
+  int queued;
+} RateState;
+
+typedef void (*RateResumeCb)(void *sess);
+
+// rate_kb is the per-session budget in KB/s; burst_kb caps how many unused
+// tokens a bucket may accumulate, <= 0 picks half a second of the rate
+void rate_limit_init(uv_loop_t *loop, int rate_kb, int burst_kb,
+    RateResumeCb resume);
+int rate_limit_enabled();
+int rate_limit_throttled(RateState *rs);
+
+// charges nbytes against the bucket; returns 1 when the bucket is
+// exhausted and the caller must stop reading until the resume callback
+// fires for this session
+int rate_limit_charge(RateState *rs, void *sess, int nbytes);
+
+// drops the session from the waiter queue, for the session teardown path
+void rate_limit_forget(RateState *rs);
+
+#endif /* end of include guard: RATE_LIMIT_H_ */
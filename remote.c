@@ -6,18 +6,36 @@
 #include "util.h"
 #include "alloc.h"
 #include "socks5.h"
+#include "dns_cache.h"
+#include "udp_relay.h"
 #include "defs.h"
 #include "encrypt.h"
+#include "metrics.h"
+#include "rate_limit.h"
+#include "graceful.h"
 #include "cli.h"
 
+#if defined(__linux__)
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#endif
+
 #define SERVER_BACKLOG 256
 #define KEEPALIVE 60
 
+// every worker thread runs its own loop with its own ServerContext, so the
+// hot path stays lock-free; the main thread resolves the listen address once
+// and the workers copy the result out of g_ctx_template
 struct ServerContext;
-static struct ServerContext *g_server_ctx;
-static uv_loop_t *g_loop;
+static __thread struct ServerContext *g_server_ctx;
+static __thread uv_loop_t *g_loop;
 static RemoteServerCliCfg g_cli_cfg = { 0 };
 
+// backpressure marks for the pipelined relay, fixed at startup (-W/-L)
+// and read-only while the workers run
+static int g_pipe_high_wm = PIPE_HIGH_WATERMARK_DEFAULT;
+static int g_pipe_low_wm = PIPE_LOW_WATERMARK_DEFAULT;
+
 typedef struct {
   const char *host;
   int local_port;
@@ -46,16 +64,32 @@ typedef struct ServerContext {
   uint8_t bound_ip[16];
 } ServerContext;
 
+static ServerContext g_ctx_template;
+static struct sockaddr_storage g_listen_addr;
+static char g_listen_ipstr[INET6_ADDRSTRLEN];
+static uv_barrier_t g_worker_barrier;
+
+typedef struct {
+  uv_thread_t thread;
+  int idx;
+} Worker;
+
 static void start_server(int argc, const char *argv[]);
-static void do_bind_and_listen(uv_getaddrinfo_t* req, int status, 
+static void start_workers(int workers);
+static void worker_thread(void *arg);
+static void do_bind_and_listen(uv_getaddrinfo_t* req, int status,
     struct addrinfo* res);
+static void listen_enable_fastopen(uv_tcp_t *tcp);
+static void listen_enable_defer_accept(uv_tcp_t *tcp);
 static void on_connection_new(uv_stream_t *server, int status);
+static void shed_idle_sessions(uv_loop_t *loop);
+static void shed_idle_walk(uv_handle_t *handle, void *arg);
 
 static int init_tcp_handle(Session *sess, uv_tcp_t **tcp_handle);
-static int init_udp_handle(Session *sess, uv_udp_t **udp_handle);
 
 static Session *create_session();
 static void close_session(Session *sess);
+static void evict_idle_session(IdleNode *node);
 static void close_handle(Session *sess, uv_handle_t *handle);
 static void handle_close_cb(uv_handle_t *handle);
 static void finish_socks5_udp_handshake(Session *sess);
@@ -64,7 +98,9 @@ static int client_tcp_read_start(uv_stream_t *handle);
 static int client_tcp_write_start(uv_stream_t *handle, const uv_buf_t *buf);
 static void on_client_tcp_alloc(uv_handle_t *handle, size_t size, 
     uv_buf_t *buf);
-static void on_client_tcp_read_done(uv_stream_t *handle, ssize_t nread, 
+static void on_client_tcp_read_done(uv_stream_t *handle, ssize_t nread,
+    const uv_buf_t *buf);
+static void client_tcp_read_dispatch(uv_stream_t *handle, ssize_t nread,
     const uv_buf_t *buf);
 static void on_client_tcp_write_done(uv_write_t *req, int status);
 static void handle_socks5_request(uv_stream_t *handle, 
@@ -79,25 +115,33 @@ static int upstream_tcp_read_start(uv_stream_t *handle);
 static int upstream_tcp_write_start(uv_stream_t *handle, const uv_buf_t *buf);
 static void on_upstream_tcp_alloc(uv_handle_t *handle, size_t size, 
     uv_buf_t *buf);
-static void on_upstream_tcp_read_done(uv_stream_t *handle, ssize_t nread, 
+static void on_upstream_tcp_read_done(uv_stream_t *handle, ssize_t nread,
+    const uv_buf_t *buf);
+static void upstream_tcp_read_dispatch(uv_stream_t *handle, ssize_t nread,
     const uv_buf_t *buf);
+static void upstream_tcp_connect_dispatch(uv_connect_t *req, int status);
 static void on_upstream_tcp_write_done(uv_write_t *req, int status);
+static PipeSlot *pipe_slot_take(StreamPipe *pipe);
+static PipeSlot *pipe_slot_from_base(StreamPipe *pipe, const char *base);
+static void pipe_read_observe(StreamPipe *pipe, PipeSlot *slot, int nread,
+    int tier_cap);
+static int stream_pipe_write(Session *sess, StreamPipe *pipe, PipeSlot *slot,
+    uv_stream_t *dst, char *data, int len, uv_write_cb cb);
+static void crypto_job_submit(TCPSession *sess, PipeSlot *slot, char *data,
+    int len, int encrypt);
+static void crypto_work_cb(uv_work_t *w);
+static void crypto_after_cb(uv_work_t *w, int status);
+static void on_to_upstream_pipe_write_done(uv_write_t *req, int status);
+static int flush_decrypt_backlog(TCPSession *sess);
+static void on_to_client_pipe_write_done(uv_write_t *req, int status);
+static void rate_limit_resume_session(void *arg);
+
+static void upstream_connected(TCPSession *sess);
+struct HERace;
+static int he_race_start(TCPSession *sess, const struct sockaddr *addr0,
+    const struct sockaddr *addr1);
+static void he_race_abort(struct HERace *race);
 
-static void on_client_udp_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf);
-static void on_client_udp_recv_done(uv_udp_t *handle, ssize_t nread, 
-    const uv_buf_t *buf, const struct sockaddr *addr, unsigned flags);
-static void on_upstream_udp_send_done(uv_udp_send_t *req, int status);
-static void on_upstream_udp_alloc(uv_handle_t *handle, size_t size, 
-    uv_buf_t *buf);
-static void on_upstream_udp_recv_done(uv_udp_t *handle, ssize_t nread, 
-    const uv_buf_t *buf, const struct sockaddr *addr, unsigned flags);
-static void on_client_udp_send_done(uv_udp_send_t *req, int status);
-static int client_udp_recv_start(UDPSession *sess);
-static void upstream_udp_send(uv_getaddrinfo_t *req, int status, 
-    struct addrinfo *res);
-static void init_client_udp_send_if_needed(UDPSession *sess);
-static void client_udp_send_domain_resolved(uv_getaddrinfo_t *req, int status, 
-    struct addrinfo *res);
 
 int main(int argc, const char *argv[]) {
   start_server(argc, argv);
@@ -123,18 +167,48 @@ void start_server(int argc, const char *argv[]) {
 
   g_loop = uv_default_loop();
 
-  ServerContext server_ctx;
-  memset(&server_ctx, 0, sizeof(ServerContext));
-  g_server_ctx = &server_ctx;
+  memset(&g_ctx_template, 0, sizeof(ServerContext));
+  g_server_ctx = &g_ctx_template;
 
-  server_ctx.server_cfg.host = g_cli_cfg.local_host;
-  server_ctx.server_cfg.local_port = g_cli_cfg.local_port;
-  server_ctx.server_cfg.backlog = SERVER_BACKLOG;
+  g_ctx_template.server_cfg.host = g_cli_cfg.local_host;
+  g_ctx_template.server_cfg.local_port = g_cli_cfg.local_port;
+  g_ctx_template.server_cfg.backlog =
+      g_cli_cfg.backlog > 0 ? g_cli_cfg.backlog : SERVER_BACKLOG;
 
-  // hardcode the server and port for testing 
+  // hardcode the server and port for testing
   cipher_global_init();
-  server_ctx.rs_cfg.cipher_name = g_cli_cfg.cipher_name;
-  server_ctx.rs_cfg.cipher_secret = g_cli_cfg.cipher_secret;
+  if (g_cli_cfg.compress && cipher_set_framing(1) != 0) {
+    exit(1);
+  }
+
+  if (g_cli_cfg.high_watermark > 0) {
+    g_pipe_high_wm = g_cli_cfg.high_watermark;
+  }
+  if (g_cli_cfg.low_watermark > 0) {
+    g_pipe_low_wm = g_cli_cfg.low_watermark;
+  }
+  if (g_pipe_low_wm >= g_pipe_high_wm) {
+    LOG_E("low_watermark (%d) must be below high_watermark (%d)",
+        g_pipe_low_wm, g_pipe_high_wm);
+    exit(1);
+  }
+
+  graceful_init(g_cli_cfg.workers <= 1 ? 1 : g_cli_cfg.workers, argv);
+
+  // in multi-worker mode the workers register their own metrics and
+  // worker #0 owns the dump signal, the main loop drains before relaying
+  if (g_cli_cfg.workers <= 1) {
+    metrics_worker_register();
+    metrics_install_dump_signal(g_loop);
+    stall_prof_install(g_loop, g_cli_cfg.stall_ms);
+    idle_wheel_init(g_loop, g_cli_cfg.idle_timeout, evict_idle_session);
+  }
+  if (g_cli_cfg.rate_limit > 0) {
+    rate_limit_init(g_loop, g_cli_cfg.rate_limit, g_cli_cfg.rate_burst,
+        rate_limit_resume_session);
+  }
+  g_ctx_template.rs_cfg.cipher_name = g_cli_cfg.cipher_name;
+  g_ctx_template.rs_cfg.cipher_secret = g_cli_cfg.cipher_secret;
 
   struct addrinfo hint;
   memset(&hint, 0, sizeof(hint));
@@ -142,19 +216,155 @@ void start_server(int argc, const char *argv[]) {
   hint.ai_socktype = SOCK_STREAM;
   hint.ai_protocol = IPPROTO_TCP;
 
-  server_ctx.addrinfo_req.data = &g_cli_cfg;
-  CHECK(uv_getaddrinfo(g_loop, 
-                       &server_ctx.addrinfo_req, 
-                       do_bind_and_listen, 
-                       g_cli_cfg.local_host, 
-                       NULL, 
+  g_ctx_template.addrinfo_req.data = &g_cli_cfg;
+  CHECK(uv_getaddrinfo(g_loop,
+                       &g_ctx_template.addrinfo_req,
+                       do_bind_and_listen,
+                       g_cli_cfg.local_host,
+                       NULL,
                        &hint) == 0);
 
   uv_run(g_loop, UV_RUN_DEFAULT);
+
+  // in multi-worker mode do_bind_and_listen only records the listen address
+  // and lets the loop drain, so we get here while the process is starting up
+  if (g_cli_cfg.workers > 1) {
+    start_workers(g_cli_cfg.workers);
+  }
+
   uv_loop_close(g_loop);
   uv_loop_delete(g_loop);
 }
 
+void start_workers(int workers) {
+  uv_barrier_init(&g_worker_barrier, workers + 1);
+
+  Worker *w = lmalloc(sizeof(Worker) * workers);
+  for (int i = 0; i < workers; ++i) {
+    w[i].idx = i;
+    CHECK(uv_thread_create(&w[i].thread, worker_thread, &w[i]) == 0);
+  }
+
+  // all workers have bound their listeners once the barrier is passed,
+  // which may require root for ports under 1024, so only then drop privileges
+  uv_barrier_wait(&g_worker_barrier);
+  uv_barrier_destroy(&g_worker_barrier);
+  if (g_cli_cfg.user) {
+    do_setuid(g_cli_cfg.user);
+  }
+  graceful_mark_ready();
+
+  for (int i = 0; i < workers; ++i) {
+    uv_thread_join(&w[i].thread);
+  }
+  free(w);
+}
+
+void worker_thread(void *arg) {
+  Worker *w = arg;
+
+  uv_loop_t loop;
+  CHECK(uv_loop_init(&loop) == 0);
+  g_loop = &loop;
+
+  metrics_worker_register();
+  if (w->idx == 0) {
+    metrics_install_dump_signal(&loop);
+  }
+  stall_prof_install(&loop, g_cli_cfg.stall_ms);
+  idle_wheel_init(&loop, g_cli_cfg.idle_timeout, evict_idle_session);
+  if (g_cli_cfg.rate_limit > 0) {
+    rate_limit_init(&loop, g_cli_cfg.rate_limit, g_cli_cfg.rate_burst,
+        rate_limit_resume_session);
+  }
+
+  ServerContext server_ctx;
+  memcpy(&server_ctx, &g_ctx_template, sizeof(ServerContext));
+  g_server_ctx = &server_ctx;
+
+  int err;
+  if ((err = tcp_bind_reuseport(&loop, &server_ctx.server_tcp,
+          (struct sockaddr *)&g_listen_addr, server_ctx.server_cfg.backlog,
+          on_connection_new)) != 0) {
+    LOG_E("worker #%d failed to listen on %s:%d: %s", w->idx, g_listen_ipstr,
+        server_ctx.server_cfg.local_port, uv_strerror(err));
+    exit(1);
+  }
+
+  LOG_I("worker #%d listening on %s:%d", w->idx, g_listen_ipstr,
+      server_ctx.server_cfg.local_port);
+  listen_enable_fastopen(&server_ctx.server_tcp);
+  listen_enable_defer_accept(&server_ctx.server_tcp);
+  graceful_register_worker(&loop, &server_ctx.server_tcp,
+      shed_idle_sessions);
+  uv_barrier_wait(&g_worker_barrier);
+
+  uv_run(&loop, UV_RUN_DEFAULT);
+  uv_loop_close(&loop);
+}
+
+// lets repeat clients carry the first encrypted chunk on the SYN; the
+// kernel ignores it gracefully when net.ipv4.tcp_fastopen disallows it
+static void listen_enable_fastopen(uv_tcp_t *tcp) {
+#if defined(__linux__) && defined(TCP_FASTOPEN)
+  uv_os_fd_t fd;
+  if (uv_fileno((uv_handle_t *)tcp, &fd) != 0) {
+    return;
+  }
+  int qlen = g_server_ctx->server_cfg.backlog;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) == 0) {
+    LOG_I("TCP_FASTOPEN enabled on the listener (qlen=%d)", qlen);
+  } else {
+    LOG_W("enabling TCP_FASTOPEN failed: %s", strerror(errno));
+  }
+#endif
+}
+
+// a peer that completes the handshake but never sends its first ciphered
+// byte (port scans, load-balancer health checks, latency probes from the
+// local servers) stays in the kernel queue instead of costing an accept
+// and a session allocation; real clients always talk first. Warm tunnels
+// parked by the local servers surface once the defer window expires
+static void listen_enable_defer_accept(uv_tcp_t *tcp) {
+#if defined(__linux__) && defined(TCP_DEFER_ACCEPT)
+  uv_os_fd_t fd;
+  if (uv_fileno((uv_handle_t *)tcp, &fd) != 0) {
+    return;
+  }
+  int secs = 3;
+  if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &secs, sizeof(secs)) != 0) {
+    LOG_W("enabling TCP_DEFER_ACCEPT failed: %s", strerror(errno));
+  }
+#endif
+}
+
+// the warm tunnels parked by the local servers sit here as sessions that
+// never sent their SOCKS5 request; a draining worker closes them instead
+// of waiting for their owners, which would hold the old process open
+// indefinitely. Sessions with a parsed request are real traffic and drain
+// at their own pace.
+void shed_idle_sessions(uv_loop_t *loop) {
+  uv_walk(loop, shed_idle_walk, NULL);
+}
+
+void shed_idle_walk(uv_handle_t *handle, void *arg) {
+  if (handle->type != UV_TCP || uv_is_closing(handle)) {
+    return;
+  }
+  // the walk sees every TCP handle on the loop, not only session-owned
+  // ones: a Happy Eyeballs race tags its upstream handles with the
+  // HEAttempt instead (see he_attempt_start), so only trust data when
+  // the handle is the session's own client socket
+  Session *sess = handle->data;
+  if (sess == NULL || sess->client_tcp != (uv_tcp_t *)handle) {
+    return;
+  }
+  if (sess->state == S5_REQUEST &&
+      sess->s5_ctx.state != S5_PARSE_STATE_FINISH) {
+    close_session(sess);
+  }
+}
+
 void do_bind_and_listen(uv_getaddrinfo_t* req, int status, struct addrinfo* res) {
   if (status < 0) {
     LOG_E("getaddrinfo(\"%s\"): %s", g_server_ctx->server_cfg.host, 
@@ -163,9 +373,6 @@ void do_bind_and_listen(uv_getaddrinfo_t* req, int status, struct addrinfo* res)
     return;
   }
 
-  // abort if failing to init uv_tcp_t
-  CHECK(uv_tcp_init(g_loop, &g_server_ctx->server_tcp) == 0);
-
   struct sockaddr_storage addr;
   char ipstr[INET6_ADDRSTRLEN];
 
@@ -183,33 +390,43 @@ void do_bind_and_listen(uv_getaddrinfo_t* req, int status, struct addrinfo* res)
 
     } else if (ai->ai_family == AF_INET6) {
       g_server_ctx->bound_ip_version = IPV6;
-      memcpy(g_server_ctx->bound_ip, 
+      memcpy(g_server_ctx->bound_ip,
           ((struct sockaddr_in6 *)&addr)->sin6_addr.s6_addr, 16);
     }
 
-    int err;
-    if ((err = uv_tcp_bind(&g_server_ctx->server_tcp, 
-            (struct sockaddr *)&addr, 0)) != 0) {
-      LOG_W("uv_tcp_bind on %s:%d failed: %s", 
-          ipstr, g_server_ctx->server_cfg.local_port, uv_strerror(err));
-      continue;
+    if (g_cli_cfg.workers > 1) {
+      // the workers bind their own SO_REUSEPORT listeners, just remember
+      // the address we settled on and let the startup loop drain
+      memcpy(&g_listen_addr, &addr, sizeof(addr));
+      memcpy(g_listen_ipstr, ipstr, sizeof(g_listen_ipstr));
+      uv_freeaddrinfo(res);
+      return;
     }
 
-    if ((err = uv_listen((uv_stream_t *)&g_server_ctx->server_tcp, 
-          g_server_ctx->server_cfg.backlog, 
-          on_connection_new)) != 0) {
-      LOG_W("uv_tcp_listen on %s:%d failed: %s", 
+    // the single listener binds with SO_REUSEPORT like the workers do, so
+    // a graceful restart's new process can bind alongside before this one
+    // stops accepting
+    int err;
+    if ((err = tcp_bind_reuseport(g_loop, &g_server_ctx->server_tcp,
+            (struct sockaddr *)&addr, g_server_ctx->server_cfg.backlog,
+            on_connection_new)) != 0) {
+      LOG_W("listening on %s:%d failed: %s",
           ipstr, g_server_ctx->server_cfg.local_port, uv_strerror(err));
       continue;
     }
-    
+
     LOG_I("server listening on %s:%d", ipstr, g_server_ctx->server_cfg.local_port);
+    listen_enable_fastopen(&g_server_ctx->server_tcp);
+    listen_enable_defer_accept(&g_server_ctx->server_tcp);
+    graceful_register_worker(g_loop, &g_server_ctx->server_tcp,
+        shed_idle_sessions);
     uv_freeaddrinfo(res);
 
     RemoteServerCliCfg *g_cli_cfg = req->data;
     if (g_cli_cfg->user) {
       do_setuid(g_cli_cfg->user);
     }
+    graceful_mark_ready();
     return;
   }
 
@@ -218,10 +435,16 @@ void do_bind_and_listen(uv_getaddrinfo_t* req, int status, struct addrinfo* res)
 } 
 
 Session *create_session() {
-  Session *sess = lmalloc(sizeof(Session));
+  // the pool block fits either session flavor, only the generic part needs
+  // to be cleared here, the TCP/UDP extension fields are zeroed when the
+  // session is specialized in handle_socks5_request
+  Session *sess = lpool_take(POOL_SESSION, sizeof(SessionStorage));
+  SESSION_CLEAR(sess);
   // on the remote side, we don't need SOCKS5 method identification
   // get right into S5_REQUEST phrase
   sess->state = S5_REQUEST;
+  idle_wheel_touch(&sess->idle_node);
+  ++g_metrics.sessions_active;
 
   cipher_ctx_init(&sess->e_ctx, g_server_ctx->rs_cfg.cipher_name, 
       g_server_ctx->rs_cfg.cipher_secret);
@@ -232,7 +455,7 @@ Session *create_session() {
 }
 
 int init_tcp_handle(Session *sess, uv_tcp_t **tcp_handle) {
-  *tcp_handle = lmalloc(sizeof(uv_tcp_t));
+  *tcp_handle = lpool_take(POOL_UV_TCP, sizeof(uv_tcp_t));
   (*tcp_handle)->data = sess;
 
   int err;
@@ -249,40 +472,45 @@ int init_tcp_handle(Session *sess, uv_tcp_t **tcp_handle) {
   return 0;
 }
 
-int init_udp_handle(Session *sess, uv_udp_t **udp_handle) {
-  *udp_handle = lmalloc(sizeof(uv_udp_t));
-  (*udp_handle)->data = sess;
-
-  int err;
-  if ((err = uv_udp_init(g_loop, *udp_handle)) != 0) {
-    LOG_E("uv_udp_init failed: %s", uv_strerror(err));
-    close_session(sess);
-    return err;
-  }
-
-  return 0;
-}
-
 void close_session(Session *sess) {
   if (sess->state == S5_CLOSING) {
     return;
   }
+  if (sess->type == SESSION_TYPE_TCP &&
+      (((TCPSession *)sess)->crypto_to_upstream.busy ||
+       ((TCPSession *)sess)->crypto_to_client.busy)) {
+    // a crypto job still reads the cipher contexts on a threadpool
+    // thread; remember the close, the last completion re-enters here
+    TCPSession *tcp_sess = (TCPSession *)sess;
+    tcp_sess->crypto_close_pending = 1;
+    if (sess->client_tcp != NULL) {
+      uv_read_stop((uv_stream_t *)sess->client_tcp);
+    }
+    if (tcp_sess->upstream_tcp != NULL) {
+      uv_read_stop((uv_stream_t *)tcp_sess->upstream_tcp);
+    }
+    return;
+  }
+
   sess->state = S5_CLOSING;
+  idle_wheel_remove(&sess->idle_node);
 
   LOG_V("now will close session: %p", sess);
   if (sess->type == SESSION_TYPE_TCP) {
     sess->heap_obj_count = 2;
 
     TCPSession *tcp_sess = (TCPSession *)sess;
+    if (tcp_sess->he_race != NULL) {
+      // the race owns the upstream handles during the connect window
+      he_race_abort((struct HERace *)tcp_sess->he_race);
+      tcp_sess->he_race = NULL;
+    }
     close_handle(sess, (uv_handle_t *)tcp_sess->upstream_tcp);
 
   } else if (sess->type == SESSION_TYPE_UDP) {
-    sess->heap_obj_count = 4;
-
-    UDPSession *udp_sess = (UDPSession *)sess;
-    close_handle(sess, (uv_handle_t *)udp_sess->upstream_udp);
-    close_handle(sess, (uv_handle_t *)udp_sess->client_udp_send);
-    close_handle(sess, (uv_handle_t *)udp_sess->client_udp_recv);
+    // only the TCP control channel belongs to the session; the datagram
+    // flows live in the shared relay and expire on their own (udp_relay.c)
+    sess->heap_obj_count = 1;
   } else {
     sess->heap_obj_count = 1;
     // type is unknown, which means the SOCKS5 connection was not 
@@ -293,6 +521,22 @@ void close_session(Session *sess) {
   close_handle(sess, (uv_handle_t *)sess->client_tcp);
 }
 
+// the idle wheel found a session with no I/O since the timeout. UDP
+// associates are exempt: the control channel is quiet by design while
+// datagrams move, and the relay sweeps its own idle flows (udp_relay.c).
+// Warm tunnels from the local servers park in S5_REQUEST without traffic
+// and are evicted like any other idle session; the local end just sees
+// EOF and refills its pool
+void evict_idle_session(IdleNode *node) {
+  Session *sess = container_of(node, Session, idle_node);
+  if (sess->type == SESSION_TYPE_UDP) {
+    idle_wheel_remove(node);
+    return;
+  }
+  LOG_V("closing idle session: %p", sess);
+  close_session(sess);
+}
+
 void close_handle(Session *sess, uv_handle_t *handle) {
   if (handle == NULL) {
     --sess->heap_obj_count;
@@ -313,13 +557,38 @@ void close_handle(Session *sess, uv_handle_t *handle) {
 void handle_close_cb(uv_handle_t *handle) {
   Session *sess = handle->data;
   --sess->heap_obj_count;
-  free(handle);
+  lpool_return(handle->type == UV_UDP ? POOL_UV_UDP : POOL_UV_TCP, handle);
 
   if (sess->heap_obj_count == 0) {
     LOG_V("now will free the session object: %p", sess);
+    --g_metrics.sessions_active;
+    if (sess->client_buf != NULL) {
+      lpool_return(POOL_BUF_SMALL, sess->client_buf);
+      sess->client_buf = NULL;
+    }
+    if (sess->type == SESSION_TYPE_TCP) {
+      // in-flight slots were already handed back by their (cancelled)
+      // write callbacks, this catches buffers a read borrowed but never
+      // queued on the peer
+      TCPSession *tcp_sess = (TCPSession *)sess;
+      for (int i = 0; i < PIPE_DEPTH; ++i) {
+        if (tcp_sess->to_upstream.slots[i].buf != NULL) {
+          lpool_return(POOL_BUF_LARGE + tcp_sess->to_upstream.slots[i].tier,
+              tcp_sess->to_upstream.slots[i].buf);
+          tcp_sess->to_upstream.slots[i].buf = NULL;
+        }
+        if (tcp_sess->to_client.slots[i].buf != NULL) {
+          lpool_return(POOL_BUF_LARGE + tcp_sess->to_client.slots[i].tier,
+              tcp_sess->to_client.slots[i].buf);
+          tcp_sess->to_client.slots[i].buf = NULL;
+        }
+      }
+      rate_limit_forget(&tcp_sess->rate);
+    }
     cipher_ctx_destroy(&sess->e_ctx);
     cipher_ctx_destroy(&sess->d_ctx);
-    free(sess);
+    free(sess->socks5_req_data);
+    lpool_return(POOL_SESSION, sess);
   }
 }
 
@@ -330,37 +599,44 @@ void on_connection_new(uv_stream_t *server, int status) {
     return;
   }
 
-  Session *sess = create_session();
-
-  if (init_tcp_handle(sess, &sess->client_tcp) < 0) {
-    close_session(sess);
-    return;
-  }
+  // drain every connection the kernel has queued before returning to the
+  // loop; during a reconnect storm a single wakeup carries many pending
+  // accepts and taking them one per event lets the SYN queue overflow
+  for (;;) {
+    Session *sess = create_session();
 
-  int err;
-  if ((err = uv_accept(server, (uv_stream_t *)sess->client_tcp)) != 0) {
-    LOG_E("uv_accept failed: %s", uv_strerror(err));
-    close_session(sess);
-    return;
-  }
+    if (init_tcp_handle(sess, &sess->client_tcp) < 0) {
+      close_session(sess);
+      return;
+    }
 
-  if (g_cli_cfg.window_size > 0) {
-    uv_os_fd_t client_tcp_fd;
-    if (uv_fileno((uv_handle_t *)&g_server_ctx->server_tcp,
-          &client_tcp_fd) == UV_EBADF) {
-      LOG_W("uv_fileno failed on server_tcp");
-    } else {
-      if (setsockopt(client_tcp_fd, SOL_SOCKET, SO_SNDBUF,
-            &g_cli_cfg.window_size, sizeof(g_cli_cfg.window_size)) != -1) {
-        LOG_I("TCP SO_SNDBUF set to %d", g_cli_cfg.window_size);
+    int err;
+    if ((err = uv_accept(server, (uv_stream_t *)sess->client_tcp)) != 0) {
+      if (err != UV_EAGAIN) {
+        LOG_E("uv_accept failed: %s", uv_strerror(err));
+      }
+      close_session(sess);
+      return;
+    }
 
+    if (g_cli_cfg.window_size > 0) {
+      uv_os_fd_t client_tcp_fd;
+      if (uv_fileno((uv_handle_t *)&g_server_ctx->server_tcp,
+            &client_tcp_fd) == UV_EBADF) {
+        LOG_W("uv_fileno failed on server_tcp");
       } else {
-        LOG_W("setting TCP SO_SNDBUF failed: %s", strerror(errno));
+        if (setsockopt(client_tcp_fd, SOL_SOCKET, SO_SNDBUF,
+              &g_cli_cfg.window_size, sizeof(g_cli_cfg.window_size)) != -1) {
+          LOG_I("TCP SO_SNDBUF set to %d", g_cli_cfg.window_size);
+
+        } else {
+          LOG_W("setting TCP SO_SNDBUF failed: %s", strerror(errno));
+        }
       }
     }
-  }
 
-  client_tcp_read_start((uv_stream_t *)sess->client_tcp);
+    client_tcp_read_start((uv_stream_t *)sess->client_tcp);
+  }
 }
 
 int client_tcp_read_start(uv_stream_t *handle) {
@@ -410,12 +686,41 @@ void on_client_tcp_write_done(uv_write_t *req, int status) {
 
 void on_client_tcp_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
   Session *sess = (Session *)handle->data;
+  if (sess->state == S5_STREAMING && sess->type == SESSION_TYPE_TCP) {
+    // streaming reads go through the pipe slots so several writes can be
+    // in flight at once; when every slot is busy the read comes back as
+    // UV_ENOBUFS and is restarted from the pipe write callback
+    PipeSlot *slot = pipe_slot_take(&((TCPSession *)sess)->to_upstream);
+    if (slot == NULL) {
+      buf->base = NULL;
+      buf->len = 0;
+      return;
+    }
+    buf->base = slot->buf + CRYPTO_HEADROOM;
+    buf->len = READ_TIER_SIZE(slot->tier);
+    return;
+  }
+  // handshake phase: borrow a small buffer, it is handed back once the
+  // session enters streaming
+  if (sess->client_buf == NULL) {
+    sess->client_buf = lpool_take(POOL_BUF_SMALL, SESSION_SMALL_BUFSIZ);
+  }
   buf->base = sess->client_buf;
-  // reserve some space for encrypted version of the data
-  buf->len = sizeof(sess->client_buf);
+  buf->len = SESSION_SMALL_BUFSIZ;
+}
+
+// thin dispatch wrapper so the stall profiler can time the callback; the
+// session state is captured up front, the dispatch may recycle the session
+void on_client_tcp_read_done(uv_stream_t *handle, ssize_t nread,
+    const uv_buf_t *buf) {
+  Session *sess = (Session *)handle->data;
+  int state = sess != NULL ? (int)sess->state : -1;
+  uint64_t start_ns = stall_prof_enter();
+  client_tcp_read_dispatch(handle, nread, buf);
+  stall_prof_leave(start_ns, STALL_SITE_CLIENT_READ, state);
 }
 
-void on_client_tcp_read_done(uv_stream_t *handle, ssize_t nread, 
+void client_tcp_read_dispatch(uv_stream_t *handle, ssize_t nread,
     const uv_buf_t *buf) {
   if (nread == 0) { // EAGAIN || EWOULDBLOCK
     return;
@@ -425,38 +730,110 @@ void on_client_tcp_read_done(uv_stream_t *handle, ssize_t nread,
   if (sess == NULL || sess->state == S5_CLOSING) {
     return;
   }
+  idle_wheel_touch(&sess->idle_node);
 
-  // stop reading so the buf can be reused and not overrun
-  uv_read_stop(handle);
+  if (nread == UV_ENOBUFS) {
+    // every pipe slot is in flight, pause until a write completes
+    ((TCPSession *)sess)->to_upstream.read_stopped = 1;
+    uv_read_stop(handle);
+    return;
+  }
 
   if (nread < 0) {
     if (nread != UV_EOF) {
       LOG_E("client read failed: %s", uv_strerror(nread));
     }
+    uv_read_stop(handle);
+    if (sess->state == S5_STREAMING && sess->type == SESSION_TYPE_TCP &&
+        (((TCPSession *)sess)->to_upstream.inflight > 0 ||
+         ((TCPSession *)sess)->to_client.inflight > 0)) {
+      // let the queued writes drain before tearing the session down
+      sess->state = S5_STREAMING_END;
+      return;
+    }
     close_session(sess);
     return;
   }
 
-  if (!stream_decrypt(&sess->d_ctx, buf->base, (int *)&nread, 1)) {
+  if (sess->state == S5_STREAMING && sess->type == SESSION_TYPE_TCP) {
+    TCPSession *tcp_sess = (TCPSession *)sess;
+    PipeSlot *slot = pipe_slot_from_base(&tcp_sess->to_upstream, buf->base);
+    // wire-side reads carry framed records of any size, no tier cap
+    pipe_read_observe(&tcp_sess->to_upstream, slot, nread, READ_TIER_MAX);
+
+    if (g_cli_cfg.crypto_offload) {
+      crypto_job_submit(tcp_sess, slot, buf->base, nread, 0);
+      return;
+    }
+
+    // deciphered in place, the plaintext starts right after the consumed IV
+    char *data;
+    if ((data = stream_decrypt_to(&sess->d_ctx, buf->base,
+            (int *)&nread)) == NULL) {
+      LOG_E("cipher_secret is incorrect");
+      close_session(sess);
+      return;
+    }
+    if (nread == 0) {
+      // an AEAD record is still incomplete, the read stays active
+      return;
+    }
+    if (sess->d_ctx.is_aead || cipher_framing()) {
+      // the reassembled plaintext lives in a per-worker staging buffer and
+      // would be clobbered by the next decrypt, move it into the slot so
+      // it survives while the write is in flight (stream_decrypt_to hands
+      // out at most DECRYPT_OUT_MAX, which fits PIPE_SLOT_BUFSIZ)
+      memcpy(slot->buf + CRYPTO_HEADROOM, data, nread);
+      data = slot->buf + CRYPTO_HEADROOM;
+    }
+
+    if (stream_pipe_write(sess, &tcp_sess->to_upstream, slot,
+          (uv_stream_t *)tcp_sess->upstream_tcp, data, nread,
+          on_to_upstream_pipe_write_done) != 0) {
+      return;
+    }
+    if (flush_decrypt_backlog(tcp_sess)) {
+      return;
+    }
+    if (tcp_sess->to_upstream.inflight >= g_pipe_high_wm ||
+        cipher_pending(&sess->d_ctx)) {
+      tcp_sess->to_upstream.read_stopped = 1;
+      uv_read_stop(handle);
+    }
+    if (rate_limit_charge(&tcp_sess->rate, tcp_sess, nread) &&
+        !tcp_sess->to_upstream.read_stopped) {
+      tcp_sess->to_upstream.read_stopped = 1;
+      uv_read_stop(handle);
+    }
+    return;
+  }
+
+  // stop reading so the buf can be reused and not overrun
+  uv_read_stop(handle);
+
+  // deciphered in place, the plaintext starts right after the consumed IV
+  char *data;
+  if ((data = stream_decrypt_to(&sess->d_ctx, buf->base,
+          (int *)&nread)) == NULL) {
     LOG_E("cipher_secret is incorrect");
     close_session(sess);
     return;
   }
+  if (nread == 0) {
+    // an AEAD record is still incomplete, keep reading
+    client_tcp_read_start(handle);
+    return;
+  }
+
+  uv_buf_t plain = uv_buf_init(data, nread);
 
   if (sess->state == S5_REQUEST) {
-    handle_socks5_request(handle, nread, buf, sess);
+    handle_socks5_request(handle, nread, &plain, sess);
 
   } else {
-    if (sess->state == S5_STREAMING) { 
-      ((uv_buf_t *)buf)->len = nread;
-      upstream_tcp_write_start((uv_stream_t *)((TCPSession *)sess)->upstream_tcp, 
-          buf);
-
-    } else {
-      // unreachable code
-      LOG_W("unepxected state: %d", sess->state);
-      close_session(sess);
-    }
+    // unreachable code
+    LOG_W("unepxected state: %d", sess->state);
+    close_session(sess);
   }
 }
 
@@ -464,39 +841,59 @@ void handle_socks5_request(uv_stream_t *handle, ssize_t nread,
     const uv_buf_t *buf, Session *sess) {
   Socks5Ctx *s5_ctx = &sess->s5_ctx;
 
-  S5Err s5_err = socks5_parse_request(s5_ctx, buf->base, nread); 
+  S5Err s5_err = socks5_parse_request(s5_ctx, buf->base, nread);
   if (s5_err != S5_OK) {
     LOG_E("socks5_parse_request failed");
+    ++g_metrics.handshake_errors[s5_err];
     close_session(sess);
     return;
   }
 
-  // finished parsing the SOCKS request, now we know it is a 
+  // finished parsing the SOCKS request, now we know it is a
   // CONNECT or UDP ASSOCIATE request
-  sess->type = (s5_ctx->cmd == S5_CMD_UDP_ASSOCIATE ? 
-      SESSION_TYPE_UDP : SESSION_TYPE_TCP); 
+  sess->type = (s5_ctx->cmd == S5_CMD_UDP_ASSOCIATE ?
+      SESSION_TYPE_UDP : SESSION_TYPE_TCP);
 
   if (sess->type == SESSION_TYPE_UDP) {
-    LOG_V("received a UDP request");
+    ++g_metrics.sessions_total_udp;
+  } else {
+    ++g_metrics.sessions_total_tcp;
+  }
+
+  // the first encrypted chunk may carry payload glued right behind the SOCKS
+  // request when the kernel coalesced the two writes from lightning_local;
+  // stash the remainder and replay it once the upstream is connected
+  if (sess->type == SESSION_TYPE_TCP) {
+    int req_len = 4 + 2;
+    if (s5_ctx->atyp == S5_ATYP_IPV4) {
+      req_len += 4;
+    } else if (s5_ctx->atyp == S5_ATYP_IPV6) {
+      req_len += 16;
+    } else {
+      req_len += 1 + strlen((const char *)s5_ctx->dst_addr);
+    }
 
-    sess = lrealloc(sess, sizeof(UDPSession));
-    memset(((char *)sess)+sizeof(Session), 0, sizeof(UDPSession)-sizeof(Session));
-    // this is necessary, because after realloc memory for the sess object,
-    // its address may be changed and any other objects that reference it 
-    // should do the re-assignment
-    handle->data = sess;  
+    if (nread > req_len) {
+      sess->socks5_req_data_len = nread - req_len;
+      sess->socks5_req_data = lmalloc(sess->socks5_req_data_len);
+      memcpy(sess->socks5_req_data, buf->base + req_len,
+          sess->socks5_req_data_len);
+    }
+  }
 
+  if (sess->type == SESSION_TYPE_UDP) {
+    LOG_V("received a UDP request");
     finish_socks5_udp_handshake(sess);
     return;
   }
 
-  // alright, it is a CONNECT request
-  sess = lrealloc(sess, sizeof(TCPSession));
-  memset(((char *)sess)+sizeof(Session), 0, sizeof(TCPSession)-sizeof(Session));
-  // this is necessary, because after realloc memory for the sess object,
-  // its address may be changed and any other objects that reference it 
-  // should do the re-assignment
-  handle->data = sess;
+  // alright, it is a CONNECT request; the pool block is already big enough,
+  // just clear the TCP extension fields (the pipes only need their
+  // bookkeeping reset, the slot buffers live in the pool)
+  memset(((char *)sess)+sizeof(Session), 0,
+      offsetof(TCPSession, to_upstream) - sizeof(Session));
+  STREAM_PIPE_CLEAR(&((TCPSession *)sess)->to_upstream);
+  STREAM_PIPE_CLEAR(&((TCPSession *)sess)->to_client);
 
   int err;
   if ((err = init_tcp_handle(sess, &((TCPSession *)sess)->upstream_tcp)) < 0) {
@@ -519,6 +916,28 @@ void handle_socks5_request(uv_stream_t *handle, ssize_t nread,
     }
 
   } else if (s5_ctx->atyp == S5_ATYP_DOMAIN) {
+    // a cache hit skips the threadpool round-trip through getaddrinfo
+    // entirely and connects right away
+    struct sockaddr_storage cached_addr;
+    DNSCacheResult cache_result = dns_cache_get((const char *)s5_ctx->dst_addr,
+        htons(s5_ctx->dst_port), &cached_addr, uv_now(g_loop));
+    if (cache_result == DNS_CACHE_NEGATIVE_HIT) {
+      LOG_V("negative DNS cache hit: %s", s5_ctx->dst_addr);
+      close_session(sess);
+      return;
+    }
+    if (cache_result == DNS_CACHE_HIT) {
+      ((TCPSession *)sess)->upstream_connect_req.data = (void *)(intptr_t)0;
+      if ((err = upstream_tcp_connect(
+              &((TCPSession *)sess)->upstream_connect_req,
+              (struct sockaddr *)&cached_addr)) != 0) {
+        LOG_W("upstream_tcp_connect failed on %s:%d, err: %s",
+            s5_ctx->dst_addr, s5_ctx->dst_port, uv_strerror(err));
+        close_session(sess);
+      }
+      return;
+    }
+
     struct addrinfo hint;
     memset(&hint, 0, sizeof(hint));
     hint.ai_family = AF_UNSPEC;
@@ -575,40 +994,99 @@ int upstream_tcp_read_start(uv_stream_t *handle) {
 
 void on_upstream_tcp_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
   TCPSession *sess = (TCPSession *)handle->data;
-  buf->base = sess->upstream_buf;
-  buf->len = sizeof(sess->upstream_buf) - MAX_IV_LEN;
+  PipeSlot *slot = pipe_slot_take(&sess->to_client);
+  if (slot == NULL) {
+    buf->base = NULL;
+    buf->len = 0;
+    return;
+  }
+  // leave room around the data so stream_encrypt_to can prepend the IV or
+  // frame an AEAD record without copying
+  buf->base = slot->buf + CRYPTO_HEADROOM;
+  buf->len = READ_TIER_SIZE(slot->tier);
+}
+
+void on_upstream_tcp_read_done(uv_stream_t *handle, ssize_t nread,
+    const uv_buf_t *buf) {
+  Session *sess = (Session *)handle->data;
+  int state = sess != NULL ? (int)sess->state : -1;
+  uint64_t start_ns = stall_prof_enter();
+  upstream_tcp_read_dispatch(handle, nread, buf);
+  stall_prof_leave(start_ns, STALL_SITE_UPSTREAM_READ, state);
 }
 
-void on_upstream_tcp_read_done(uv_stream_t *handle, ssize_t nread, 
+void upstream_tcp_read_dispatch(uv_stream_t *handle, ssize_t nread,
     const uv_buf_t *buf) {
   if (nread == 0) { // EAGAIN || EWOULDBLOCK
     return;
   }
 
-  Session *sess = (Session *)handle->data;
+  TCPSession *sess = (TCPSession *)handle->data;
   if (sess == NULL || sess->state == S5_CLOSING) {
     return;
   }
+  idle_wheel_touch(&sess->idle_node);
 
-  // stop reading so the buf can be reused and not overrun
-  uv_read_stop(handle);
+  if (nread == UV_ENOBUFS) {
+    // every pipe slot is in flight, pause until a write completes
+    sess->to_client.read_stopped = 1;
+    uv_read_stop(handle);
+    return;
+  }
 
   if (nread < 0 || sess->state == S5_STREAMING_END) {
     if (nread != UV_EOF) {
       LOG_E("upstream read failed: %s", uv_strerror(nread));
     }
-    close_session(sess);
+    uv_read_stop(handle);
+    if (sess->state != S5_STREAMING_END &&
+        (sess->to_upstream.inflight > 0 || sess->to_client.inflight > 0)) {
+      // let the queued writes drain before tearing the session down
+      sess->state = S5_STREAMING_END;
+      return;
+    }
+    if (sess->to_upstream.inflight > 0 || sess->to_client.inflight > 0) {
+      return;  // the last pipe write callback will close the session
+    }
+    close_session((Session *)sess);
+    return;
+  }
+
+  PipeSlot *slot = pipe_slot_from_base(&sess->to_client, buf->base);
+  // plaintext feeding an AEAD/framed cipher is cut into records of at
+  // most AEAD_MAX_RECORD, so those reads gain nothing beyond tier 0
+  pipe_read_observe(&sess->to_client, slot, nread,
+      sess->e_ctx.is_aead || cipher_framing() ? 0 : READ_TIER_MAX);
+
+  if (g_cli_cfg.crypto_offload) {
+    crypto_job_submit(sess, slot, buf->base, nread, 1);
     return;
   }
 
-  if (!stream_encrypt(&sess->e_ctx, buf->base, (int *)&nread, 1)) {
+  // ciphered in place, the IV (if any) lands in the headroom in front of
+  // the slot buffer
+  char *data;
+  if ((data = stream_encrypt_to(&sess->e_ctx, buf->base,
+          (int *)&nread)) == NULL) {
     LOG_E("cipher_secret incorrect");
-    close_session(sess);
+    close_session((Session *)sess);
     return;
   }
 
-  ((uv_buf_t *)buf)->len = nread;
-  client_tcp_write_start((uv_stream_t *)sess->client_tcp, buf);
+  if (stream_pipe_write((Session *)sess, &sess->to_client, slot,
+        (uv_stream_t *)sess->client_tcp, data, nread,
+        on_to_client_pipe_write_done) != 0) {
+    return;
+  }
+  if (sess->to_client.inflight >= g_pipe_high_wm) {
+    sess->to_client.read_stopped = 1;
+    uv_read_stop(handle);
+  }
+  if (rate_limit_charge(&sess->rate, sess, nread) &&
+      !sess->to_client.read_stopped) {
+    sess->to_client.read_stopped = 1;
+    uv_read_stop(handle);
+  }
 }
 
 int upstream_tcp_write_start(uv_stream_t *handle, const uv_buf_t *buf) {
@@ -632,478 +1110,696 @@ void on_upstream_tcp_write_done(uv_write_t *req, int status) {
   }
 }
 
-void upstream_tcp_connect_domain(uv_getaddrinfo_t* req, int status, 
-    struct addrinfo* res) {
-  TCPSession *sess = container_of(req, TCPSession, upstream_addrinfo_req);
-  if (status < 0) {
-    LOG_E("getaddrinfo(\"%s\"): %s", sess->s5_ctx.dst_addr, uv_strerror(status));
-    uv_freeaddrinfo(res);
-    close_session((Session *)sess);
-    return;
+PipeSlot *pipe_slot_take(StreamPipe *pipe) {
+  for (int i = 0; i < PIPE_DEPTH; ++i) {
+    if (!pipe->slots[i].busy) {
+      // a buffer left over from before a tier change goes back to its
+      // own pool so the slot can offer the current read size
+      if (pipe->slots[i].buf != NULL &&
+          pipe->slots[i].tier != pipe->read_tier) {
+        lpool_return(POOL_BUF_LARGE + pipe->slots[i].tier,
+            pipe->slots[i].buf);
+        pipe->slots[i].buf = NULL;
+      }
+      if (pipe->slots[i].buf == NULL) {
+        pipe->slots[i].buf = lpool_take(POOL_BUF_LARGE + pipe->read_tier,
+            PIPE_SLOT_BUFSIZ_TIER(pipe->read_tier));
+        pipe->slots[i].tier = pipe->read_tier;
+      }
+      return &pipe->slots[i];
+    }
   }
+  return NULL;
+}
 
-  char ipstr[INET6_ADDRSTRLEN];
-  struct sockaddr_storage addr;
-
-  int err;
-  for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
-    if (fill_ipaddr((struct sockaddr *)&addr, htons(sess->s5_ctx.dst_port), ipstr, 
-          sizeof(ipstr), ai) != 0) {
-      continue;
-    }
-    
-    int keep_session_alive = ai->ai_next != NULL;
-    sess->upstream_connect_req.data = (void *)(intptr_t)keep_session_alive;
-    if ((err = upstream_tcp_connect(&sess->upstream_connect_req, 
-            (struct sockaddr *)&addr)) != 0) {
-      LOG_W("upstream_tcp_connect failed on %s:%d, err: %s",
-          ipstr, sess->s5_ctx.dst_port, uv_strerror(err));
-      continue;
+// adjusts a direction's read tier from the sizes its reads actually come
+// back with: a buffer-filling bulk flow grows toward 64KB reads, a flow
+// gone quiescent shrinks back so interactive sessions neither pin big
+// buffers nor pay for latency. tier_cap pins the plaintext side of
+// AEAD/framed sessions to tier 0, whose read size already matches the
+// largest record the wire format carries
+void pipe_read_observe(StreamPipe *pipe, PipeSlot *slot, int nread,
+    int tier_cap) {
+  if (nread >= READ_TIER_SIZE(slot->tier)) {
+    pipe->lean_streak = 0;
+    if (pipe->read_tier < tier_cap &&
+        ++pipe->full_streak >= READ_TIER_PROMOTE_STREAK) {
+      ++pipe->read_tier;
+      pipe->full_streak = 0;
+      LOG_V("read tier up: %d", pipe->read_tier);
     }
-
-    LOG_I("connected to %s:%d", ipstr, sess->s5_ctx.dst_port);
-    uv_freeaddrinfo(res);
-
     return;
   }
-
-  uv_freeaddrinfo(res);
-  LOG_E("failed to connect to upstream");
-  close_session((Session *)sess);
+  pipe->full_streak = 0;
+  if (pipe->read_tier > 0 && nread * 4 <= READ_TIER_SIZE(pipe->read_tier) &&
+      ++pipe->lean_streak >= READ_TIER_DEMOTE_STREAK) {
+    --pipe->read_tier;
+    pipe->lean_streak = 0;
+    LOG_V("read tier down: %d", pipe->read_tier);
+  }
 }
 
-void upstream_tcp_connect_cb(uv_connect_t* req, int status) {
-  TCPSession *sess = container_of(req, TCPSession, upstream_connect_req);
-
-  upstream_tcp_connect_log((Session *)sess, status);
-  if (status < 0) {
-    int keep_session_alive = (intptr_t)req->data;
-    if (!keep_session_alive) {
-      close_session((Session *)sess);
+// maps a read buffer handed out by pipe_slot_take back to its slot
+PipeSlot *pipe_slot_from_base(StreamPipe *pipe, const char *base) {
+  for (int i = 0; i < PIPE_DEPTH; ++i) {
+    if (pipe->slots[i].buf != NULL &&
+        base == pipe->slots[i].buf + CRYPTO_HEADROOM) {
+      return &pipe->slots[i];
     }
-  } else {
-    // once connected, the connection enter streaming mode
-    sess->state = S5_STREAMING;
-    client_tcp_read_start((uv_stream_t *)sess->client_tcp);
-    upstream_tcp_read_start((uv_stream_t *)((TCPSession *)sess)->upstream_tcp);
   }
+  return NULL;
 }
 
-void finish_socks5_udp_handshake(Session *sess) {
-  struct sockaddr_storage addr;
+// queues one slot worth of data on dst without stopping the source read;
+// the read is only paused once the bytes in flight cross the high watermark
+int stream_pipe_write(Session *sess, StreamPipe *pipe, PipeSlot *slot,
+    uv_stream_t *dst, char *data, int len, uv_write_cb cb) {
+  slot->busy = 1;
+  slot->wire_len = len;
+  slot->write_req.data = sess;
+
+  uv_buf_t wbuf = uv_buf_init(data, len);
   int err;
+  if ((err = uv_write(&slot->write_req, dst, &wbuf, 1, cb)) != 0) {
+    LOG_E("uv_write failed: %s", uv_strerror(err));
+    slot->busy = 0;
+    close_session(sess);
+    return err;
+  }
+  pipe->inflight += len;
+  return 0;
+}
 
-  if (g_server_ctx->bound_ip_version == IPV4) {
-    struct sockaddr_in *addr4 = (struct sockaddr_in *)&addr;
-    addr4->sin_family = AF_INET;
-    memcpy(&addr4->sin_addr.s_addr, g_server_ctx->bound_ip, 4);
-    addr4->sin_port = 0;
-  } else {
-    struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
-    addr6->sin6_family = AF_INET6;
-    memcpy(((struct sockaddr_in6 *)&addr)->sin6_addr.s6_addr, 
-        g_server_ctx->bound_ip, 16);
-    addr6->sin6_port = 0;
+// common tail of the two pipe write callbacks: returns 1 when the session
+// was (or will be) closed and the caller should not resume reading
+static int stream_pipe_write_done(Session *sess, StreamPipe *pipe, 
+    uv_write_t *req, int status) {
+  PipeSlot *slot = container_of(req, PipeSlot, write_req);
+  slot->busy = 0;
+  pipe->inflight -= slot->wire_len;
+  lpool_return(POOL_BUF_LARGE + slot->tier, slot->buf);
+  slot->buf = NULL;
+
+  if (sess->state == S5_CLOSING) {
+    return 1;
+  }
+  if (status < 0) {
+    LOG_V("status=%d, now will close session", status);
+    close_session(sess);
+    return 1;
   }
+  if (sess->state == S5_STREAMING_END) {
+    // one end hit EOF earlier; close once both directions have drained
+    if (((TCPSession *)sess)->to_upstream.inflight == 0 &&
+        ((TCPSession *)sess)->to_client.inflight == 0) {
+      close_session(sess);
+    }
+    return 1;
+  }
+  return 0;
+}
 
-  UDPSession *udp_sess = (UDPSession *)sess;
-  if (init_udp_handle(sess, &udp_sess->upstream_udp) < 0) {
+// compressed records can inflate one wire read into more plaintext than
+// its slot carries; the surplus stays buffered in the decrypt context and
+// is written out here, both right after the read and again as slots free
+// up. Returns 1 when the session got closed underneath.
+int flush_decrypt_backlog(TCPSession *sess) {
+  while (cipher_pending(&((Session *)sess)->d_ctx) &&
+      sess->to_upstream.inflight < g_pipe_high_wm) {
+    PipeSlot *slot = pipe_slot_take(&sess->to_upstream);
+    if (slot == NULL) {
+      return 0;
+    }
+    int len = 0;
+    char *data = stream_decrypt_drain(&((Session *)sess)->d_ctx, &len);
+    if (data == NULL) {
+      close_session((Session *)sess);
+      return 1;
+    }
+    if (len == 0) {
+      return 0;
+    }
+    memcpy(slot->buf + CRYPTO_HEADROOM, data, len);
+    if (stream_pipe_write((Session *)sess, &sess->to_upstream, slot,
+          (uv_stream_t *)sess->upstream_tcp, slot->buf + CRYPTO_HEADROOM,
+          len, on_to_upstream_pipe_write_done) != 0) {
+      return 1;
+    }
+    rate_limit_charge(&sess->rate, sess, len);
+  }
+  return 0;
+}
+
+void on_to_upstream_pipe_write_done(uv_write_t *req, int status) {
+  Session *sess = (Session *)req->data;
+  StreamPipe *pipe = &((TCPSession *)sess)->to_upstream;
+  if (stream_pipe_write_done(sess, pipe, req, status)) {
     return;
   }
-  if (init_udp_handle(sess, &udp_sess->client_udp_recv) < 0) {
+  if (((TCPSession *)sess)->crypto_to_upstream.busy) {
+    // a decrypt job owns d_ctx on a threadpool thread right now; its
+    // completion callback drains the backlog and resumes the read
     return;
   }
-  uv_udp_bind(udp_sess->client_udp_recv, (struct sockaddr *)&addr, 
-      UV_UDP_REUSEADDR);
-
-  init_client_udp_send_if_needed(udp_sess);
-
-  // get the bound port and send it to the client, so the client
-  // can send us UDP packets on this port
-  if ((err = uv_udp_getsockname(udp_sess->client_udp_recv, 
-          (struct sockaddr *)&addr, (int []){ sizeof(addr) })) < 0) {
-    LOG_W("uv_udp_getsockname failed: %s", uv_strerror(err));
-    close_session(sess);
+  if (flush_decrypt_backlog((TCPSession *)sess)) {
     return;
   }
-
-  uv_udp_recv_start(udp_sess->client_udp_recv, on_client_udp_alloc, 
-      on_client_udp_recv_done);
+  if (pipe->read_stopped && pipe->inflight <= g_pipe_low_wm &&
+      !cipher_pending(&sess->d_ctx) &&
+      !rate_limit_throttled(&((TCPSession *)sess)->rate)) {
+    pipe->read_stopped = 0;
+    client_tcp_read_start((uv_stream_t *)sess->client_tcp);
+  }
 }
 
-void init_client_udp_send_if_needed(UDPSession *sess) {
-  Socks5Ctx *s5_ctx = &sess->s5_ctx;
-  if (s5_ctx->dst_port == 0) {
+void on_to_client_pipe_write_done(uv_write_t *req, int status) {
+  Session *sess = (Session *)req->data;
+  StreamPipe *pipe = &((TCPSession *)sess)->to_client;
+  if (stream_pipe_write_done(sess, pipe, req, status)) {
     return;
   }
+  if (pipe->read_stopped && pipe->inflight <= g_pipe_low_wm &&
+      !rate_limit_throttled(&((TCPSession *)sess)->rate)) {
+    pipe->read_stopped = 0;
+    upstream_tcp_read_start((uv_stream_t *)((TCPSession *)sess)->upstream_tcp);
+  }
+}
 
-  if (s5_ctx->atyp == S5_ATYP_DOMAIN) {
-    struct addrinfo hint;
-    memset(&hint, 0, sizeof(hint));
-    hint.ai_family = AF_UNSPEC;
-    hint.ai_socktype = SOCK_DGRAM;
-    hint.ai_protocol = IPPROTO_UDP;
+// Crypto offload (-x): instead of running EVP_CipherUpdate inline in the
+// read callback, streaming-phase buffers are handed to the libuv
+// threadpool and come back here for the pipe write, overlapping cipher
+// CPU with the loop's I/O. The source read stays paused while a job is
+// in flight: the cipher contexts chain state across calls, so each
+// direction is strictly sequential anyway.
+void crypto_job_submit(TCPSession *sess, PipeSlot *slot, char *data,
+    int len, int encrypt) {
+  CryptoJob *job = encrypt ? &sess->crypto_to_client
+                           : &sess->crypto_to_upstream;
+  job->work.data = job;
+  job->sess = sess;
+  job->slot = slot;
+  job->data = data;
+  job->len = len;
+  job->encrypt = encrypt;
+  job->busy = 1;
+  uv_read_stop(encrypt ? (uv_stream_t *)sess->upstream_tcp
+                       : (uv_stream_t *)sess->client_tcp);
+  CHECK(uv_queue_work(g_loop, &job->work, crypto_work_cb,
+        crypto_after_cb) == 0);
+}
 
-    int err;
-    if ((err = uv_getaddrinfo(g_loop, 
-            &((UDPSession *)sess)->client_udp_addrinfo_req, 
-            client_udp_send_domain_resolved,
-            (const char *)s5_ctx->dst_addr, 
-            NULL, 
-            &hint)) < 0) {
+void crypto_work_cb(uv_work_t *w) {
+  // threadpool threads carry their own metrics block; register it once
+  // so the ciphered byte counts still reach the dump
+  static __thread int registered;
+  if (!registered) {
+    registered = 1;
+    metrics_worker_register();
+  }
 
-      LOG_E("uv_getaddrinfo failed: %s, err: %s", 
-          s5_ctx->dst_addr, uv_strerror(err));
-    }
+  CryptoJob *job = w->data;
+  Session *sess = (Session *)job->sess;
+  if (job->encrypt) {
+    job->data = stream_encrypt_to(&sess->e_ctx, job->data, &job->len);
     return;
-  } 
+  }
+  job->data = stream_decrypt_to(&sess->d_ctx, job->data, &job->len);
+  if (job->data != NULL && job->len > 0 &&
+      (sess->d_ctx.is_aead || cipher_framing())) {
+    // the staging buffer belongs to this threadpool thread, move the
+    // plaintext into the slot before another job can clobber it
+    memcpy(job->slot->buf + CRYPTO_HEADROOM, job->data, job->len);
+    job->data = job->slot->buf + CRYPTO_HEADROOM;
+  }
+}
 
-  if (s5_ctx->atyp == S5_ATYP_IPV4) {
-    if (is_ipv4_addr_any((const char *)s5_ctx->dst_addr)) {
-      return;
-    }
-#ifdef IGNORE_LOCAL_UDP_RELAY
-    if (is_ipv4_addr_local((const char *)s5_ctx->dst_addr)) {
-      return;
+// back on the loop thread: queue the pipe write the read callback would
+// have queued inline, then resume the paused read unless the watermark,
+// the rate limiter or a pending close says otherwise
+void crypto_after_cb(uv_work_t *w, int status) {
+  CryptoJob *job = w->data;
+  TCPSession *sess = (TCPSession *)job->sess;
+  job->busy = 0;
+
+  if (sess->crypto_close_pending) {
+    if (!sess->crypto_to_upstream.busy && !sess->crypto_to_client.busy) {
+      sess->crypto_close_pending = 0;
+      close_session((Session *)sess);
     }
-#endif
+    return;
+  }
 
-  } else if (s5_ctx->atyp == S5_ATYP_IPV6) {
-    if (is_ipv6_addr_any((const char *)s5_ctx->dst_addr)) {
+  if (job->data == NULL) {
+    LOG_E("cipher_secret incorrect");
+    close_session((Session *)sess);
+    return;
+  }
+
+  if (job->encrypt) {  // upstream -> client
+    if (stream_pipe_write((Session *)sess, &sess->to_client, job->slot,
+          (uv_stream_t *)sess->client_tcp, job->data, job->len,
+          on_to_client_pipe_write_done) != 0) {
       return;
     }
-#ifdef IGNORE_LOCAL_UDP_RELAY
-    if (is_ipv6_addr_local((const char *)s5_ctx->dst_addr))) {
-      return;
+    // the charge must land even when the watermark already pauses the read
+    int throttled = rate_limit_charge(&sess->rate, sess, job->len);
+    if (sess->to_client.inflight >= g_pipe_high_wm || throttled) {
+      sess->to_client.read_stopped = 1;
+    } else if (sess->state == S5_STREAMING) {
+      upstream_tcp_read_start((uv_stream_t *)sess->upstream_tcp);
     }
-#endif
-  } else 
+    return;
+  }
 
-  init_udp_handle((Session *)sess, &sess->client_udp_send);
+  // client -> upstream
+  if (job->len == 0) {
+    // an AEAD record is still incomplete, keep reading
+    if (sess->state == S5_STREAMING) {
+      client_tcp_read_start((uv_stream_t *)sess->client_tcp);
+    }
+    return;
+  }
+  if (stream_pipe_write((Session *)sess, &sess->to_upstream, job->slot,
+        (uv_stream_t *)sess->upstream_tcp, job->data, job->len,
+        on_to_upstream_pipe_write_done) != 0) {
+    return;
+  }
+  if (flush_decrypt_backlog(sess)) {
+    return;
+  }
+  // the charge must land even when the watermark already pauses the read
+  int throttled = rate_limit_charge(&sess->rate, sess, job->len);
+  if (sess->to_upstream.inflight >= g_pipe_high_wm ||
+      cipher_pending(&((Session *)sess)->d_ctx) || throttled) {
+    sess->to_upstream.read_stopped = 1;
+  } else if (sess->state == S5_STREAMING) {
+    client_tcp_read_start((uv_stream_t *)sess->client_tcp);
+  }
 }
 
-void upstream_tcp_connect_log(Session *sess, int status) {
-  if (sess->s5_ctx.atyp == S5_ATYP_IPV4) {
-    char ipstr[INET_ADDRSTRLEN];
-    uv_inet_ntop(AF_INET, sess->s5_ctx.dst_addr, ipstr, INET_ADDRSTRLEN);
-    LOG_I("uv_tcp_connect: %s:%d, status: %s", 
-        ipstr, sess->s5_ctx.dst_port, 
-        status ? uv_strerror(status) : "CONNECTED");
-
-  } else if (sess->s5_ctx.atyp == S5_ATYP_IPV6) {
-    char ipstr[INET6_ADDRSTRLEN];
-    uv_inet_ntop(AF_INET6, sess->s5_ctx.dst_addr, ipstr, INET6_ADDRSTRLEN);
-    LOG_I("uv_tcp_connect: %s:%d, status: %s", 
-        ipstr, sess->s5_ctx.dst_port, 
-        status ? uv_strerror(status) : "CONNECTED");
-
-  } else {
-    LOG_I("uv_tcp_connect: %s:%d, status: %s", 
-        sess->s5_ctx.dst_addr, sess->s5_ctx.dst_port, 
-        status ? uv_strerror(status) : "CONNECTED");
+// the refill timer granted this session tokens again; resume whichever
+// directions only the rate limiter had paused, the watermark check keeps
+// backpressured ones stopped
+void rate_limit_resume_session(void *arg) {
+  TCPSession *sess = (TCPSession *)arg;
+  if (sess->state != S5_STREAMING) {
+    return;
+  }
+  if (flush_decrypt_backlog(sess)) {
+    return;
+  }
+  if (sess->to_upstream.read_stopped &&
+      sess->to_upstream.inflight <= g_pipe_low_wm &&
+      !cipher_pending(&((Session *)sess)->d_ctx)) {
+    sess->to_upstream.read_stopped = 0;
+    client_tcp_read_start((uv_stream_t *)sess->client_tcp);
+  }
+  if (sess->to_client.read_stopped &&
+      sess->to_client.inflight <= g_pipe_low_wm) {
+    sess->to_client.read_stopped = 0;
+    upstream_tcp_read_start((uv_stream_t *)sess->upstream_tcp);
   }
-
 }
 
-int upstream_tcp_connect(uv_connect_t *req, struct sockaddr *addr) {
-  TCPSession *sess = container_of(req, TCPSession, upstream_connect_req);
 
-  int err;
-  if ((err = uv_tcp_connect(req, sess->upstream_tcp, (struct sockaddr *)addr, 
-          upstream_tcp_connect_cb)) != 0) {
-    LOG_W("uv_tcp_connect failed: %s", uv_strerror(err));
+// Happy Eyeballs (RFC 8305): when a hostname resolves to both address
+// families, race two connects instead of walking the list sequentially.
+// The preferred family (IPv6) starts first, the other follows after a
+// short stagger, the first success wins and the loser is torn down. The
+// winning address is pinned in the DNS cache, so until the entry expires
+// subsequent connects go straight to the known-good family.
+#define HE_STAGGER_MS 250
+
+typedef struct HEAttempt {
+  uv_connect_t req;
+  uv_tcp_t *tcp;
+  struct sockaddr_storage addr;
+  int started;
+  int done;
+  int closing;
+  struct HERace *race;
+} HEAttempt;
+
+typedef struct HERace {
+  TCPSession *sess;       // NULL once the race detached from the session
+  uv_timer_t timer;       // stagger timer for the second attempt
+  int timer_closed;
+  HEAttempt at[2];        // [0] is the preferred family and starts first
+  int winner;             // index of the winning attempt, -1 while racing
+  int refs;               // open handles keeping this allocation alive
+} HERace;
+
+static void he_attempt_start(HERace *race, int i);
+static void he_attempt_failed(HERace *race, int i, int status);
+static void he_connect_cb(uv_connect_t *req, int status);
+
+static void he_race_unref(HERace *race) {
+  if (--race->refs == 0) {
+    free(race);
   }
-  return err;
 }
 
-void on_client_udp_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
-  UDPSession *sess = (UDPSession *)handle->data;
-  buf->base = sess->clinet_udp_recv_buf;
-  // reserve some space for encrypted version of the data
-  buf->len = sizeof(sess->clinet_udp_recv_buf);
+static void he_tcp_close_cb(uv_handle_t *handle) {
+  HERace *race = ((HEAttempt *)handle->data)->race;
+  lpool_return(POOL_UV_TCP, handle);
+  he_race_unref(race);
 }
 
-void on_client_udp_recv_done(uv_udp_t *handle, ssize_t nread, 
-    const uv_buf_t* buf, const struct sockaddr* addr, unsigned flags) {
-  if (nread < 0) {
-    if (nread != UV_EOF) {
-      LOG_E("client udp packet failed: %s", uv_strerror(nread));
-    }
-    return;
-  }
+static void he_timer_close_cb(uv_handle_t *handle) {
+  he_race_unref(container_of((uv_timer_t *)handle, HERace, timer));
+}
 
-  if (nread == 0 && addr == NULL) {
+// closes the stagger timer; the race is freed once the timer and every
+// race-owned tcp handle have finished closing
+static void he_race_finish(HERace *race) {
+  if (race->timer_closed) {
     return;
   }
+  race->timer_closed = 1;
+  uv_timer_stop(&race->timer);
+  uv_close((uv_handle_t *)&race->timer, he_timer_close_cb);
+}
 
-  LOG_V("received udp packet: %lu", nread);
-  UDPSession *sess = (UDPSession *)handle->data;
-  int err;
-  if ((err = socks5_parse_udp_request(&sess->s5_ctx, buf->base, buf->len)) != S5_OK) {
-      LOG_E("socks5_parse_udp_request failed, ignored the dgram, err: %d", err);
-      return;
+static void he_attempt_close(HEAttempt *at) {
+  if (at->tcp != NULL && !at->closing) {
+    at->closing = 1;
+    uv_close((uv_handle_t *)at->tcp, he_tcp_close_cb);
   }
+}
 
-  uv_udp_recv_stop(handle);
+// detaches the race from a session that is going away; in-flight connects
+// are cancelled and the race frees itself once they resolve
+void he_race_abort(HERace *race) {
+  race->sess = NULL;
+  race->winner = 0;  // nobody can win anymore
+  he_attempt_close(&race->at[0]);
+  he_attempt_close(&race->at[1]);
+  he_race_finish(race);
+}
 
-  ((uv_buf_t *)buf)->len = nread;
+static void he_stagger_cb(uv_timer_t *timer) {
+  HERace *race = container_of(timer, HERace, timer);
+  if (race->sess != NULL && race->winner < 0 && !race->at[1].started) {
+    he_attempt_start(race, 1);
+  }
+}
 
-  Socks5Ctx *s5_ctx = &sess->s5_ctx;
-  if (s5_ctx->atyp == S5_ATYP_IPV4) {
-    struct sockaddr_in addr4;
-    addr4.sin_family = AF_INET;
-    addr4.sin_port = htons(s5_ctx->dst_port);
-    memcpy(&addr4.sin_addr.s_addr, s5_ctx->dst_addr, 4);
+static void he_race_win(HERace *race, int i) {
+  HEAttempt *at = &race->at[i];
+  TCPSession *sess = race->sess;
 
-    err = uv_udp_send(&sess->upstream_udp_send_req, sess->upstream_udp, 
-        buf, 1, (struct sockaddr *)&addr4, on_upstream_udp_send_done);
-    if (err < 0) {
-      LOG_E("uv_udp_send failed: %s", uv_strerror(err));
-      log_ipv6_and_port(s5_ctx->dst_addr, s5_ctx->dst_port, 
-          "uv_udp_send failed");
-      client_udp_recv_start(sess);
-    }
+  race->winner = i;
+  he_attempt_close(&race->at[1 - i]);
 
-  } else if (s5_ctx->atyp == S5_ATYP_DOMAIN) {
-    struct addrinfo hint;
-    memset(&hint, 0, sizeof(hint));
-    hint.ai_family = AF_UNSPEC;
-    hint.ai_socktype = SOCK_DGRAM;
-    hint.ai_protocol = IPPROTO_UDP;
+  // hand the winning handle over to the session; the race gives up its
+  // reference without closing it
+  at->tcp->data = sess;
+  sess->upstream_tcp = at->tcp;
+  at->tcp = NULL;
+  --race->refs;
 
-    ((UDPSession *)sess)->upstream_udp_addrinfo_req.data = (void *)buf;
+  // remember the family that actually worked for this destination
+  dns_cache_put_addr((const char *)sess->s5_ctx.dst_addr,
+      (const struct sockaddr *)&at->addr, uv_now(g_loop));
 
-    LOG_V("now will send udp packet to: %s", (const char *)s5_ctx->dst_addr);
-    int err;
-    if ((err = uv_getaddrinfo(g_loop, 
-            &((UDPSession *)sess)->upstream_udp_addrinfo_req, 
-            upstream_udp_send,
-            (const char *)s5_ctx->dst_addr, 
-            NULL, 
-            &hint)) < 0) {
+  sess->he_race = NULL;
+  race->sess = NULL;
+  he_race_finish(race);
 
-      LOG_E("uv_getaddrinfo failed: %s, err: %s", 
-          s5_ctx->dst_addr, uv_strerror(err));
-      client_udp_recv_start(sess);
-    }
+  upstream_tcp_connect_log((Session *)sess, 0);
+  upstream_connected(sess);
+}
 
-  } else if (s5_ctx->atyp == S5_ATYP_IPV6) {
-    struct sockaddr_in6 addr6;
-    addr6.sin6_family = AF_INET6;
-    addr6.sin6_port = htons(s5_ctx->dst_port);
-    memcpy(addr6.sin6_addr.s6_addr, s5_ctx->dst_addr, 16);
+void he_attempt_failed(HERace *race, int i, int status) {
+  HEAttempt *other = &race->at[1 - i];
+  if (other->started && other->done) {
+    // both families failed, the session is out of options
+    TCPSession *sess = race->sess;
+    ++g_metrics.connect_failures;
+    sess->he_race = NULL;
+    race->sess = NULL;
+    he_race_finish(race);
+    upstream_tcp_connect_log((Session *)sess, status);
+    close_session((Session *)sess);
+  } else if (!other->started) {
+    // don't sit out the rest of the stagger, start the fallback now
+    uv_timer_stop(&race->timer);
+    he_attempt_start(race, 1 - i);
+  }
+  // else: the other attempt is still in flight and may win
+}
 
-    err = uv_udp_send(&sess->upstream_udp_send_req, sess->upstream_udp, 
-        buf, 1, (struct sockaddr *)&addr6, on_upstream_udp_send_done);
-    if (err < 0) {
-      LOG_E("uv_udp_send failed: %s", uv_strerror(err));
-      log_ipv6_and_port(s5_ctx->dst_addr, s5_ctx->dst_port, 
-          "uv_udp_send failed");
+void he_connect_cb(uv_connect_t *req, int status) {
+  HEAttempt *at = container_of(req, HEAttempt, req);
+  HERace *race = at->race;
+  at->done = 1;
 
-      client_udp_recv_start(sess);
-    }
+  if (race->sess != NULL && race->winner < 0 && status == 0) {
+    he_race_win(race, (int)(at - race->at));
+    return;
+  }
 
-  } else {
-    LOG_E("unknown ATYP: %d", s5_ctx->atyp);
-    client_udp_recv_start(sess);
+  he_attempt_close(at);
+  if (race->sess != NULL && race->winner < 0) {
+    he_attempt_failed(race, (int)(at - race->at), status);
   }
 }
 
-void on_upstream_udp_send_done(uv_udp_send_t* req, int status) {
-  LOG_I("udp package sent: %s", status == 0 ? "SUCCEEDED" : uv_strerror(status));
-  UDPSession *sess = container_of(req, UDPSession, upstream_udp_send_req);
-  client_udp_recv_start(sess);
-}
+void he_attempt_start(HERace *race, int i) {
+  HEAttempt *at = &race->at[i];
+  at->started = 1;
 
-int client_udp_recv_start(UDPSession *sess) {
-  int err = uv_udp_recv_start(sess->client_udp_recv, on_client_udp_alloc, 
-      on_client_udp_recv_done);
-  if (err < 0) {
-    LOG_E("uv_udp_recv_start failed: %s", uv_strerror(err));
-    return err;
-  }
-  // if client_udp_send is bound, then we should start listening for UDP packets 
-  // sent from the upstream_udp port which we initially relayed the packets to.
-  if (sess->client_udp_send != NULL) {
-    LOG_I("now will listen for UDP packets from remote");
-    err = uv_udp_recv_start(sess->upstream_udp, on_upstream_udp_alloc, 
-        on_upstream_udp_recv_done);
-    if (err < 0) {
-      LOG_E("uv_udp_recv_start failed: %s", uv_strerror(err));
+  int err;
+  if (at->tcp == NULL) {
+    at->tcp = lpool_take(POOL_UV_TCP, sizeof(uv_tcp_t));
+    at->tcp->data = at;
+    ++race->refs;
+    if ((err = uv_tcp_init(g_loop, at->tcp)) != 0 ||
+        (err = uv_tcp_keepalive(at->tcp, 1, KEEPALIVE)) != 0) {
+      LOG_E("uv_tcp_init failed: %s", uv_strerror(err));
+      at->done = 1;
+      he_attempt_close(at);
+      he_attempt_failed(race, i, err);
+      return;
     }
   }
-  return err;
+
+  if ((err = uv_tcp_connect(&at->req, at->tcp,
+          (struct sockaddr *)&at->addr, he_connect_cb)) != 0) {
+    LOG_W("uv_tcp_connect failed: %s", uv_strerror(err));
+    at->done = 1;
+    he_attempt_close(at);
+    he_attempt_failed(race, i, err);
+  }
 }
 
-void upstream_udp_send(uv_getaddrinfo_t* req, int status, struct addrinfo* res) {
-  UDPSession *sess = container_of(req, UDPSession, upstream_udp_addrinfo_req);
+// addr0 is the preferred family and connects immediately, addr1 joins
+// after HE_STAGGER_MS; returns non-zero if the race could not even start
+int he_race_start(TCPSession *sess, const struct sockaddr *addr0,
+    const struct sockaddr *addr1) {
+  HERace *race = lmalloc(sizeof(HERace));
+  memset(race, 0, sizeof(HERace));
+  race->winner = -1;
+  race->at[0].race = race;
+  race->at[1].race = race;
+  memcpy(&race->at[0].addr, addr0,
+      addr0->sa_family == AF_INET ? sizeof(struct sockaddr_in)
+                                  : sizeof(struct sockaddr_in6));
+  memcpy(&race->at[1].addr, addr1,
+      addr1->sa_family == AF_INET ? sizeof(struct sockaddr_in)
+                                  : sizeof(struct sockaddr_in6));
+
+  // the race carries its own upstream handles, the one the session
+  // pre-allocated goes back once it is ours to close; init_tcp_handle only
+  // initialized it, it has no socket yet
+  if (sess->upstream_tcp != NULL) {
+    sess->upstream_tcp->data = &race->at[0];
+    ++race->refs;
+    uv_close((uv_handle_t *)sess->upstream_tcp, he_tcp_close_cb);
+    sess->upstream_tcp = NULL;
+  }
+
+  race->sess = sess;
+  sess->he_race = race;
+  sess->upstream_connect_ts = uv_hrtime();
+
+  ++race->refs;  // the stagger timer
+  uv_timer_init(g_loop, &race->timer);
+  uv_timer_start(&race->timer, he_stagger_cb, HE_STAGGER_MS, 0);
+
+  he_attempt_start(race, 0);
+  return 0;
+}
+
+void upstream_tcp_connect_domain(uv_getaddrinfo_t* req, int status, 
+    struct addrinfo* res) {
+  TCPSession *sess = container_of(req, TCPSession, upstream_addrinfo_req);
   if (status < 0) {
     LOG_E("getaddrinfo(\"%s\"): %s", sess->s5_ctx.dst_addr, uv_strerror(status));
+    dns_cache_put((const char *)sess->s5_ctx.dst_addr, NULL, uv_now(g_loop));
     uv_freeaddrinfo(res);
-    client_udp_recv_start(sess);
+    close_session((Session *)sess);
     return;
   }
 
+  dns_cache_put((const char *)sess->s5_ctx.dst_addr, res, uv_now(g_loop));
+
   char ipstr[INET6_ADDRSTRLEN];
   struct sockaddr_storage addr;
 
-  int err = -1;
+  // first usable address of each family; with both present the connects
+  // race Happy Eyeballs style instead of walking the list one by one
+  struct sockaddr_storage addr6, addr4;
+  int have6 = 0, have4 = 0;
   for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
-    if (fill_ipaddr((struct sockaddr *)&addr, htons(sess->s5_ctx.dst_port), 
-          ipstr, sizeof(ipstr), ai) != 0) {
-      continue;
+    if (ai->ai_family == AF_INET6 && !have6) {
+      have6 = fill_ipaddr((struct sockaddr *)&addr6,
+          htons(sess->s5_ctx.dst_port), ipstr, sizeof(ipstr), ai) == 0;
+    } else if (ai->ai_family == AF_INET && !have4) {
+      have4 = fill_ipaddr((struct sockaddr *)&addr4,
+          htons(sess->s5_ctx.dst_port), ipstr, sizeof(ipstr), ai) == 0;
     }
+  }
+  if (have6 && have4) {
+    uv_freeaddrinfo(res);
+    he_race_start(sess, (struct sockaddr *)&addr6, (struct sockaddr *)&addr4);
+    return;
+  }
 
-    err = uv_udp_send(&sess->upstream_udp_send_req, sess->upstream_udp, 
-        (uv_buf_t *)req->data, 1, (struct sockaddr *)&addr,
-        on_upstream_udp_send_done);
-
-    if (err < 0) {
-      LOG_E("uv_udp_send to %s:%d failed: %s", ipstr, sess->s5_ctx.dst_port, 
-          uv_strerror(err));
+  int err;
+  for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+    if (fill_ipaddr((struct sockaddr *)&addr, htons(sess->s5_ctx.dst_port), ipstr, 
+          sizeof(ipstr), ai) != 0) {
       continue;
     }
+    
+    int keep_session_alive = ai->ai_next != NULL;
+    sess->upstream_connect_req.data = (void *)(intptr_t)keep_session_alive;
+    if ((err = upstream_tcp_connect(&sess->upstream_connect_req, 
+            (struct sockaddr *)&addr)) != 0) {
+      LOG_W("upstream_tcp_connect failed on %s:%d, err: %s",
+          ipstr, sess->s5_ctx.dst_port, uv_strerror(err));
+      continue;
+    }
+
+    LOG_I("connected to %s:%d", ipstr, sess->s5_ctx.dst_port);
+    uv_freeaddrinfo(res);
 
-    break;
+    return;
   }
 
   uv_freeaddrinfo(res);
-
-  if (err == -1) {
-    // if we havn't successfully sent out the packets, 
-    // on_upstream_udp_send_done will not be called, so we have to call the 
-    // following function right here
-    client_udp_recv_start(sess);
-  }
+  LOG_E("failed to connect to upstream");
+  close_session((Session *)sess);
 }
 
-void on_upstream_udp_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
-  UDPSession *sess = (UDPSession *)handle->data;
-  // 22 to encapsulate the header, see on_upstream_udp_recv_done
-  buf->base = sess->upstream_udp_buf + 22;
-  buf->len = sizeof(sess->upstream_udp_buf) - 22 - MAX_IV_LEN;; 
+void upstream_tcp_connect_cb(uv_connect_t* req, int status) {
+  TCPSession *sess = container_of(req, TCPSession, upstream_connect_req);
+  int state = (int)sess->state;
+  uint64_t start_ns = stall_prof_enter();
+  upstream_tcp_connect_dispatch(req, status);
+  stall_prof_leave(start_ns, STALL_SITE_CONNECT, state);
 }
 
-void on_upstream_udp_recv_done(uv_udp_t *handle, ssize_t nread, 
-    const uv_buf_t *buf, const struct sockaddr *addr, unsigned flags) {
-  if (nread < 0) {
-    if (nread != UV_EOF) {
-      LOG_E("upstream udp packet failed: %s", uv_strerror(nread));
-    }
-    return;
-  }
-
-  if (nread == 0 && addr == NULL) {
-    return;
-  }
+void upstream_tcp_connect_dispatch(uv_connect_t* req, int status) {
+  TCPSession *sess = container_of(req, TCPSession, upstream_connect_req);
 
-  UDPSession *sess = (UDPSession *)handle->data;
-  if (sess == NULL) {
-    return;
+  upstream_tcp_connect_log((Session *)sess, status);
+  if (status < 0) {
+    ++g_metrics.connect_failures;
+    int keep_session_alive = (intptr_t)req->data;
+    if (!keep_session_alive) {
+      close_session((Session *)sess);
+    }
+  } else {
+    upstream_connected(sess);
   }
+}
 
-  LOG_V("received udp packet: %lu", nread);
-
-  uv_udp_recv_stop(handle);
-
-  if (addr->sa_family == AF_INET) {
-    ((uv_buf_t *)buf)->base -= 10;
-    ((uv_buf_t *)buf)->len = nread + 10;
-    char *data = buf->base;
-    data[0] = 0; // RSV
-    data[1] = 0; // RSV
-    data[2] = 0; // FRAG
-    data[3] = 1; // IPv4
-    memcpy(&data[4], (char *)&((struct sockaddr_in *)addr)->sin_addr.s_addr, 4);
-    data[8] = (unsigned char)(((struct sockaddr_in *)addr)->sin_port >> 8);
-    data[9] = (unsigned char)(((struct sockaddr_in *)addr)->sin_port);
-  } else if (addr->sa_family == AF_INET6) {
-    ((uv_buf_t *)buf)->base -= 22;
-    ((uv_buf_t *)buf)->len = nread + 22;
-    char *data = buf->base;
-    data[0] = 0; // RSV
-    data[1] = 0; // RSV
-    data[2] = 0; // FRAG
-    data[3] = 4; // IPv6
-    memcpy(&data[4], ((struct sockaddr_in6 *)addr)->sin6_addr.s6_addr, 16);
-    data[20] = (unsigned char)(((struct sockaddr_in6 *)addr)->sin6_port >> 8);
-    data[21] = (unsigned char)(((struct sockaddr_in6 *)addr)->sin6_port);
+// common tail of a successful upstream connect, shared between the plain
+// connect callback and the Happy Eyeballs race
+void upstream_connected(TCPSession *sess) {
+  if (sess->upstream_connect_ts != 0) {
+    metrics_connect_observe(sess->upstream_connect_ts);
+    sess->upstream_connect_ts = 0;
+  }
+  // once connected, the connection enter streaming mode
+  sess->state = S5_STREAMING;
+  // the handshake buffer is done, streaming reads go through the slots
+  // (the glued payload, if any, was stashed in socks5_req_data)
+  if (sess->client_buf != NULL) {
+    lpool_return(POOL_BUF_SMALL, sess->client_buf);
+    sess->client_buf = NULL;
+  }
+  if (sess->socks5_req_data != NULL) {
+    // flush the payload that arrived glued to the SOCKS request; reading
+    // from the client resumes in on_upstream_tcp_write_done
+    uv_buf_t pending;
+    pending.base = sess->socks5_req_data;
+    pending.len = sess->socks5_req_data_len;
+    upstream_tcp_write_start((uv_stream_t *)sess->upstream_tcp, &pending);
   } else {
-    // unreachable code
-    LOG_W("unepxected sa_family: %d", addr->sa_family);
-    return;
+    client_tcp_read_start((uv_stream_t *)sess->client_tcp);
   }
+  upstream_tcp_read_start((uv_stream_t *)sess->upstream_tcp);
+}
 
-  Socks5Ctx *s5_ctx = &sess->s5_ctx;
-  struct sockaddr_storage c_addr;
+void finish_socks5_udp_handshake(Session *sess) {
+  struct sockaddr_storage addr;
+  int err;
 
-  if (s5_ctx->atyp == S5_ATYP_IPV4) {
-    struct sockaddr_in *addr4 = (struct sockaddr_in *)&c_addr;
-    copy_ipv4_addr(&addr4->sin_addr.s_addr, (char *)s5_ctx->dst_addr);
+  if (g_server_ctx->bound_ip_version == IPV4) {
+    struct sockaddr_in *addr4 = (struct sockaddr_in *)&addr;
     addr4->sin_family = AF_INET;
-    addr4->sin_port = s5_ctx->dst_port;;
-
-  } else if (s5_ctx->atyp == S5_ATYP_IPV6) {
-    struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&c_addr;
-    memcpy(addr6->sin6_addr.s6_addr, s5_ctx->dst_addr, 16);
-    addr6->sin6_family = AF_INET6;
-    addr6->sin6_port = s5_ctx->dst_port;;
-
+    memcpy(&addr4->sin_addr.s_addr, g_server_ctx->bound_ip, 4);
+    addr4->sin_port = 0;
   } else {
-    // unreachable code
-    LOG_W("unepxected atyp: %d", s5_ctx->atyp);
-    return;
+    struct sockaddr_in6 *addr6 = (struct sockaddr_in6 *)&addr;
+    addr6->sin6_family = AF_INET6;
+    memcpy(((struct sockaddr_in6 *)&addr)->sin6_addr.s6_addr, 
+        g_server_ctx->bound_ip, 16);
+    addr6->sin6_port = 0;
   }
 
-  int err = uv_udp_send(&sess->client_udp_send_req, sess->client_udp_send, 
-      buf, 1, (struct sockaddr *)&c_addr,
-      on_client_udp_send_done);
-
-  if (err < 0) {
-    LOG_E("uv_udp_send to %d failed: %s", s5_ctx->dst_port, uv_strerror(err));
+  // all associates on this worker share one relay socket
+  if ((err = udp_relay_start(g_loop, (struct sockaddr *)&addr, NULL)) != 0) {
+    close_session(sess);
+    return;
   }
 }
 
-void on_client_udp_send_done(uv_udp_send_t* req, int status) {
-  LOG_I("client_udp_send status: %s", status == 0 ? 
-      "SUCCEEDED" : uv_strerror(status));
-}
+void upstream_tcp_connect_log(Session *sess, int status) {
+  if (sess->s5_ctx.atyp == S5_ATYP_IPV4) {
+    char ipstr[INET_ADDRSTRLEN];
+    uv_inet_ntop(AF_INET, sess->s5_ctx.dst_addr, ipstr, INET_ADDRSTRLEN);
+    LOG_I("uv_tcp_connect: %s:%d, status: %s", 
+        ipstr, sess->s5_ctx.dst_port, 
+        status ? uv_strerror(status) : "CONNECTED");
 
-void client_udp_send_domain_resolved(uv_getaddrinfo_t* req, int status, 
-    struct addrinfo* res) {
-  UDPSession *sess = container_of(req, UDPSession, client_udp_addrinfo_req);
+  } else if (sess->s5_ctx.atyp == S5_ATYP_IPV6) {
+    char ipstr[INET6_ADDRSTRLEN];
+    uv_inet_ntop(AF_INET6, sess->s5_ctx.dst_addr, ipstr, INET6_ADDRSTRLEN);
+    LOG_I("uv_tcp_connect: %s:%d, status: %s", 
+        ipstr, sess->s5_ctx.dst_port, 
+        status ? uv_strerror(status) : "CONNECTED");
 
-  if (status < 0) {
-    LOG_E("getaddrinfo(\"%s\"): %s", sess->s5_ctx.dst_addr, uv_strerror(status));
-    uv_freeaddrinfo(res);
-    return;
+  } else {
+    LOG_I("uv_tcp_connect: %s:%d, status: %s", 
+        sess->s5_ctx.dst_addr, sess->s5_ctx.dst_port, 
+        status ? uv_strerror(status) : "CONNECTED");
   }
-  
-  for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
-    LOG_V("domain [%s] resolved", sess->s5_ctx.dst_addr);
-
-    if (ai->ai_family == AF_INET) {
-      struct sockaddr_in *sai = (struct sockaddr_in *)ai->ai_addr;
-      sess->s5_ctx.atyp = S5_ATYP_IPV4;
-      sess->s5_ctx.dst_addr[0] = (sai->sin_addr.s_addr >> 24) & 0xff;
-      sess->s5_ctx.dst_addr[1] = (sai->sin_addr.s_addr >> 16) & 0xff;
-      sess->s5_ctx.dst_addr[2] = (sai->sin_addr.s_addr >> 8) & 0xff;
-      sess->s5_ctx.dst_addr[3] = sai->sin_addr.s_addr & 0xff;
 
-    } else if (ai->ai_family == AF_INET6) {
-      struct sockaddr_in6 *sai6 = (struct sockaddr_in6 *)ai->ai_addr;
-      sess->s5_ctx.atyp = S5_ATYP_IPV6;
-      memcpy(sess->s5_ctx.dst_addr, sai6->sin6_addr.s6_addr, 16);
-    }
+}
 
-    if (init_udp_handle((Session *)sess, &sess->client_udp_send) < 0) {
-      continue;
-    }
+int upstream_tcp_connect(uv_connect_t *req, struct sockaddr *addr) {
+  TCPSession *sess = container_of(req, TCPSession, upstream_connect_req);
 
-    uv_freeaddrinfo(res);
-    return;
+  int err;
+  sess->upstream_connect_ts = uv_hrtime();
+  if ((err = uv_tcp_connect(req, sess->upstream_tcp, (struct sockaddr *)addr,
+          upstream_tcp_connect_cb)) != 0) {
+    LOG_W("uv_tcp_connect failed: %s", uv_strerror(err));
   }
-
-  close_session((Session *)sess);
-  uv_freeaddrinfo(res);
+  return err;
 }
+
@@ -5,6 +5,35 @@ static S5Err socks5_parse_addr_and_port(Socks5Ctx *socks5_ctx,
     const char *data, int size, int is_udp_req);
 
 S5Err socks5_parse_method_identification(Socks5Ctx *socks5_ctx, const char *data, int size) {
+  // fast path: in practice the whole greeting arrives in a single read,
+  // so validate and decode it with direct field reads instead of paying
+  // the switch-per-byte state machine below
+  if (size >= 2) {
+    if ((unsigned char)data[0] != SOCKS5_VERSION) {
+      LOG_E("bad version: %d", (unsigned char)data[0]);
+      return S5_BAD_VERSION;
+    }
+
+    int nmethods = (unsigned char)data[1];
+    if (size == 2 + nmethods) {
+      for (int m = 0; m < nmethods; ++m) {
+        switch ((unsigned char)data[2 + m]) {
+          case 0: socks5_ctx->methods |= S5_AUTH_NONE;   break;
+          case 1: socks5_ctx->methods |= S5_AUTH_GSSAPI; break;
+          case 2: socks5_ctx->methods |= S5_AUTH_PASSWD; break;
+          default: break;
+        }
+      }
+      socks5_ctx->state = S5_PARSE_STATE_FINISH;
+      return S5_OK;
+    }
+    if (size > 2 + nmethods) {
+      LOG_E("junk in handshake: %d - %d", 2 + nmethods, size);
+      return S5_JUNK_DATA_IN_HANDSHAKE;
+    }
+    // fragmented greeting, fall through to the incremental parser
+  }
+
   socks5_ctx->state = S5_PARSE_STATE_VERSION;
 
   int i = 0;
@@ -60,6 +89,56 @@ S5Err socks5_parse_method_identification(Socks5Ctx *socks5_ctx, const char *data
 }
 
 S5Err socks5_parse_request(Socks5Ctx *socks5_ctx, const char *data, int size) {
+  // fast path for a complete request in one buffer; the smallest one is
+  // VER+CMD+RSV+ATYP plus an IPv4 address and the port. Trailing bytes
+  // are payload the kernel coalesced with the request and are left for
+  // the caller, exactly like the state machine below behaves
+  if (size >= 4 + 4 + 2) {
+    unsigned char ver = data[0];
+    unsigned char cmd = data[1];
+    unsigned char atyp = data[3];
+
+    if (ver != SOCKS5_VERSION) {
+      LOG_E("bad version: %d", ver);
+      return S5_BAD_VERSION;
+    }
+    if (cmd != S5_CMD_CONNECT && cmd != S5_CMD_UDP_ASSOCIATE) {
+      LOG_E("unsupported cmd: %d", cmd);
+      return S5_UNSUPPORTED_CMD;
+    }
+
+    int addr_off = 4;
+    int addr_len;
+    if (atyp == S5_ATYP_IPV4) {
+      addr_len = 4;
+    } else if (atyp == S5_ATYP_DOMAIN) {
+      addr_off = 5;
+      addr_len = (unsigned char)data[4];
+    } else if (atyp == S5_ATYP_IPV6) {
+      addr_len = 16;
+    } else {
+      LOG_E("bad atyp: %d", atyp);
+      return S5_BAD_ATYP;
+    }
+
+    if (size >= addr_off + addr_len + 2) {
+      socks5_ctx->cmd = cmd;
+      socks5_ctx->atyp = atyp;
+      // addresses are at most 255 bytes, a plain loop beats the libc
+      // memcpy dispatch at these sizes
+      for (int a = 0; a < addr_len; ++a) {
+        socks5_ctx->dst_addr[a] = data[addr_off + a];
+      }
+      socks5_ctx->dst_addr[addr_len] = '\0';
+      socks5_ctx->dst_port =
+          ((unsigned char)data[addr_off + addr_len] << 8) |
+          (unsigned char)data[addr_off + addr_len + 1];
+      socks5_ctx->state = S5_PARSE_STATE_FINISH;
+      return S5_OK;
+    }
+    // fragmented request, fall through to the incremental parser
+  }
+
   socks5_ctx->state = S5_PARSE_STATE_REQ_VERSION;
 
   int i = 0;
@@ -169,11 +248,11 @@ S5Err socks5_parse_addr_and_port(Socks5Ctx *socks5_ctx,
         } else {
           socks5_ctx->dst_port |= c;
 
-          if (is_udp_req) {
-            return S5_OK;
-          }
-
+          // the request is complete, stop consuming here: anything left in
+          // the buffer is payload that got coalesced with the request by
+          // the kernel, the caller decides what to do with it
           socks5_ctx->state = S5_PARSE_STATE_FINISH;
+          return S5_OK;
         }
         break;
 
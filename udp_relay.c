@@ -0,0 +1,543 @@
+#include "udp_relay.h"
+#include <stdlib.h>
+#include <string.h>
+#if defined(__linux__)
+#include <sys/socket.h>
+#include <errno.h>
+#endif
+
+#include "log/log.h"
+#include "util.h"
+#include "alloc.h"
+#include "hashmap.h"
+#include "socks5.h"
+#include "dns_cache.h"
+
+// room for the longest SOCKS5 UDP header (RSV+FRAG+ATYP+IPv6+port)
+#define UDP_RELAY_HDR_MAX 22
+#define UDP_FLOW_KEY_LEN 64
+// flows reclaimed per sweep tick; anything left over goes next tick
+#define UDP_SWEEP_BATCH 256
+
+typedef struct {
+  uv_udp_t upstream;  // one socket towards the target per flow
+  struct sockaddr_storage client_addr;
+  uint64_t last_active;
+} UDPFlow;
+
+// a datagram in flight, freed when the send completes
+typedef struct {
+  uv_udp_send_t req;
+  char data[UDP_RELAY_BUFSIZ + UDP_RELAY_HDR_MAX];
+} UDPSendJob;
+
+// a client datagram parked while its domain target resolves
+typedef struct {
+  uv_getaddrinfo_t req;
+  struct sockaddr_storage client_addr;
+  unsigned short port;  // network byte order
+  char host[258];
+  int len;
+  char data[UDP_RELAY_BUFSIZ];
+} UDPResolveJob;
+
+// one relay per worker thread, same model as the pools and the DNS cache
+static __thread uv_loop_t *g_relay_loop;
+static __thread uv_udp_t g_relay_sock;
+static __thread uv_timer_t g_sweep_timer;
+static __thread HashMap g_flows;
+static __thread int g_relay_started;
+static __thread struct sockaddr_storage g_relay_addr;
+// recv scratch: datagrams are consumed inside the recv callback, so one
+// buffer per worker is enough for both the relay socket and all flows
+static __thread char g_recv_buf[UDP_RELAY_BUFSIZ + UDP_RELAY_HDR_MAX];
+
+#if defined(__linux__)
+// Batched datagram I/O: the relay sockets are opened with UV_UDP_RECVMMSG
+// and handed a multi-chunk buffer, so libuv drains them with one recvmmsg
+// per burst and delivers the datagrams as UV_UDP_MMSG_CHUNK callbacks.
+// Instead of one uv_udp_send (a malloc plus a sendmsg) per datagram, the
+// chunked callbacks park their output in a send batch that is flushed
+// with a single sendmmsg when the burst ends, amortizing both syscall
+// directions by up to the batch width.
+#define UDP_BATCH_MAX 32
+// one recvmmsg drains up to this many datagrams; libuv cuts the receive
+// buffer into 64KB chunks (its per-datagram maximum), hence the sizing
+#define UDP_MMSG_CHUNKS 8
+
+typedef struct {
+  struct mmsghdr msgs[UDP_BATCH_MAX];
+  struct iovec iovs[UDP_BATCH_MAX];
+  struct sockaddr_storage addrs[UDP_BATCH_MAX];
+  char bufs[UDP_BATCH_MAX][UDP_RELAY_BUFSIZ + UDP_RELAY_HDR_MAX];
+  uv_udp_t *sock;  // every queued datagram leaves through this socket
+  int count;
+} UDPSendBatch;
+
+static __thread UDPSendBatch g_tx_to_upstream;  // client -> targets
+static __thread UDPSendBatch g_tx_to_client;    // targets -> client
+static __thread char g_mmsg_buf[UDP_MMSG_CHUNKS * 65536];
+#endif
+
+static void client_recv_done(uv_udp_t *handle, ssize_t nread,
+    const uv_buf_t *buf, const struct sockaddr *addr, unsigned flags);
+static void upstream_recv_done(uv_udp_t *handle, ssize_t nread,
+    const uv_buf_t *buf, const struct sockaddr *addr, unsigned flags);
+
+static void flow_key(const struct sockaddr *addr, char *key) {
+  char ipstr[INET6_ADDRSTRLEN];
+  int port = 0;
+  if (addr->sa_family == AF_INET) {
+    uv_ip4_name((const struct sockaddr_in *)addr, ipstr, sizeof(ipstr));
+    port = ntohs(((const struct sockaddr_in *)addr)->sin_port);
+  } else {
+    uv_ip6_name((const struct sockaddr_in6 *)addr, ipstr, sizeof(ipstr));
+    port = ntohs(((const struct sockaddr_in6 *)addr)->sin6_port);
+  }
+  snprintf(key, UDP_FLOW_KEY_LEN, "%s:%d", ipstr, port);
+}
+
+static void flow_close_cb(uv_handle_t *handle) {
+  free(container_of(handle, UDPFlow, upstream));
+}
+
+static void flow_removed(const char *key, void *value) {
+  UDPFlow *flow = (UDPFlow *)value;
+  LOG_V("udp flow %s expired", key);
+  uv_udp_recv_stop(&flow->upstream);
+  uv_close((uv_handle_t *)&flow->upstream, flow_close_cb);
+}
+
+#if defined(__linux__)
+static void mmsg_alloc(uv_buf_t *buf) {
+  buf->base = g_mmsg_buf;
+  buf->len = sizeof(g_mmsg_buf);
+}
+#endif
+
+static void client_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
+#if defined(__linux__)
+  mmsg_alloc(buf);
+  return;
+#endif
+  buf->base = g_recv_buf;
+  buf->len = UDP_RELAY_BUFSIZ;
+}
+
+static void upstream_alloc(uv_handle_t *handle, size_t size, uv_buf_t *buf) {
+#if defined(__linux__)
+  mmsg_alloc(buf);
+  return;
+#endif
+  // leave room so the reply header can be prepended without moving data
+  buf->base = g_recv_buf + UDP_RELAY_HDR_MAX;
+  buf->len = UDP_RELAY_BUFSIZ;
+}
+
+static void send_done(uv_udp_send_t *req, int status) {
+  if (status < 0) {
+    LOG_V("udp send failed: %s", uv_strerror(status));
+  }
+  free(container_of(req, UDPSendJob, req));
+}
+
+#if defined(__linux__)
+static void udp_batch_flush(UDPSendBatch *b) {
+  if (b->count == 0) {
+    return;
+  }
+  uv_os_fd_t fd;
+  int off = 0;
+  if (uv_fileno((uv_handle_t *)b->sock, &fd) == 0) {
+    while (off < b->count) {
+      int n = sendmmsg(fd, b->msgs + off, b->count - off, 0);
+      if (n > 0) {
+        off += n;
+        continue;
+      }
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      break;  // kernel buffer full or a transient error
+    }
+  }
+  // whatever sendmmsg did not take goes out through libuv, which queues
+  // it until the socket drains
+  for (; off < b->count; ++off) {
+    UDPSendJob *job = lmalloc(sizeof(UDPSendJob));
+    int len = b->iovs[off].iov_len;
+    memcpy(job->data, b->bufs[off], len);
+    uv_buf_t wbuf = uv_buf_init(job->data, len);
+    int err;
+    if ((err = uv_udp_send(&job->req, b->sock, &wbuf, 1,
+            (struct sockaddr *)&b->addrs[off], send_done)) != 0) {
+      LOG_E("uv_udp_send failed: %s", uv_strerror(err));
+      free(job);
+    }
+  }
+  b->count = 0;
+}
+
+// reserves the next slot for a datagram to dst on sock, flushing first
+// when the batch is full or would change sockets; the caller copies the
+// payload into the returned buffer and commits the final length
+static char *udp_batch_slot(UDPSendBatch *b, uv_udp_t *sock,
+    const struct sockaddr *dst) {
+  if (b->count == UDP_BATCH_MAX || (b->count > 0 && b->sock != sock)) {
+    udp_batch_flush(b);
+  }
+  b->sock = sock;
+
+  int i = b->count++;
+  int addr_len = dst->sa_family == AF_INET ?
+      sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+  memcpy(&b->addrs[i], dst, addr_len);
+  memset(&b->msgs[i], 0, sizeof(b->msgs[i]));
+  b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+  b->msgs[i].msg_hdr.msg_namelen = addr_len;
+  b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+  b->msgs[i].msg_hdr.msg_iovlen = 1;
+  b->iovs[i].iov_base = b->bufs[i];
+  return b->bufs[i];
+}
+
+static void udp_batch_commit(UDPSendBatch *b, int len) {
+  b->iovs[b->count - 1].iov_len = len;
+}
+#endif
+
+// opens a relay socket; on Linux it is created with UV_UDP_RECVMMSG so
+// bursts drain with one recvmmsg instead of one syscall per datagram
+static int relay_udp_init(uv_loop_t *loop, uv_udp_t *handle) {
+#if defined(__linux__)
+  return uv_udp_init_ex(loop, handle, AF_UNSPEC | UV_UDP_RECVMMSG);
+#else
+  return uv_udp_init(loop, handle);
+#endif
+}
+
+static UDPFlow *flow_find_or_create(const struct sockaddr *client_addr) {
+  char key[UDP_FLOW_KEY_LEN];
+  flow_key(client_addr, key);
+
+  UDPFlow *flow = hashmap_get(&g_flows, key);
+  if (flow != NULL) {
+    flow->last_active = uv_now(g_relay_loop);
+    return flow;
+  }
+
+  flow = lmalloc(sizeof(UDPFlow));
+  memset(flow, 0, sizeof(UDPFlow));
+  memcpy(&flow->client_addr, client_addr,
+      client_addr->sa_family == AF_INET ?
+      sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6));
+  flow->last_active = uv_now(g_relay_loop);
+
+  int err;
+  if ((err = relay_udp_init(g_relay_loop, &flow->upstream)) != 0) {
+    LOG_E("uv_udp_init failed: %s", uv_strerror(err));
+    free(flow);
+    return NULL;
+  }
+  if ((err = uv_udp_recv_start(&flow->upstream, upstream_alloc,
+          upstream_recv_done)) != 0) {
+    LOG_E("uv_udp_recv_start failed: %s", uv_strerror(err));
+    uv_close((uv_handle_t *)&flow->upstream, flow_close_cb);
+    return NULL;
+  }
+
+  hashmap_put(&g_flows, key, flow);
+  LOG_V("new udp flow: %s (%d active)", key, hashmap_size(&g_flows));
+  return flow;
+}
+
+// ships one payload from a flow towards dst
+static void flow_forward(UDPFlow *flow, const char *data, int len,
+    const struct sockaddr *dst) {
+  UDPSendJob *job = lmalloc(sizeof(UDPSendJob));
+  memcpy(job->data, data, len);
+
+  uv_buf_t buf = uv_buf_init(job->data, len);
+  int err;
+  if ((err = uv_udp_send(&job->req, &flow->upstream, &buf, 1, dst,
+          send_done)) != 0) {
+    LOG_E("uv_udp_send failed: %s", uv_strerror(err));
+    free(job);
+  }
+}
+
+// routes one decapsulated client payload out through its flow; datagrams
+// arriving as part of a recvmmsg burst are batched rather than sent one
+// at a time
+static void flow_dispatch(UDPFlow *flow, const char *data, int len,
+    const struct sockaddr *dst, unsigned flags) {
+#if defined(__linux__)
+  if (flags & UV_UDP_MMSG_CHUNK) {
+    char *slot = udp_batch_slot(&g_tx_to_upstream, &flow->upstream, dst);
+    memcpy(slot, data, len);
+    udp_batch_commit(&g_tx_to_upstream, len);
+    return;
+  }
+#endif
+  flow_forward(flow, data, len, dst);
+}
+
+static void resolve_done(uv_getaddrinfo_t *req, int status,
+    struct addrinfo *res) {
+  UDPResolveJob *job = container_of(req, UDPResolveJob, req);
+
+  if (status < 0) {
+    LOG_E("getaddrinfo(\"%s\"): %s", job->host, uv_strerror(status));
+    dns_cache_put(job->host, NULL, uv_now(g_relay_loop));
+    uv_freeaddrinfo(res);
+    free(job);
+    return;
+  }
+  dns_cache_put(job->host, res, uv_now(g_relay_loop));
+
+  char ipstr[INET6_ADDRSTRLEN];
+  struct sockaddr_storage addr;
+  for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+    if (fill_ipaddr((struct sockaddr *)&addr, job->port, ipstr,
+          sizeof(ipstr), ai) != 0) {
+      continue;
+    }
+    // the flow may have been swept while the resolver ran
+    UDPFlow *flow = flow_find_or_create(
+        (const struct sockaddr *)&job->client_addr);
+    if (flow != NULL) {
+      flow_forward(flow, job->data, job->len, (struct sockaddr *)&addr);
+    }
+    break;
+  }
+
+  uv_freeaddrinfo(res);
+  free(job);
+}
+
+// datagram from a SOCKS client: strip the request header, route the
+// payload to its destination through the sender's flow
+void client_recv_done(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf,
+    const struct sockaddr *addr, unsigned flags) {
+  if (nread < 0) {
+    LOG_E("udp recv failed: %s", uv_strerror(nread));
+    return;
+  }
+  if (nread == 0 || addr == NULL || (flags & UV_UDP_PARTIAL)) {
+#if defined(__linux__)
+    // end of a recvmmsg burst: everything queued during it leaves in one
+    // sendmmsg
+    if (flags & UV_UDP_MMSG_FREE) {
+      udp_batch_flush(&g_tx_to_upstream);
+    }
+#endif
+    return;
+  }
+
+  Socks5Ctx s5_ctx;
+  memset(&s5_ctx, 0, sizeof(s5_ctx));
+  if (socks5_parse_udp_request(&s5_ctx, buf->base, nread) != S5_OK) {
+    LOG_V("malformed udp request, dgram dropped");
+    return;
+  }
+
+  int hdr_len = 4 + 2;
+  if (s5_ctx.atyp == S5_ATYP_IPV4) {
+    hdr_len += 4;
+  } else if (s5_ctx.atyp == S5_ATYP_IPV6) {
+    hdr_len += 16;
+  } else {
+    hdr_len += 1 + strlen((const char *)s5_ctx.dst_addr);
+  }
+  if (nread <= hdr_len) {
+    return;  // header only, nothing to relay
+  }
+  const char *payload = buf->base + hdr_len;
+  int payload_len = nread - hdr_len;
+  if (payload_len > UDP_RELAY_BUFSIZ) {
+    return;  // beyond the relay buffer class, dropped like a truncated dgram
+  }
+
+  if (s5_ctx.atyp == S5_ATYP_DOMAIN) {
+    struct sockaddr_storage cached_addr;
+    DNSCacheResult cache_result = dns_cache_get((const char *)s5_ctx.dst_addr,
+        htons(s5_ctx.dst_port), &cached_addr, uv_now(g_relay_loop));
+    if (cache_result == DNS_CACHE_NEGATIVE_HIT) {
+      return;
+    }
+    if (cache_result == DNS_CACHE_HIT) {
+      UDPFlow *flow = flow_find_or_create(addr);
+      if (flow != NULL) {
+        flow_dispatch(flow, payload, payload_len,
+            (struct sockaddr *)&cached_addr, flags);
+      }
+      return;
+    }
+
+    // park the datagram until the name resolves
+    UDPResolveJob *job = lmalloc(sizeof(UDPResolveJob));
+    memcpy(&job->client_addr, addr,
+        addr->sa_family == AF_INET ?
+        sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6));
+    job->port = htons(s5_ctx.dst_port);
+    snprintf(job->host, sizeof(job->host), "%s",
+        (const char *)s5_ctx.dst_addr);
+    job->len = payload_len;
+    memcpy(job->data, payload, payload_len);
+
+    struct addrinfo hint;
+    memset(&hint, 0, sizeof(hint));
+    hint.ai_family = AF_UNSPEC;
+    hint.ai_socktype = SOCK_DGRAM;
+    hint.ai_protocol = IPPROTO_UDP;
+
+    int err;
+    if ((err = uv_getaddrinfo(g_relay_loop, &job->req, resolve_done,
+            job->host, NULL, &hint)) < 0) {
+      LOG_E("uv_getaddrinfo failed: %s, err: %s", job->host,
+          uv_strerror(err));
+      free(job);
+    }
+    return;
+  }
+
+  struct sockaddr_storage dst;
+  if (s5_ctx.atyp == S5_ATYP_IPV4) {
+    struct sockaddr_in *dst4 = (struct sockaddr_in *)&dst;
+    dst4->sin_family = AF_INET;
+    dst4->sin_port = htons(s5_ctx.dst_port);
+    memcpy(&dst4->sin_addr.s_addr, s5_ctx.dst_addr, 4);
+  } else {
+    struct sockaddr_in6 *dst6 = (struct sockaddr_in6 *)&dst;
+    dst6->sin6_family = AF_INET6;
+    dst6->sin6_port = htons(s5_ctx.dst_port);
+    memcpy(dst6->sin6_addr.s6_addr, s5_ctx.dst_addr, 16);
+  }
+
+  UDPFlow *flow = flow_find_or_create(addr);
+  if (flow != NULL) {
+    flow_dispatch(flow, payload, payload_len, (struct sockaddr *)&dst, flags);
+  }
+}
+
+// writes the SOCKS5 UDP reply header (RSV+FRAG+ATYP+addr+port) for the
+// target addr into data, returns the header length
+static int reply_hdr(char *data, const struct sockaddr *addr) {
+  data[0] = 0;  // RSV
+  data[1] = 0;  // RSV
+  data[2] = 0;  // FRAG
+  if (addr->sa_family == AF_INET) {
+    data[3] = S5_ATYP_IPV4;
+    memcpy(&data[4], &((const struct sockaddr_in *)addr)->sin_addr.s_addr, 4);
+    memcpy(&data[8], &((const struct sockaddr_in *)addr)->sin_port, 2);
+    return 10;
+  }
+  data[3] = S5_ATYP_IPV6;
+  memcpy(&data[4],
+      ((const struct sockaddr_in6 *)addr)->sin6_addr.s6_addr, 16);
+  memcpy(&data[20], &((const struct sockaddr_in6 *)addr)->sin6_port, 2);
+  return 22;
+}
+
+// reply from a target: wrap it in a SOCKS5 UDP header and hand it back to
+// the client that owns this flow
+void upstream_recv_done(uv_udp_t *handle, ssize_t nread, const uv_buf_t *buf,
+    const struct sockaddr *addr, unsigned flags) {
+  if (nread < 0) {
+    LOG_E("udp recv failed: %s", uv_strerror(nread));
+    return;
+  }
+  if (nread == 0 || addr == NULL || (flags & UV_UDP_PARTIAL)) {
+#if defined(__linux__)
+    if (flags & UV_UDP_MMSG_FREE) {
+      udp_batch_flush(&g_tx_to_client);
+    }
+#endif
+    return;
+  }
+  if (nread > UDP_RELAY_BUFSIZ) {
+    return;  // beyond the relay buffer class, dropped like a truncated dgram
+  }
+
+  UDPFlow *flow = container_of(handle, UDPFlow, upstream);
+  flow->last_active = uv_now(g_relay_loop);
+
+#if defined(__linux__)
+  if (flags & UV_UDP_MMSG_CHUNK) {
+    char *data = udp_batch_slot(&g_tx_to_client, &g_relay_sock,
+        (struct sockaddr *)&flow->client_addr);
+    int hdr_len = reply_hdr(data, addr);
+    memcpy(data + hdr_len, buf->base, nread);
+    udp_batch_commit(&g_tx_to_client, hdr_len + nread);
+    return;
+  }
+#endif
+
+  UDPSendJob *job = lmalloc(sizeof(UDPSendJob));
+  char *data = job->data;
+  int hdr_len = reply_hdr(data, addr);
+  memcpy(data + hdr_len, buf->base, nread);
+
+  uv_buf_t wbuf = uv_buf_init(data, hdr_len + nread);
+  int err;
+  if ((err = uv_udp_send(&job->req, &g_relay_sock, &wbuf, 1,
+          (struct sockaddr *)&flow->client_addr, send_done)) != 0) {
+    LOG_E("uv_udp_send failed: %s", uv_strerror(err));
+    free(job);
+  }
+}
+
+static void sweep_cb(uv_timer_t *timer) {
+  uint64_t now = uv_now(g_relay_loop);
+  const char *expired[UDP_SWEEP_BATCH];
+  int n = 0;
+
+  KeyIterator it = hashmap_key_iterator(&g_flows);
+  const char *key;
+  while (n < UDP_SWEEP_BATCH &&
+      (key = hashmap_next_key(&g_flows, &it)) != NULL) {
+    UDPFlow *flow = hashmap_get(&g_flows, key);
+    if (now - flow->last_active >= UDP_FLOW_TTL) {
+      expired[n++] = key;
+    }
+  }
+  for (int i = 0; i < n; ++i) {
+    hashmap_remove(&g_flows, expired[i]);
+  }
+  if (n > 0) {
+    LOG_V("udp sweep reclaimed %d flows, %d left", n,
+        hashmap_size(&g_flows));
+  }
+}
+
+int udp_relay_start(uv_loop_t *loop, const struct sockaddr *bind_addr,
+    struct sockaddr_storage *out_addr) {
+  if (!g_relay_started) {
+    int err;
+    g_relay_loop = loop;
+    hashmap_init(&g_flows, flow_removed);
+
+    if ((err = relay_udp_init(loop, &g_relay_sock)) != 0 ||
+        (err = uv_udp_bind(&g_relay_sock, bind_addr, UV_UDP_REUSEADDR)) != 0 ||
+        (err = uv_udp_getsockname(&g_relay_sock,
+            (struct sockaddr *)&g_relay_addr,
+            (int []){ sizeof(g_relay_addr) })) != 0 ||
+        (err = uv_udp_recv_start(&g_relay_sock, client_alloc,
+            client_recv_done)) != 0) {
+      LOG_E("udp relay setup failed: %s", uv_strerror(err));
+      return err;
+    }
+
+    uv_timer_init(loop, &g_sweep_timer);
+    uv_timer_start(&g_sweep_timer, sweep_cb, UDP_SWEEP_INTERVAL,
+        UDP_SWEEP_INTERVAL);
+
+    g_relay_started = 1;
+    LOG_I("udp relay listening, one socket per worker");
+  }
+
+  if (out_addr != NULL) {
+    *out_addr = g_relay_addr;
+  }
+  return 0;
+}
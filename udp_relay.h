@@ -0,0 +1,25 @@
+#ifndef UDP_RELAY_H_
+#define UDP_RELAY_H_
+#include <uv.h>
+
+// Shared per-worker UDP relay. Instead of three uv_udp_t handles and three
+// buffers per UDP ASSOCIATE, every worker thread runs a single relay socket
+// and keeps a flow table keyed by the client address. Flows hold one
+// upstream socket each and are expired by a periodic LRU sweep, so idle
+// associates (DNS-over-SOCKS is the usual offender) no longer pin fds and
+// session memory until their TCP control channel dies.
+
+// largest datagram payload the relay will carry
+#define UDP_RELAY_BUFSIZ 4096
+// how long a flow may stay idle before the sweep reclaims it
+#define UDP_FLOW_TTL (60 * 1000)
+#define UDP_SWEEP_INTERVAL (10 * 1000)
+
+// Starts the calling worker's relay if it is not running yet (idempotent),
+// binding to bind_addr (port 0 picks an ephemeral one). On success the
+// fully resolved address the relay listens on is stored in *out_addr for
+// the UDP ASSOCIATE reply. Returns 0 or a libuv error code.
+int udp_relay_start(uv_loop_t *loop, const struct sockaddr *bind_addr,
+    struct sockaddr_storage *out_addr);
+
+#endif /* end of include guard: UDP_RELAY_H_ */
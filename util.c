@@ -3,6 +3,7 @@
 #include <pwd.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include "log/log.h"
 
 void log_ipv4_and_port(void *ipv4, int port, const char *msg) {
@@ -98,6 +99,51 @@ int do_setuid(const char *user) {
   return 0;
 }
 
+// used by the multi-worker mode: every worker loop binds its own listening
+// socket on the same address so the kernel can spread accepted connections
+// across the worker loops
+int tcp_bind_reuseport(uv_loop_t *loop, uv_tcp_t *tcp,
+    const struct sockaddr *addr, int backlog, uv_connection_cb on_connection) {
+  int err;
+  if ((err = uv_tcp_init(loop, tcp)) != 0) {
+    LOG_E("uv_tcp_init failed: %s", uv_strerror(err));
+    return err;
+  }
+
+#ifdef SO_REUSEPORT
+  uv_os_sock_t fd = socket(addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
+  if (fd < 0) {
+    LOG_E("socket failed: %s", strerror(errno));
+    return UV_ENOMEM;
+  }
+
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) {
+    LOG_W("setting SO_REUSEPORT failed: %s", strerror(errno));
+  }
+  // libuv marks its own sockets close-on-exec but not ones we hand it; a
+  // graceful restart's exec'd process must not inherit this listener, or
+  // closing it in the old process would leave a dead copy still accepting
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  if ((err = uv_tcp_open(tcp, fd)) != 0) {
+    LOG_E("uv_tcp_open failed: %s", uv_strerror(err));
+    close(fd);
+    return err;
+  }
+#else
+  LOG_W("SO_REUSEPORT is not available on this platform");
+#endif
+
+  if ((err = uv_tcp_bind(tcp, addr, 0)) != 0) {
+    LOG_E("uv_tcp_bind failed: %s", uv_strerror(err));
+    return err;
+  }
+
+  return uv_listen((uv_stream_t *)tcp, backlog, on_connection);
+}
+
 void redirect_stderr_to_file(const char *log_file) {
   FILE *old_stderr = stderr;
   stderr = fopen(log_file, "w");
@@ -105,4 +151,7 @@ void redirect_stderr_to_file(const char *log_file) {
     fprintf(old_stderr, "failed to open log file: %s", log_file);
     exit(1);
   }
+  // when logging to a file, take the formatting and the write out of the
+  // event-loop callbacks (see log/log.c)
+  log_async_start();
 }
@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include <netdb.h>
+#include <uv.h>
 
 #define container_of(ptr, type, field) \
   ((type *) ((char *) (ptr) - ((char *) &((type *) 0)->field)))
@@ -27,5 +28,7 @@ int is_ipv6_addr_any(const char *ip);
 int is_ipv6_addr_local(const char *ip);
 int do_setuid(const char *user);
 void redirect_stderr_to_file(const char *log_file);
+int tcp_bind_reuseport(uv_loop_t *loop, uv_tcp_t *tcp,
+    const struct sockaddr *addr, int backlog, uv_connection_cb on_connection);
 
 #endif /* end of include guard: UTIL_H_ */